@@ -0,0 +1,129 @@
+#include "AsyncQueue.h"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "Statistics.h"
+
+AsyncQueue::AsyncQueue(DatabaseEngine *engine)
+    : m_engine(engine)
+    , m_isStopped(false)
+{
+    m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventFd == -1) {
+	throw std::string("Can't create event fd of async queue");
+    }
+    m_worker = std::thread(&AsyncQueue::workerLoop, this);
+}
+
+AsyncQueue::~AsyncQueue()
+{
+    {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_isStopped = true;
+    }
+    m_hasRequests.notify_all();
+    m_worker.join();
+
+    for (Completion &completion : m_completions) {
+	delete[] completion.value.data;
+    }
+    ::close(m_eventFd);
+}
+
+DatabaseEngine *AsyncQueue::engine() const
+{
+    return m_engine;
+}
+
+int AsyncQueue::eventFd() const
+{
+    return m_eventFd;
+}
+
+void AsyncQueue::submit(Request &request)
+{
+    {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_requests.push_back(Request());
+	Request &queued = m_requests.back();
+	queued.type = request.type;
+	queued.keyspace = request.keyspace;
+	queued.key.swap(request.key);
+	queued.value.swap(request.value);
+	queued.userData = request.userData;
+    }
+    m_hasRequests.notify_one();
+}
+
+size_t AsyncQueue::poll(Completion *completions, size_t maxCount)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t count = 0;
+    while (count < maxCount && !m_completions.empty()) {
+	completions[count++] = m_completions.front();
+	m_completions.pop_front();
+    }
+    if (m_completions.empty()) {
+	uint64_t counter;
+	::read(m_eventFd, &counter, sizeof(counter)); // fd isn't readable until next completion
+    }
+    return count;
+}
+
+void AsyncQueue::workerLoop()
+{
+    while (true) {
+	Request request;
+	{
+	    std::unique_lock<std::mutex> lock(m_mutex);
+	    m_hasRequests.wait(lock, [this]() { return m_isStopped || !m_requests.empty(); });
+	    if (m_requests.empty()) {
+		return; // stopped and every request is done
+	    }
+	    request = m_requests.front();
+	    m_requests.pop_front();
+	}
+
+	Completion completion;
+	completion.type = request.type;
+	completion.status = 0;
+	completion.value = DatabaseNode::Record(0, nullptr);
+	completion.userData = request.userData;
+	execute(request, completion);
+	complete(completion);
+    }
+}
+
+void AsyncQueue::execute(const Request &request, Completion &completion)
+{
+    DatabaseNode::Record key(request.key.size(), const_cast<char *>(request.key.data()));
+    try {
+	m_engine->useKeyspace(request.keyspace);
+	if (request.type == GET) {
+	    ScopedLatency latency(m_engine->statistics().selectLatency);
+	    m_engine->select(key, completion.value);
+	} else if (request.type == PUT) {
+	    ScopedLatency latency(m_engine->statistics().insertLatency);
+	    m_engine->insert(key, DatabaseNode::Record(request.value.size(), const_cast<char *>(request.value.data())));
+	} else {
+	    ScopedLatency latency(m_engine->statistics().deleteLatency);
+	    m_engine->remove(key);
+	}
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	completion.status = 1;
+    }
+}
+
+void AsyncQueue::complete(const Completion &completion)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_completions.push_back(completion);
+    uint64_t one = 1;
+    ::write(m_eventFd, &one, sizeof(one));
+}
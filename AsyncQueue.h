@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "DatabaseEngine.h"
+#include "DatabaseNode.h"
+
+/// Requests submitted without waiting, done by worker thread in submit order.
+/// Finished requests are collected from completion queue, event fd is
+/// readable while completion queue isn't empty.
+/// Engine isn't thread-safe, so one worker is all it can use
+class AsyncQueue
+{
+public:
+    enum RequestType {
+	GET,
+	PUT,
+	DEL
+    };
+
+    struct Request
+    {
+	RequestType type;
+	size_t keyspace;
+	std::string key;
+	std::string value;
+	void *userData;
+    };
+
+    struct Completion
+    {
+	RequestType type;
+	/// 0 on success, 1 on error
+	int status;
+	/// Found value of GET, data is nullptr when key is absent
+	DatabaseNode::Record value;
+	void *userData;
+    };
+
+    AsyncQueue(DatabaseEngine *engine);
+    /// Waits for submitted requests, undelivered completions are dropped
+    ~AsyncQueue();
+
+    DatabaseEngine *engine() const;
+    int eventFd() const;
+
+    void submit(Request &request);
+    /// Moves at most maxCount completions to completions, returns their count
+    size_t poll(Completion *completions, size_t maxCount);
+
+private:
+    DatabaseEngine *m_engine;
+    int m_eventFd;
+    std::thread m_worker;
+
+    /// Guards requests, completions and stop flag
+    std::mutex m_mutex;
+    std::condition_variable m_hasRequests;
+    std::deque<Request> m_requests;
+    std::deque<Completion> m_completions;
+    bool m_isStopped;
+
+    void workerLoop();
+    void execute(const Request &request, Completion &completion);
+    void complete(const Completion &completion);
+
+    AsyncQueue(const AsyncQueue &);
+    void operator=(const AsyncQueue &);
+};
@@ -7,6 +7,7 @@
 
 Bitset::Bitset()
     : m_isInitialised(false)
+    , m_rw(nullptr)
 {
 }
 
@@ -50,6 +51,8 @@ void Bitset::initialize(
 
     m_mask = new char[maskSize()];
     memset(m_mask, 0, maskSize());
+    m_isIndexPageDirty.assign(indexPageCount(), true);
+    m_isIndexPageLoaded.assign(indexPageCount(), true);
 
     for (const size_t &i : preallocatedPagesNum) {
         set(i, true);
@@ -70,6 +73,7 @@ bool Bitset::get(const size_t &pos) const
         throw std::string("Invalid bitset position");
     }
 
+    loadIndexPage(pos / 8 / m_globConf->pageSize());
     return (m_mask[pos / 8] >> (pos % 8)) & 1;
 }
 
@@ -83,11 +87,13 @@ void Bitset::set(const size_t &pos, bool value)
         throw std::string("Invalid bitset position");
     }
 
+    loadIndexPage(pos / 8 / m_globConf->pageSize());
     if (value) {
         m_mask[pos / 8] |= (1 << (pos % 8));
     } else {
         m_mask[pos / 8] &= ~(1 << (pos % 8));
     }
+    m_isIndexPageDirty[pos / 8 / m_globConf->pageSize()] = true;
 }
 
 size_t Bitset::freePageNumber() const
@@ -105,6 +111,21 @@ size_t Bitset::freePageNumber() const
     throw std::string("There is no free pages");
 }
 
+size_t Bitset::lastUsedPageNumber() const
+{
+    if (!m_isInitialised) {
+        throw std::string("Bitset isn't initialised");
+    }
+
+    for (size_t i = m_globConf->pageCount(); i > 0; i--) {
+        if (get(i - 1)) {
+            return i - 1;
+        }
+    }
+
+    throw std::string("There is no used pages");
+}
+
 void Bitset::read(GlobalConfiguration *_globConf, Page &headerPage, PageReadWriter &rw)
 {
     if (m_isInitialised) {
@@ -120,25 +141,45 @@ void Bitset::read(GlobalConfiguration *_globConf, Page &headerPage, PageReadWrit
     headerPage.read(&m_indexStartingPage, sizeof(m_indexStartingPage));
 
     m_mask = new char[maskSize()];
+    m_isIndexPageDirty.assign(indexPageCount(), false);
+    m_isIndexPageLoaded.assign(indexPageCount(), false);
+    m_rw = &rw;
+}
 
-    for (size_t i = 0; i < indexPageCount(); i++) {
-        Page curPage(i + m_indexStartingPage, m_globConf->pageSize());
-        rw.read(curPage);
-        curPage.read(m_mask + i * m_globConf->pageSize(), m_globConf->pageSize());
+void Bitset::loadIndexPage(size_t index) const
+{
+    if (m_isIndexPageLoaded[index]) {
+        return;
     }
+    Page curPage(index + m_indexStartingPage, m_globConf->pageSize());
+    m_rw->read(curPage);
+    curPage.read(m_mask + index * m_globConf->pageSize(), m_globConf->pageSize());
+    m_isIndexPageLoaded[index] = true;
 }
 
-void Bitset::write(Page &headerPage, PageReadWriter &rw) const
+void Bitset::write(Page &headerPage, PageReadWriter &rw)
 {
     if (!m_isInitialised) {
         throw std::string("Bitset isn't initialised");
     }
 
     headerPage.write(&m_indexStartingPage, sizeof(m_indexStartingPage));
+    writeIndex(rw);
+}
+
+void Bitset::writeIndex(PageReadWriter &rw)
+{
+    if (!m_isInitialised) {
+        throw std::string("Bitset isn't initialised");
+    }
 
     for (size_t i = 0; i < indexPageCount(); i++) {
+        if (!m_isIndexPageDirty[i]) {
+            continue;
+        }
         Page curPage(i + m_indexStartingPage, m_globConf->pageSize());
         curPage.write(m_mask + i * m_globConf->pageSize(), m_globConf->pageSize());
         rw.write(curPage);
+        m_isIndexPageDirty[i] = false;
     }
 }
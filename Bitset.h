@@ -16,9 +16,15 @@ public:
 
     bool get(const size_t &pos) const;
     void set(const size_t &pos, bool value);
+    /// Index pages are read from rw on first access, so open doesn't
+    /// depend on file size. rw has to outlive bitset
     void read(GlobalConfiguration *globConf, Page &headerPage, PageReadWriter &rw);
-    void write(Page &headerPage, PageReadWriter &rw) const;
+    /// Writes index start to header and index pages changed since previous write
+    void write(Page &headerPage, PageReadWriter &rw);
+    /// Writes index pages changed since previous write, header isn't touched
+    void writeIndex(PageReadWriter &rw);
     size_t freePageNumber() const;
+    size_t lastUsedPageNumber() const;
 
 private:
     bool m_isInitialised;
@@ -26,9 +32,13 @@ private:
 
     char *m_mask;
     size_t m_indexStartingPage;
+    std::vector<bool> m_isIndexPageDirty;
+    PageReadWriter *m_rw;
+    mutable std::vector<bool> m_isIndexPageLoaded;
 
     size_t maskSize() const;
     size_t indexPageCount() const;
+    void loadIndexPage(size_t index) const;
 
     Bitset(const Bitset &) { }
     void operator=(const Bitset &) { }
@@ -5,8 +5,11 @@
 #include <algorithm>
 #include <string>
 
+#include <cstdio>
+
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 const char CachedPageReadWriter::LOG_ACTION_CHANGE[CachedPageReadWriter::LOG_ACTION_SIZE] = "CHANGE_";
 const char CachedPageReadWriter::LOG_ACTION_DB_OPEN[CachedPageReadWriter::LOG_ACTION_SIZE] = "DB_OPEN";
@@ -14,23 +17,43 @@ const char CachedPageReadWriter::LOG_ACTION_DB_CLOSE[CachedPageReadWriter::LOG_A
 const char CachedPageReadWriter::LOG_ACTION_CHECKPOINT[CachedPageReadWriter::LOG_ACTION_SIZE] = "CHCKPNT";
 const char CachedPageReadWriter::LOG_ACTION_INSERT[CachedPageReadWriter::LOG_ACTION_SIZE] = "INSERT_";
 const char CachedPageReadWriter::LOG_ACTION_DELETE[CachedPageReadWriter::LOG_ACTION_SIZE] = "DELETE_";
+const char CachedPageReadWriter::LOG_ACTION_UPSERT[CachedPageReadWriter::LOG_ACTION_SIZE] = "UPSERT_";
 const char CachedPageReadWriter::LOG_ACTION_COMMIT[CachedPageReadWriter::LOG_ACTION_SIZE] = "COMMIT_";
+const char CachedPageReadWriter::LOG_ACTION_BATCH[CachedPageReadWriter::LOG_ACTION_SIZE] = "BATCH__";
+const char CachedPageReadWriter::LOG_ACTION_ROOT[CachedPageReadWriter::LOG_ACTION_SIZE] = "ROOT___";
 const char CachedPageReadWriter::LOG_SEEK_DELIM[CachedPageReadWriter::LOG_SEEK_DELIM_SIZE] = {'|'};
 
-CachedPageReadWriter::CachedPageReadWriter(PageReadWriter *source, GlobalConfiguration *globConf)
+CachedPageReadWriter::CachedPageReadWriter(
+    PageReadWriter *source,
+    GlobalConfiguration *globConf,
+    Statistics *stats,
+    MemoryBudget *budget)
     : m_globConf(globConf)
+    , m_stats(stats)
+    , m_budget(budget)
     , m_source(source)
+    , m_logFd(-1)
+    , m_hasJournal(*globConf->journalPath() != '\0')
+    , m_isReadOnly(source->isReadOnly())
+    , m_isClosed(false)
     , m_writesCounter(0)
     , m_inOperation(false)
+    , m_inBatch(false)
+    , m_batchOffset(0)
+    , m_isCopyOnWrite(false)
     , m_pendingOperation(NONE)
     , m_pendingKey(0, nullptr)
     , m_pendingValue(0, nullptr)
+    , m_pendingKeyspace(0)
+    , m_nextSnapshotId(1)
 {
     if (m_globConf->cacheSize() % m_globConf->pageSize()) {
+	delete m_source;
 	throw std::string("Page size should divide cache size.");
     }
 
     size_t cacheCells = m_globConf->cacheSize() / m_globConf->pageSize();
+    m_cellLimit = cacheCells;
     m_cache.assign(cacheCells, nullptr);
     m_isDirty.assign(cacheCells, false);
     for (size_t i = 0; i < cacheCells; i++) {
@@ -39,73 +62,165 @@ CachedPageReadWriter::CachedPageReadWriter(PageReadWriter *source, GlobalConfigu
     // m_posInCache already empty
     // m_pinnedCells already empty
 
-    bool noJournalBefore = access(globConf->journalPath(), F_OK) == -1;
-    m_logFd = open(globConf->journalPath(), O_RDWR | O_CREAT, 0666);
-    if (noJournalBefore) {
+    try {
+	if (m_hasJournal && m_isReadOnly) {
+	    // Nothing to redo, so journal isn't opened at all
+	    checkJournalClosed();
+	    m_hasJournal = false;
+	} else if (m_hasJournal) {
+	    openJournal();
+	}
+    } catch (std::string err) {
+	// Destructor doesn't run for object which failed to construct
+	if (m_logFd != -1) {
+	    ::close(m_logFd);
+	}
+	delete m_source;
+	throw;
+    }
+}
+
+void CachedPageReadWriter::checkJournalClosed() const
+{
+    int fd = open(m_globConf->journalPath(), O_RDONLY);
+    if (fd == -1) {
+	return; // fresh journal would be empty too
+    }
+    size_t recordSize = LOG_ACTION_SIZE + sizeof(size_t) + m_globConf->pageSize();
+    off_t end = lseek(fd, 0, SEEK_END);
+    end -= end % recordSize;
+    char recordType[LOG_ACTION_SIZE];
+    bool isClosed = end >= static_cast<off_t>(recordSize)
+	&& pread(fd, recordType, LOG_ACTION_SIZE, end - recordSize) == LOG_ACTION_SIZE
+	&& !strcmp(recordType, LOG_ACTION_DB_CLOSE);
+    ::close(fd);
+    if (!isClosed) {
+	throw std::string("Database wasn't closed cleanly, open it for writing to recover it");
+    }
+}
+
+void CachedPageReadWriter::openJournal()
+{
+    // Journal left by removed database file doesn't belong to new one
+    bool noJournalBefore = access(m_globConf->journalPath(), F_OK) == -1 || !m_globConf->isReadedFromFile();
+    m_logFd = open(m_globConf->journalPath(), O_RDWR | O_CREAT | (noJournalBefore ? O_TRUNC : 0), 0666);
+    if (m_logFd == -1) {
+	throw std::string("Error opening journal");
+    }
+    size_t recordSize = LOG_ACTION_SIZE + sizeof(size_t) + m_globConf->pageSize();
+    // Record cut by crash is dropped, records behind it would be misaligned
+    off_t end = lseek(m_logFd, 0, SEEK_END);
+    if (end % recordSize) {
+	end -= end % recordSize;
+	if (ftruncate(m_logFd, end) == -1) {
+	    throw std::string("Error truncating journal");
+	}
+	lseek(m_logFd, end, SEEK_SET);
+    }
+    // Journal is emptied only after pages reached file, nothing to redo
+    if (noJournalBefore || end == 0) {
 	::write(m_logFd, LOG_ACTION_CHECKPOINT, LOG_ACTION_SIZE);
 	writeLogStumb(LOG_ACTION_SIZE);
     } else {
-	size_t recordSize = LOG_ACTION_SIZE + sizeof(size_t) + m_globConf->pageSize();
-	lseek(m_logFd, 0, SEEK_END);
 	char recordType[LOG_ACTION_SIZE];
 	bool isLastOperationFinished = true;
 	bool hasSeenOperationEnd = false;
-	off_t lastOperationOffset;
+	off_t lastOperationOffset = -1;
+	std::vector<LoggedOperation> unfinished; // newest first
+	bool isBatch = false;
 	do {
 	    off_t curOffset = lseek(m_logFd, -static_cast<off_t>(recordSize), SEEK_CUR);
+	    if (curOffset == -1) {
+		throw std::string("Journal has no checkpoint");
+	    }
 	    ::read(m_logFd, recordType, LOG_ACTION_SIZE);
 
 	    if (!strcmp(recordType, LOG_ACTION_COMMIT)) {
 		hasSeenOperationEnd = true;
 	    }
 
-	    if (!strcmp(recordType, LOG_ACTION_INSERT) || !strcmp(recordType, LOG_ACTION_DELETE)) {
-		if (!hasSeenOperationEnd) {
-		    isLastOperationFinished = false;
-		    lastOperationOffset = curOffset;
-
-		    if (!strcmp(recordType, LOG_ACTION_INSERT)) {
-			m_pendingOperation = INSERT;
-
-			::read(m_logFd, &(m_pendingKey.size), sizeof(m_pendingKey.size));
-			m_pendingKey.data = new char[m_pendingKey.size];
-			::read(m_logFd, m_pendingKey.data, m_pendingKey.size);
-
-			::read(m_logFd, &(m_pendingValue.size), sizeof(m_pendingValue.size));
-			m_pendingValue.data = new char[m_pendingValue.size];
-			::read(m_logFd, m_pendingValue.data, m_pendingValue.size);
-		    } else {
-			m_pendingOperation = DELETE;
-
-			::read(m_logFd, &(m_pendingKey.size), sizeof(m_pendingKey.size));
-			m_pendingKey.data = new char[m_pendingKey.size];
-			::read(m_logFd, m_pendingKey.data, m_pendingKey.size);
-		    }
-		}
+	    if (!hasSeenOperationEnd && isOperationRecord(recordType)) {
+		isLastOperationFinished = false;
+		lastOperationOffset = curOffset;
+		LoggedOperation op;
+		readOperationRecord(recordType, op);
+		unfinished.push_back(op);
+	    } else if (!hasSeenOperationEnd && !strcmp(recordType, LOG_ACTION_BATCH)) {
+		isLastOperationFinished = false;
+		lastOperationOffset = curOffset;
+		isBatch = true;
 	    }
 
 	    lseek(m_logFd, curOffset, SEEK_SET);
 	} while (strcmp(recordType, LOG_ACTION_CHECKPOINT));
+
+	// Batch which didn't commit is dropped as a whole, it isn't redone
+	if (!isBatch && !unfinished.empty()) {
+	    const LoggedOperation &op = unfinished.back();
+	    m_pendingOperation = op.type;
+	    m_pendingKey = DatabaseNode::Record(op.key.size(), new char[op.key.size()]);
+	    memcpy(m_pendingKey.data, op.key.data(), op.key.size());
+	    if (op.type != DELETE) {
+		m_pendingValue = DatabaseNode::Record(op.value.size(), new char[op.value.size()]);
+		memcpy(m_pendingValue.data, op.value.data(), op.value.size());
+	    }
+	    m_pendingKeyspace = op.keyspace;
+	}
+
 	// Now pointing begin of check point, lets skip it
 	lseek(m_logFd, recordSize, SEEK_CUR);
+	std::vector<LoggedOperation> uncommitted;
+	bool isHeaderChanged = false;
 	while (::read(m_logFd, recordType, LOG_ACTION_SIZE) == LOG_ACTION_SIZE) {
 	    off_t curOffset = lseek(m_logFd, 0, SEEK_CUR);
-	    if (!strcmp(recordType, LOG_ACTION_CHANGE)) {
+	    if (!isLastOperationFinished && curOffset - static_cast<off_t>(LOG_ACTION_SIZE) == lastOperationOffset) {
+		// Changes of unfinished operation are dropped, it is redone from scratch.
+		// Header may have got its roots with pages it allocated, old roots are put back
+		std::set<size_t> restored;
+		do {
+		    off_t recordOffset = lseek(m_logFd, 0, SEEK_CUR) - LOG_ACTION_SIZE;
+		    if (!strcmp(recordType, LOG_ACTION_ROOT)) {
+			size_t root[3]; // keyspace, old root, new root
+			::read(m_logFd, root, sizeof(root));
+			if (restored.insert(root[0]).second) {
+			    m_globConf->setKeyspaceRoot(root[0], root[1]);
+			    isHeaderChanged = true;
+			}
+		    }
+		    lseek(m_logFd, recordOffset + recordSize, SEEK_SET);
+		} while (::read(m_logFd, recordType, LOG_ACTION_SIZE) == LOG_ACTION_SIZE);
+		ftruncate(m_logFd, lastOperationOffset);
+		break;
+	    } else if (!strcmp(recordType, LOG_ACTION_ROOT)) {
+		size_t root[3];
+		::read(m_logFd, root, sizeof(root));
+		m_globConf->setKeyspaceRoot(root[0], root[2]);
+		isHeaderChanged = true;
+		lseek(m_logFd, curOffset + recordSize - LOG_ACTION_SIZE, SEEK_SET);
+	    } else if (!strcmp(recordType, LOG_ACTION_CHANGE)) {
 		size_t pageNumber;
 		::read(m_logFd, &pageNumber, sizeof(pageNumber));
 		Page p(pageNumber, m_globConf->pageSize());
 		::read(m_logFd, p.rawData(), m_globConf->pageSize());
 
 		m_source->write(p);
-	    } else if (!isLastOperationFinished && !strcmp(recordType, LOG_ACTION_INSERT)
-		    && !strcmp(recordType, LOG_ACTION_DELETE) && curOffset == lastOperationOffset) {
-		// we don't need to restore anything below, lets delete it
-		ftruncate(m_logFd, curOffset);
-		break;
+	    } else if (isOperationRecord(recordType)) {
+		LoggedOperation op;
+		readOperationRecord(recordType, op);
+		uncommitted.push_back(op);
+		lseek(m_logFd, curOffset + recordSize - LOG_ACTION_SIZE, SEEK_SET);
+	    } else if (!strcmp(recordType, LOG_ACTION_COMMIT)) {
+		m_budget->charge(MemoryBudget::OPERATION_BUFFERS, operationsSize(uncommitted));
+		m_committedOperations.insert(m_committedOperations.end(), uncommitted.begin(), uncommitted.end());
+		uncommitted.clear();
+		lseek(m_logFd, recordSize - LOG_ACTION_SIZE, SEEK_CUR);
 	    } else {
 		lseek(m_logFd, recordSize - LOG_ACTION_SIZE, SEEK_CUR); // skip this entry
 	    }
 	}
+	if (isHeaderChanged) {
+	    m_source->flush();
+	}
     }
 
     lseek(m_logFd, 0, SEEK_END);
@@ -113,71 +228,351 @@ CachedPageReadWriter::CachedPageReadWriter(PageReadWriter *source, GlobalConfigu
     writeLogStumb(LOG_ACTION_SIZE);
 }
 
-CachedPageReadWriter::~CachedPageReadWriter()
+bool CachedPageReadWriter::isOperationRecord(const char *recordType)
 {
-    close();
+    return !strcmp(recordType, LOG_ACTION_INSERT) || !strcmp(recordType, LOG_ACTION_DELETE)
+	|| !strcmp(recordType, LOG_ACTION_UPSERT);
+}
+
+void CachedPageReadWriter::readOperationRecord(const char *recordType, LoggedOperation &op)
+{
+    op.type = !strcmp(recordType, LOG_ACTION_INSERT) ? INSERT
+	: !strcmp(recordType, LOG_ACTION_DELETE) ? DELETE : UPSERT;
+    size_t size;
+    ::read(m_logFd, &size, sizeof(size));
+    op.key.resize(size);
+    ::read(m_logFd, &op.key[0], size);
+    if (op.type != DELETE) {
+	::read(m_logFd, &size, sizeof(size));
+	op.value.resize(size);
+	::read(m_logFd, &op.value[0], size);
+    }
+    // Records written before keyspaces have zero gap there
+    ::read(m_logFd, &op.keyspace, sizeof(op.keyspace));
 }
 
-void CachedPageReadWriter::startOperation(OpType type, const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+void CachedPageReadWriter::writeOperationRecord(
+    OpType type,
+    const DatabaseNode::Record &key,
+    const DatabaseNode::Record &value,
+    size_t keyspace)
 {
-    if (type == INSERT) {
-	// Assuming here that all of this is less than record size
-	::write(m_logFd, LOG_ACTION_INSERT, LOG_ACTION_SIZE);
+    // Assuming here that all of this is less than record size
+    size_t recordSize = LOG_ACTION_SIZE + sizeof(key.size) + key.size + sizeof(keyspace);
+    if (type == INSERT || type == UPSERT) {
+	::write(m_logFd, type == INSERT ? LOG_ACTION_INSERT : LOG_ACTION_UPSERT, LOG_ACTION_SIZE);
 	::write(m_logFd, &(key.size), sizeof(key.size));
 	::write(m_logFd, key.data, key.size);
 	::write(m_logFd, &(value.size), sizeof(value.size));
 	::write(m_logFd, value.data, value.size);
-	writeLogStumb(LOG_ACTION_SIZE + sizeof(key.size) + key.size + sizeof(value.size) + value.size);
+	recordSize += sizeof(value.size) + value.size;
     } else if (type == DELETE) {
 	::write(m_logFd, LOG_ACTION_DELETE, LOG_ACTION_SIZE);
 	::write(m_logFd, &(key.size), sizeof(key.size));
 	::write(m_logFd, key.data, key.size);
-	writeLogStumb(LOG_ACTION_SIZE + sizeof(key.size) + key.size);
-    } else {
+    }
+    ::write(m_logFd, &keyspace, sizeof(keyspace));
+    writeLogStumb(recordSize);
+}
+
+void CachedPageReadWriter::writeBatchRecords()
+{
+    size_t count = m_batch.size();
+    ::write(m_logFd, LOG_ACTION_BATCH, LOG_ACTION_SIZE);
+    ::write(m_logFd, &count, sizeof(count));
+    writeLogStumb(LOG_ACTION_SIZE + sizeof(count));
+    for (LoggedOperation &op : m_batch) {
+	writeOperationRecord(
+	    op.type,
+	    DatabaseNode::Record(op.key.size(), &op.key[0]),
+	    DatabaseNode::Record(op.value.size(), &op.value[0]),
+	    op.keyspace);
+    }
+}
+
+CachedPageReadWriter::~CachedPageReadWriter()
+{
+    close();
+    for (Page *page : m_cache) {
+	if (page) {
+	    delete page;
+	    m_budget->release(MemoryBudget::PAGE_CACHE, m_globConf->pageSize());
+	}
+    }
+    delete m_source;
+}
+
+void CachedPageReadWriter::enableCopyOnWrite()
+{
+    m_isCopyOnWrite = true;
+}
+
+void CachedPageReadWriter::enableWarmUp(const std::string &warmFile, bool inBackground)
+{
+    m_warmFile = warmFile;
+    int fd = open(warmFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+	return; // nothing was saved yet
+    }
+    // Warm file: page count and page numbers, hottest first
+    std::vector<size_t> hottestFirst;
+    struct stat st;
+    size_t count;
+    if (fstat(fd, &st) == 0 && ::read(fd, &count, sizeof(count)) == sizeof(count)
+	    && static_cast<size_t>(st.st_size) == sizeof(count) * (count + 1)) {
+	hottestFirst.resize(count);
+	if (::read(fd, hottestFirst.data(), count * sizeof(size_t)) != static_cast<ssize_t>(count * sizeof(size_t))) {
+	    hottestFirst.clear();
+	}
+    }
+    ::close(fd);
+    if (hottestFirst.size() > m_cellLimit) {
+	hottestFirst.resize(m_cellLimit);
+    }
+
+    // List may be older than file, freed pages are skipped
+    std::vector<size_t> pages;
+    for (const size_t &number : hottestFirst) {
+	if (number < m_globConf->pageCount() && m_source->isPageAllocated(number) && !m_posInCache.count(number)) {
+	    pages.push_back(number);
+	}
+    }
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    m_source->willNeed(pages);
+    if (inBackground || m_source->isMapped()) {
+	return;
+    }
+    for (const size_t &number : pages) {
+	size_t cachePos = cachePage(number);
+	m_lruList.erase(std::find(m_lruList.begin(), m_lruList.end(), cachePos));
+	m_lruList.push_front(cachePos);
+    }
+    // Sorted reads mixed LRU order up, hottest page goes to front last
+    for (std::vector<size_t>::reverse_iterator it = hottestFirst.rbegin(); it != hottestFirst.rend(); it++) {
+	std::map<size_t, size_t>::iterator pos = m_posInCache.find(*it);
+	if (pos != m_posInCache.end()) {
+	    m_lruList.erase(std::find(m_lruList.begin(), m_lruList.end(), pos->second));
+	    m_lruList.push_front(pos->second);
+	}
+    }
+    m_stats->warmUpPages += pages.size();
+}
+
+bool CachedPageReadWriter::isReadOnly() const
+{
+    return m_isReadOnly;
+}
+
+size_t CachedPageReadWriter::journalSize() const
+{
+    struct stat st;
+    if (!m_hasJournal || fstat(m_logFd, &st) == -1) {
+	return 0;
+    }
+    return st.st_size;
+}
+
+void CachedPageReadWriter::checkWritable() const
+{
+    if (m_isReadOnly) {
+	throw std::string("Database is opened read-only");
+    }
+}
+
+void CachedPageReadWriter::saveWarmFile()
+{
+    std::vector<size_t> hottestFirst;
+    for (const size_t &cachePos : m_lruList) {
+	if (m_cache[cachePos] != nullptr) {
+	    hottestFirst.push_back(m_cache[cachePos]->number());
+	}
+    }
+    size_t count = hottestFirst.size();
+
+    // Warm file is only a hint, failure to save it doesn't fail close
+    std::string tmpFile = m_warmFile + ".tmp";
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+	return;
+    }
+    bool isWritten = ::write(fd, &count, sizeof(count)) == sizeof(count)
+	&& ::write(fd, hottestFirst.data(), count * sizeof(size_t)) == static_cast<ssize_t>(count * sizeof(size_t));
+    ::close(fd);
+    if (!isWritten || rename(tmpFile.c_str(), m_warmFile.c_str()) == -1) {
+	unlink(tmpFile.c_str());
+    }
+}
+
+void CachedPageReadWriter::startOperation(
+    OpType type,
+    const DatabaseNode::Record &key,
+    const DatabaseNode::Record &value,
+    size_t keyspace)
+{
+    if (type != INSERT && type != DELETE && type != UPSERT) {
 	throw std::string("Uknown operation type");
     }
+    checkWritable();
     m_inOperation = true;
+    if (!m_hasJournal || m_inBatch) {
+	return;
+    }
+    writeOperationRecord(type, key, value, keyspace);
 }
 
 void CachedPageReadWriter::endOperation()
 {
-    ::write(m_logFd, LOG_ACTION_COMMIT, LOG_ACTION_SIZE);
-    writeLogStumb(LOG_ACTION_SIZE);
+    if (m_inBatch) {
+	return; // batch is committed by endBatch
+    }
+    if (m_hasJournal) {
+	::write(m_logFd, LOG_ACTION_COMMIT, LOG_ACTION_SIZE);
+	writeLogStumb(LOG_ACTION_SIZE);
+    }
     m_inOperation = false;
+    if (m_isCopyOnWrite) {
+	commit();
+    }
     m_pinnedCells.clear();
+
+    if (m_writesCounter >= CHECKPOINT_THRESHOLD) {
+	flush();
+    }
+    trimCache(TRIM_STEP_PAGES);
+    shedMemory();
+}
+
+void CachedPageReadWriter::startBatch(const std::vector<LoggedOperation> &operations)
+{
+    if (m_inOperation) {
+	throw std::string("Can't start batch in the middle of operation");
+    }
+    checkWritable();
+    m_inOperation = true;
+    m_inBatch = true;
+    m_batch = operations;
+    m_budget->charge(MemoryBudget::OPERATION_BUFFERS, operationsSize(m_batch));
+    if (m_hasJournal) {
+	m_batchOffset = lseek(m_logFd, 0, SEEK_CUR);
+	writeBatchRecords();
+    }
+}
+
+void CachedPageReadWriter::endBatch()
+{
+    m_inBatch = false;
+    m_budget->release(MemoryBudget::OPERATION_BUFFERS, operationsSize(m_batch));
+    std::vector<LoggedOperation>().swap(m_batch);
+    m_batchAllocations.clear();
+    std::vector<size_t> frees;
+    frees.swap(m_batchFrees);
+    endOperation();
+    // Pages are freed after commit record, batch dropped by recovery
+    // still has them
+    for (const size_t &number : frees) {
+	deallocatePageNumber(number);
+    }
+}
+
+void CachedPageReadWriter::abortBatch()
+{
+    // Cells were clean or written back before batch changed them
+    for (const size_t &cachePos : m_pinnedCells) {
+	if (m_cache[cachePos] != nullptr) {
+	    dropCacheCell(cachePos);
+	}
+    }
+    m_pinnedCells.clear();
+    m_inBatch = false;
+    m_inOperation = false;
+    m_budget->release(MemoryBudget::OPERATION_BUFFERS, operationsSize(m_batch));
+    std::vector<LoggedOperation>().swap(m_batch);
+    m_batchFrees.clear();
+    if (m_hasJournal) {
+	// Nothing of batch reached file, so its records aren't needed
+	if (ftruncate(m_logFd, m_batchOffset) == -1) {
+	    throw std::string("Error truncating journal");
+	}
+	lseek(m_logFd, m_batchOffset, SEEK_SET);
+    }
+    for (const size_t &number : m_batchAllocations) {
+	m_source->deallocatePageNumber(number);
+    }
+    m_batchAllocations.clear();
+}
+
+size_t CachedPageReadWriter::cacheCapacity() const
+{
+    return m_cellLimit;
+}
+
+void CachedPageReadWriter::setKeyspaceRoot(size_t keyspace, size_t rootPage)
+{
+    if (m_hasJournal) {
+	size_t root[3] = {keyspace, m_globConf->keyspaceRoot(keyspace), rootPage};
+	::write(m_logFd, LOG_ACTION_ROOT, LOG_ACTION_SIZE);
+	::write(m_logFd, root, sizeof(root));
+	writeLogStumb(LOG_ACTION_SIZE + sizeof(root));
+    }
+    m_globConf->setKeyspaceRoot(keyspace, rootPage);
 }
 
 size_t CachedPageReadWriter::allocatePageNumber()
 {
-    return m_source->allocatePageNumber();
+    size_t number = m_source->allocatePageNumber();
+    if (m_inBatch) {
+	m_batchAllocations.push_back(number);
+    }
+    return number;
 }
 
 void CachedPageReadWriter::deallocatePageNumber(const size_t &number)
 {
+    if (m_inBatch) {
+	m_batchFrees.push_back(number);
+	return;
+    }
+    preserveForSnapshots(number);
     std::map<size_t, size_t>::iterator it = m_posInCache.find(number);
     if (it != m_posInCache.end()) {
-	delete m_cache[it->second];
-	m_cache[it->second] = nullptr;
-	m_isDirty[it->second] = false;
-
-	m_lruList.erase(std::find(m_lruList.begin(), m_lruList.end(), it->second));
-	m_lruList.push_back(it->second); // pushing to oldest to use first
-
-	m_posInCache.erase(it);
+	dropCacheCell(it->second);
     }
     m_source->deallocatePageNumber(number);
 }
 
+void CachedPageReadWriter::dropCacheCell(size_t cachePos)
+{
+    m_posInCache.erase(m_cache[cachePos]->number());
+    delete m_cache[cachePos];
+    m_cache[cachePos] = nullptr;
+    m_isDirty[cachePos] = false;
+    m_budget->release(MemoryBudget::PAGE_CACHE, m_globConf->pageSize());
+
+    m_lruList.erase(std::find(m_lruList.begin(), m_lruList.end(), cachePos));
+    m_lruList.push_back(cachePos); // pushing to oldest to use first
+}
+
+bool CachedPageReadWriter::isPageAllocated(const size_t &number)
+{
+    return m_source->isPageAllocated(number);
+}
+
 void CachedPageReadWriter::read(Page &page)
 {
+    if (m_source->isMapped()) {
+	// Copy from mapping is as cheap as from cache and keeps no private page
+	m_source->read(page);
+	return;
+    }
     std::map<size_t, size_t>::iterator it = m_posInCache.find(page.number());
     if (it == m_posInCache.end()) { // no page in cache
-	size_t freeCachePos = freeCachePosition(); // will do poping if needed
-	m_cache[freeCachePos] = new Page(page.number(), m_globConf->pageSize());
-	m_posInCache[page.number()] = freeCachePos;
-	m_isDirty[freeCachePos] = false;
-
-	m_source->read(*m_cache[freeCachePos]);
+	m_stats->cacheMisses++;
+	trimCache(TRIM_STEP_PAGES);
+	cachePage(page.number());
+    } else {
+	m_stats->cacheHits++;
     }
     size_t cachePos = m_posInCache[page.number()];
     memcpy(page.rawData(), m_cache[cachePos]->rawData(), m_globConf->pageSize());
@@ -186,25 +581,45 @@ void CachedPageReadWriter::read(Page &page)
     m_lruList.push_front(cachePos);
 }
 
+size_t CachedPageReadWriter::cachePage(size_t pageNumber)
+{
+    size_t freeCachePos = freeCachePosition(); // will do poping if needed
+    m_cache[freeCachePos] = new Page(pageNumber, m_globConf->pageSize());
+    m_budget->charge(MemoryBudget::PAGE_CACHE, m_globConf->pageSize());
+    m_posInCache[pageNumber] = freeCachePos;
+    m_isDirty[freeCachePos] = false;
+
+    m_source->read(*m_cache[freeCachePos]);
+    return freeCachePos;
+}
+
 void CachedPageReadWriter::write(const Page &page)
 {
-    if (m_writesCounter == CHECKPOINT_THRESHOLD) {
-	m_writesCounter = 0;
+    checkWritable();
+    // Checkpoint inside operation would hide it from recovery
+    if (m_writesCounter >= CHECKPOINT_THRESHOLD && !m_inOperation) {
 	flush();
-    } else {
-	m_writesCounter++;
     }
-
-    ::write(m_logFd, LOG_ACTION_CHANGE, LOG_ACTION_SIZE);
-    size_t pageNumber = page.number();
-    ::write(m_logFd, &pageNumber, sizeof(pageNumber));
-    ::write(m_logFd, page.rawData(), m_globConf->pageSize());
+    m_writesCounter++;
+
+    if (m_hasJournal) {
+	::write(m_logFd, LOG_ACTION_CHANGE, LOG_ACTION_SIZE);
+	size_t pageNumber = page.number();
+	::write(m_logFd, &pageNumber, sizeof(pageNumber));
+	::write(m_logFd, page.rawData(), m_globConf->pageSize());
+	m_stats->journalRecords++;
+	m_stats->journalBytes += LOG_ACTION_SIZE + sizeof(pageNumber) + m_globConf->pageSize();
+    }
+    preserveForSnapshots(page.number());
 
     std::map<size_t, size_t>::iterator it = m_posInCache.find(page.number());
     if (it == m_posInCache.end()) { // no page in cache
 	size_t freeCachePos = freeCachePosition(); // will do poping if needed
 	m_cache[freeCachePos] = new Page(page.number(), m_globConf->pageSize());
+	m_budget->charge(MemoryBudget::PAGE_CACHE, m_globConf->pageSize());
 	m_posInCache[page.number()] = freeCachePos;
+    } else if (m_inBatch && !m_pinnedCells.count(it->second)) {
+	flushCacheCell(it->second); // aborted batch drops the cell
     }
     size_t cachePos = m_posInCache[page.number()];
     m_isDirty[cachePos] = true;
@@ -219,13 +634,26 @@ void CachedPageReadWriter::write(const Page &page)
 
 void CachedPageReadWriter::close()
 {
+    if (m_isClosed) {
+	return;
+    }
+    m_isClosed = true;
+    while (!m_snapshots.empty()) {
+	releaseSnapshot(m_snapshots.begin()->first);
+    }
     flush();
+    if (!m_warmFile.empty() && !m_isReadOnly) {
+	saveWarmFile();
+    }
     m_source->close();
 
-    ::write(m_logFd, LOG_ACTION_DB_CLOSE, LOG_ACTION_SIZE);
-    writeLogStumb(LOG_ACTION_SIZE);
+    if (m_hasJournal) {
+	::write(m_logFd, LOG_ACTION_DB_CLOSE, LOG_ACTION_SIZE);
+	writeLogStumb(LOG_ACTION_SIZE);
 
-    ::close(m_logFd);
+	::close(m_logFd);
+	m_logFd = -1;
+    }
 
     if (m_pendingKey.data) {
 	delete[] m_pendingKey.data;
@@ -233,6 +661,7 @@ void CachedPageReadWriter::close()
     if (m_pendingValue.data) {
 	delete[] m_pendingValue.data;
     }
+    clearCommittedOperations();
 }
 
 void CachedPageReadWriter::flushCacheCell(size_t cachePos)
@@ -243,43 +672,247 @@ void CachedPageReadWriter::flushCacheCell(size_t cachePos)
     }
 }
 
+void CachedPageReadWriter::commit()
+{
+    if (m_pinnedCells.empty()) {
+	return; // operation changed nothing
+    }
+    // Pages written by operation are pinned, older ones are on disk already
+    for (const size_t &cachePos : m_pinnedCells) {
+	flushCacheCell(cachePos);
+    }
+    m_source->flush();
+    m_writesCounter = 0;
+}
+
 void CachedPageReadWriter::flush()
 {
-    for (const std::pair<size_t, size_t> &p : m_posInCache) {
+    writeBack(false);
+}
+
+void CachedPageReadWriter::sync()
+{
+    writeBack(true);
+}
+
+void CachedPageReadWriter::writeBack(bool durable)
+{
+    if (m_inOperation) {
+	return; // tree is consistent at operation end only
+    }
+    for (const auto &p : m_posInCache) {
 	flushCacheCell(p.second);
     }
-    m_source->flush();
+    if (durable) {
+	m_source->sync();
+    } else {
+	m_source->flush();
+    }
+    m_writesCounter = 0;
+
+    if (m_hasJournal) {
+	::write(m_logFd, LOG_ACTION_CHECKPOINT, LOG_ACTION_SIZE);
+	writeLogStumb(LOG_ACTION_SIZE);
+	if (durable && fdatasync(m_logFd) == -1) {
+	    throw std::string("Error syncing journal");
+	}
+    }
+}
+
+void CachedPageReadWriter::willNeed(const std::vector<size_t> &pages)
+{
+    std::vector<size_t> missing;
+    for (const size_t &number : pages) {
+	if (!m_posInCache.count(number)) {
+	    missing.push_back(number);
+	}
+    }
+    if (!missing.empty()) {
+	m_source->willNeed(missing);
+    }
+}
+
+void CachedPageReadWriter::setCacheSize(size_t cacheSize)
+{
+    if (cacheSize % m_globConf->pageSize()) {
+	throw std::string("Page size should divide cache size.");
+    }
+    size_t cacheCells = cacheSize / m_globConf->pageSize();
+    if (!cacheCells) {
+	throw std::string("Cache should hold at least one page");
+    }
+
+    m_cellLimit = cacheCells;
+    for (size_t cachePos = m_cache.size(); cachePos < cacheCells; cachePos++) {
+	m_cache.push_back(nullptr);
+	m_isDirty.push_back(false);
+	m_lruList.push_back(cachePos);
+    }
+    if (!m_inOperation) {
+	trimCache(TRIM_STEP_PAGES);
+    }
+}
+
+void CachedPageReadWriter::trimCache(size_t maxEvictions)
+{
+    if (m_cache.size() == m_cellLimit) {
+	return;
+    }
+    for (auto it = m_lruList.rbegin(); it != m_lruList.rend() && m_posInCache.size() > m_cellLimit && maxEvictions; it++) {
+	if (m_cache[*it] != nullptr && !m_pinnedCells.count(*it)) {
+	    evictCacheCell(*it);
+	    maxEvictions--;
+	}
+    }
+    if (m_posInCache.size() > m_cellLimit || !m_pinnedCells.empty()) {
+	return; // rest is trimmed at next operation end
+    }
+
+    // Pages above limit fit free cells below it now
+    std::vector<size_t> movedTo(m_cache.size(), m_cache.size());
+    std::vector<bool> isTaken(m_cellLimit, false);
+    size_t freeCell = 0;
+    for (size_t cachePos = m_cellLimit; cachePos < m_cache.size(); cachePos++) {
+	if (m_cache[cachePos] == nullptr) {
+	    continue;
+	}
+	while (m_cache[freeCell] != nullptr) {
+	    freeCell++;
+	}
+	m_cache[freeCell] = m_cache[cachePos];
+	m_isDirty[freeCell] = m_isDirty[cachePos];
+	m_posInCache[m_cache[freeCell]->number()] = freeCell;
+	movedTo[cachePos] = freeCell;
+	isTaken[freeCell] = true;
+    }
+
+    // Moved page keeps its LRU place, cells above limit leave the list
+    for (auto it = m_lruList.begin(); it != m_lruList.end();) {
+	if (*it >= m_cellLimit ? movedTo[*it] == m_cache.size() : isTaken[*it]) {
+	    it = m_lruList.erase(it);
+	} else {
+	    if (*it >= m_cellLimit) {
+		*it = movedTo[*it];
+	    }
+	    it++;
+	}
+    }
+    m_cache.resize(m_cellLimit);
+    m_isDirty.resize(m_cellLimit);
+}
+
+void CachedPageReadWriter::shrink()
+{
+    if (m_inOperation) {
+	throw std::string("Can't shrink in the middle of operation");
+    }
+    if (!m_snapshots.empty()) {
+	throw std::string("Can't shrink while snapshots are open");
+    }
+    checkWritable();
+    flush();
+    m_source->shrink();
+    if (!m_hasJournal) {
+	return;
+    }
 
+    // Everything is on disk now, journal before last checkpoint isn't needed.
+    // Renamed copy replaces it at once, so crash leaves one of them whole
+    std::string tmpJournal = std::string(m_globConf->journalPath()) + ".tmp";
+    int oldFd = m_logFd;
+    m_logFd = open(tmpJournal.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m_logFd == -1) {
+	m_logFd = oldFd;
+	throw std::string("Error creating journal");
+    }
     ::write(m_logFd, LOG_ACTION_CHECKPOINT, LOG_ACTION_SIZE);
     writeLogStumb(LOG_ACTION_SIZE);
+    if (fsync(m_logFd) == -1 || rename(tmpJournal.c_str(), m_globConf->journalPath()) == -1) {
+	::close(m_logFd);
+	unlink(tmpJournal.c_str());
+	m_logFd = oldFd;
+	throw std::string("Error replacing journal");
+    }
+    ::close(oldFd);
+}
+
+size_t CachedPageReadWriter::operationsSize(const std::vector<LoggedOperation> &operations)
+{
+    size_t res = operations.size() * sizeof(LoggedOperation);
+    for (const LoggedOperation &op : operations) {
+	res += op.key.size() + op.value.size();
+    }
+    return res;
 }
 
 size_t CachedPageReadWriter::freeCachePosition()
 {
-    auto it = m_lruList.rbegin();
+    // Full or over budget cache doesn't grow, its oldest page makes room
+    bool isFull = m_posInCache.size() >= m_cellLimit;
+    if (isFull || (m_budget->isOverLimit() && m_posInCache.size() >= MIN_CACHED_PAGES)) {
+	for (auto it = m_lruList.rbegin(); it != m_lruList.rend(); it++) {
+	    if (m_cache[*it] != nullptr && !m_pinnedCells.count(*it)) {
+		evictCacheCell(*it);
+		if (!isFull) {
+		    m_stats->memorySheds++;
+		}
+		return *it;
+	    }
+	}
+    }
+
     for (auto it = m_lruList.rbegin(); it != m_lruList.rend(); it++) {
 	size_t cachePos = *it;
 
 	if (m_pinnedCells.count(cachePos)) {
 	    continue;
 	}
+	if (cachePos >= m_cellLimit && m_cache[cachePos] == nullptr) {
+	    continue; // cell goes away with trim
+	}
 
 	if (m_cache[cachePos] != nullptr) {
-	    flushCacheCell(cachePos);
-	    m_posInCache.erase(m_cache[cachePos]->number());
-	    delete m_cache[cachePos];
-	    m_cache[cachePos] = nullptr;
+	    evictCacheCell(cachePos);
 	}
 	return cachePos;
     }
     throw std::string("Everything in cache is pinned. Nothing to throw out!");
 }
 
+void CachedPageReadWriter::evictCacheCell(size_t cachePos)
+{
+    m_stats->cacheEvictions++;
+    if (m_isDirty[cachePos]) {
+	m_stats->cacheDirtyEvictions++;
+    }
+    flushCacheCell(cachePos);
+    m_posInCache.erase(m_cache[cachePos]->number());
+    delete m_cache[cachePos];
+    m_cache[cachePos] = nullptr;
+    m_budget->release(MemoryBudget::PAGE_CACHE, m_globConf->pageSize());
+}
+
+void CachedPageReadWriter::shedMemory()
+{
+    // Freed cells are at LRU tail already, so they are taken first
+    for (auto it = m_lruList.rbegin(); it != m_lruList.rend(); it++) {
+	if (!m_budget->isOverLimit() || m_posInCache.size() <= MIN_CACHED_PAGES) {
+	    return;
+	}
+	if (m_cache[*it] != nullptr && !m_pinnedCells.count(*it)) {
+	    evictCacheCell(*it);
+	    m_stats->memorySheds++;
+	}
+    }
+}
+
 void CachedPageReadWriter::writeLogStumb(size_t toSkip)
 {
     size_t recordSize = LOG_ACTION_SIZE + sizeof(size_t) + m_globConf->pageSize();
     lseek(m_logFd, recordSize - toSkip - LOG_SEEK_DELIM_SIZE, SEEK_CUR); // Seek forward other fields
     ::write(m_logFd, LOG_SEEK_DELIM, LOG_SEEK_DELIM_SIZE);
+    m_stats->journalRecords++;
+    m_stats->journalBytes += recordSize;
 }
 
 CachedPageReadWriter::OpType CachedPageReadWriter::pendingOperation() const
@@ -296,3 +929,79 @@ const DatabaseNode::Record &CachedPageReadWriter::pendingValue() const
 {
     return m_pendingValue;
 }
+
+size_t CachedPageReadWriter::pendingKeyspace() const
+{
+    return m_pendingKeyspace;
+}
+
+const std::vector<CachedPageReadWriter::LoggedOperation> &CachedPageReadWriter::committedOperations() const
+{
+    return m_committedOperations;
+}
+
+void CachedPageReadWriter::clearCommittedOperations()
+{
+    m_budget->release(MemoryBudget::OPERATION_BUFFERS, operationsSize(m_committedOperations));
+    std::vector<LoggedOperation>().swap(m_committedOperations);
+}
+
+size_t CachedPageReadWriter::createSnapshot()
+{
+    size_t snapshot = m_nextSnapshotId++;
+    m_snapshots[snapshot];
+    return snapshot;
+}
+
+void CachedPageReadWriter::releaseSnapshot(size_t snapshot)
+{
+    std::map<size_t, std::map<size_t, Page *> >::iterator it = m_snapshots.find(snapshot);
+    if (it == m_snapshots.end()) {
+	throw std::string("Unknown snapshot");
+    }
+    for (const auto &p : it->second) {
+	delete p.second;
+    }
+    m_budget->release(MemoryBudget::SNAPSHOTS, it->second.size() * m_globConf->pageSize());
+    m_snapshots.erase(it);
+}
+
+void CachedPageReadWriter::readAtSnapshot(size_t snapshot, Page &page)
+{
+    std::map<size_t, std::map<size_t, Page *> >::iterator it = m_snapshots.find(snapshot);
+    if (it == m_snapshots.end()) {
+	throw std::string("Unknown snapshot");
+    }
+    std::map<size_t, Page *>::iterator preImage = it->second.find(page.number());
+    if (preImage == it->second.end()) {
+	read(page); // not changed since snapshot creation
+    } else {
+	memcpy(page.rawData(), preImage->second->rawData(), m_globConf->pageSize());
+    }
+}
+
+void CachedPageReadWriter::preserveForSnapshots(size_t pageNumber)
+{
+    Page *current = nullptr;
+    for (std::pair<const size_t, std::map<size_t, Page *> > &snapshot : m_snapshots) {
+	if (snapshot.second.count(pageNumber)) {
+	    continue;
+	}
+	if (!current) {
+	    current = new Page(pageNumber, m_globConf->pageSize());
+	    std::map<size_t, size_t>::iterator it = m_posInCache.find(pageNumber);
+	    if (it != m_posInCache.end()) {
+		memcpy(current->rawData(), m_cache[it->second]->rawData(), m_globConf->pageSize());
+	    } else {
+		m_source->read(*current);
+	    }
+	    snapshot.second[pageNumber] = current;
+	} else {
+	    Page *copy = new Page(pageNumber, m_globConf->pageSize());
+	    memcpy(copy->rawData(), current->rawData(), m_globConf->pageSize());
+	    snapshot.second[pageNumber] = copy;
+	}
+	m_budget->charge(MemoryBudget::SNAPSHOTS, m_globConf->pageSize());
+	m_stats->snapshotPageCopies++;
+    }
+}
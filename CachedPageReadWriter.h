@@ -4,10 +4,15 @@
 #include <map>
 #include <list>
 #include <set>
+#include <string>
+
+#include <sys/types.h>
 
 #include "PageReadWriter.h"
 #include "GlobalConfiguration.h"
 #include "DatabaseNode.h"
+#include "MemoryBudget.h"
+#include "Statistics.h"
 
 class CachedPageReadWriter : public PageReadWriter
 {
@@ -15,27 +20,98 @@ public:
     enum OpType {
 	INSERT,
 	DELETE,
+	UPSERT,
 	NONE
     };
 
-    CachedPageReadWriter(PageReadWriter *source, GlobalConfiguration *globConf);
+    struct LoggedOperation
+    {
+	OpType type;
+	std::string key;
+	std::string value;
+	/// Keyspace of B-tree database, 0 for other engines
+	size_t keyspace;
+    };
+
+    /// Takes ownership of source, empty journal path disables journaling.
+    /// Page frames are charged to budget, over budget least recently used
+    /// pages are dropped instead of filling free frames. Read-only source
+    /// needs journal ending with clean close, which is left untouched
+    CachedPageReadWriter(PageReadWriter *source, GlobalConfiguration *globConf, Statistics *stats, MemoryBudget *budget);
     ~CachedPageReadWriter();
 
     virtual size_t allocatePageNumber();
     virtual void deallocatePageNumber(const size_t &number);
+    virtual bool isPageAllocated(const size_t &number);
 
     virtual void read(Page &page);
     virtual void write(const Page &page);
 
     virtual void close();
     virtual void flush();
+    /// Flush which returns when pages and journal are on disk
+    virtual void sync();
+    virtual void shrink();
+    /// Passes pages which aren't cached to source
+    virtual void willNeed(const std::vector<size_t> &pages);
+
+    /// Grows cache at once. Shrunk cache takes no new pages above new
+    /// size, its extra pages are evicted a few at every operation end
+    /// and cache miss
+    void setCacheSize(size_t cacheSize);
+
+    /// Copy-on-write mode: caller never overwrites pages of committed tree,
+    /// every operation end commits its pages, flushes inside operation wait for it
+    void enableCopyOnWrite();
+
+    /// Loads pages listed in warm file hottest first, list of cached pages
+    /// is saved back to it on close. In background mode kernel is only asked
+    /// to read pages ahead and open doesn't wait for them
+    void enableWarmUp(const std::string &warmFile, bool inBackground);
 
-    void startOperation(OpType type, const DatabaseNode::Record &key, const DatabaseNode::Record &value);
+    bool isReadOnly() const;
+    /// Bytes of journal, 0 without journal
+    size_t journalSize() const;
+    /// Throws for read-only database, called before anything is changed
+    void checkWritable() const;
+
+    void startOperation(
+	OpType type,
+	const DatabaseNode::Record &key,
+	const DatabaseNode::Record &value,
+	size_t keyspace = 0);
     void endOperation();
 
+    /// Operations of batch are logged before any of its changes and are
+    /// committed together, operations started inside batch aren't logged.
+    /// Batch interrupted by crash is dropped by recovery. Pages are freed
+    /// at batch end, so failed batch can be aborted
+    void startBatch(const std::vector<LoggedOperation> &operations);
+    void endBatch();
+    /// Drops pages written by batch and cuts it from journal. Caller puts
+    /// roots back first, header written by freeing batch pages keeps them
+    void abortBatch();
+    /// Pages cache holds, pages written by one batch have to fit them
+    size_t cacheCapacity() const;
+
+    /// Root change is journaled, so recovery keeps root of tree together
+    /// with pages of operation which changed it
+    void setKeyspaceRoot(size_t keyspace, size_t rootPage);
+
     OpType pendingOperation() const;
     const DatabaseNode::Record &pendingKey() const;
     const DatabaseNode::Record &pendingValue() const;
+    size_t pendingKeyspace() const;
+
+    /// Operations committed after last checkpoint, restored from journal on open
+    const std::vector<LoggedOperation> &committedOperations() const;
+    void clearCommittedOperations();
+
+    /// Page is copied before its first change after snapshot creation,
+    /// so reads at snapshot see pages as they were at creation
+    size_t createSnapshot();
+    void releaseSnapshot(size_t snapshot);
+    void readAtSnapshot(size_t snapshot, Page &page);
 
 private:
     static const size_t LOG_ACTION_SIZE = 8;
@@ -45,27 +121,89 @@ private:
     static const char LOG_ACTION_CHECKPOINT[LOG_ACTION_SIZE];
     static const char LOG_ACTION_DELETE[LOG_ACTION_SIZE];
     static const char LOG_ACTION_INSERT[LOG_ACTION_SIZE];
+    static const char LOG_ACTION_UPSERT[LOG_ACTION_SIZE];
     static const char LOG_ACTION_COMMIT[LOG_ACTION_SIZE];
+    static const char LOG_ACTION_BATCH[LOG_ACTION_SIZE];
+    static const char LOG_ACTION_ROOT[LOG_ACTION_SIZE];
 
     static const size_t LOG_SEEK_DELIM_SIZE = 1;
     static const char LOG_SEEK_DELIM[LOG_SEEK_DELIM_SIZE];
     static const size_t CHECKPOINT_THRESHOLD = 1000;
+    /// Pages kept cached however far memory is over budget
+    static const size_t MIN_CACHED_PAGES = 16;
+    /// Extra pages of shrunk cache evicted at one operation end or miss
+    static const size_t TRIM_STEP_PAGES = 64;
 
     GlobalConfiguration *m_globConf;
+    Statistics *m_stats;
+    MemoryBudget *m_budget;
     PageReadWriter *m_source;
     std::vector<Page *> m_cache;
     std::vector<bool> m_isDirty;
+    /// Cells cache may fill, cells above it are left after shrink until trimmed
+    size_t m_cellLimit;
     std::set<size_t> m_pinnedCells;
     std::map<size_t, size_t> m_posInCache;
     std::list<size_t> m_lruList;
     int m_logFd;
+    bool m_hasJournal;
+    bool m_isReadOnly;
+    bool m_isClosed;
     size_t m_writesCounter;
     bool m_inOperation;
+    bool m_inBatch;
+    /// Operations of current batch
+    std::vector<LoggedOperation> m_batch;
+    /// Journal end before batch records, abort cuts journal back to it
+    off_t m_batchOffset;
+    /// Pages allocated by current batch, freed by abort
+    std::vector<size_t> m_batchAllocations;
+    /// Pages freed by current batch, they stay allocated until batch end
+    std::vector<size_t> m_batchFrees;
+    bool m_isCopyOnWrite;
+    /// Empty when warm-up is disabled
+    std::string m_warmFile;
 
     OpType m_pendingOperation;
     DatabaseNode::Record m_pendingKey, m_pendingValue;
+    size_t m_pendingKeyspace;
+    std::vector<LoggedOperation> m_committedOperations;
+
+    /// Pre-images of pages changed after every open snapshot
+    std::map<size_t, std::map<size_t, Page *> > m_snapshots;
+    size_t m_nextSnapshotId;
 
+    void openJournal();
+    /// Journal of read-only database must end with close record
+    void checkJournalClosed() const;
+    static bool isOperationRecord(const char *recordType);
+    /// Reads fields of operation record which type is already read
+    void readOperationRecord(const char *recordType, LoggedOperation &op);
+    void writeOperationRecord(
+	OpType type,
+	const DatabaseNode::Record &key,
+	const DatabaseNode::Record &value,
+	size_t keyspace);
+    /// Batch record with operation count followed by operation records
+    void writeBatchRecords();
+    void saveWarmFile();
+    void commit();
+    void preserveForSnapshots(size_t pageNumber);
+    /// Drops page from cache without writing it back
+    void dropCacheCell(size_t cachePos);
+    static size_t operationsSize(const std::vector<LoggedOperation> &operations);
     size_t freeCachePosition();
+    /// Writes page of cell back if it's dirty and frees the cell
+    void evictCacheCell(size_t cachePos);
+    /// Evicts least recently used pages while memory is over budget
+    void shedMemory();
+    /// Evicts at most maxEvictions pages of shrunk cache, when few enough
+    /// are left moves pages from cells above limit down and drops those cells
+    void trimCache(size_t maxEvictions);
+    /// Reads page from source to free cache cell, returns the cell
+    size_t cachePage(size_t pageNumber);
     void flushCacheCell(size_t cachePos);
+    /// Writes every dirty page and checkpoint record
+    void writeBack(bool durable);
     void writeLogStumb(size_t toSkip);
 };
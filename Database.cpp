@@ -3,33 +3,120 @@
 #include <cstring>
 #include <memory>
 #include <algorithm>
+#include <string>
+#include <queue>
 
-#include "DiskPageReadWriter.h"
+#include "SnapshotPageReadWriter.h"
+
+const size_t Database::NO_PARENT;
+const size_t Database::NO_APPEND_LEAF;
+const size_t Database::MULTI_SELECT_WIDTH;
+
+static void appendRecord(DatabaseNode::Record &to, const DatabaseNode::Record &tail)
+{
+    DatabaseNode::Record res(to.size + tail.size, new char[to.size + tail.size]);
+    memcpy(res.data, to.data, to.size);
+    memcpy(res.data + to.size, tail.data, tail.size);
+    delete[] to.data;
+    to = res;
+}
+
+static int compareKeys(const DatabaseNode::Record &a, const std::string &b)
+{
+    if (a.size != b.size()) {
+	return a.size < b.size() ? -1 : 1;
+    }
+    return a.size ? memcmp(a.data, b.data(), a.size) : 0;
+}
+
+static std::string keyString(const DatabaseNode::Record &key)
+{
+    return std::string(key.data, key.size);
+}
+
+bool Database::KeyLess::operator()(const std::string &a, const std::string &b) const
+{
+    if (a.size() != b.size()) {
+	return a.size() < b.size();
+    }
+    return memcmp(a.data(), b.data(), a.size()) < 0;
+}
+
+static std::vector<DatabaseNode::Message>::iterator findMessage(
+    std::vector<DatabaseNode::Message> &messages,
+    const DatabaseNode::Record &key)
+{
+    return std::lower_bound(messages.begin(), messages.end(), key,
+	[](const DatabaseNode::Message &m, const DatabaseNode::Record &k) {
+	    return m.key < k;
+	});
+}
 
 Database::Database(const char *databaseFile, const Database::Configuration &configuration)
-    : m_globConfiguration(
+    : DatabaseEngine(configuration)
+    , m_globConfiguration(
 	configuration.size / configuration.pageSize,
 	configuration.pageSize,
 	1,
 	configuration.cacheSize,
-	"journal.bin") //desired params
+	configuration.engine | configuration.fixedKeySize << KEY_SIZE_SHIFT,
+	configuration.compactFormat ? GlobalConfiguration::FORMAT_COMPACT : GlobalConfiguration::FORMAT_WIDE,
+	configuration.inMemory || configuration.copyOnWrite ? "" : journalFile(databaseFile).c_str()) //desired params
     // line below will init m_globConfiguration if file exists
-    , m_pageReadWriter(new DiskPageReadWriter(databaseFile, &m_globConfiguration), &m_globConfiguration)
+    , m_pageReadWriter(
+	createSource(databaseFile, configuration, &m_globConfiguration, &m_statistics),
+	&m_globConfiguration,
+	&m_statistics,
+	&m_memoryBudget)
+    , m_nodeCache(
+	m_globConfiguration.cacheSize() / m_globConfiguration.pageSize() / LEAF_CACHE_DIVISOR,
+	&m_statistics,
+	&m_memoryBudget)
 {
+    size_t engine = m_globConfiguration.engineType() & ENGINE_TYPE_MASK;
+    if (engine != BTREE && engine != BTREE_BUFFERED) {
+	throw std::string("Database file wasn't created by B-tree engine");
+    }
+    m_isBuffered = engine == BTREE_BUFFERED;
+    m_keyWidth = m_globConfiguration.engineType() >> KEY_SIZE_SHIFT;
+    m_appendLeaf = NO_APPEND_LEAF;
+    m_ascendingInserts = 0;
+    m_keyspace = 0;
+    m_inBatch = false;
+    // Files created without journal keep copy-on-write mode
+    m_isCopyOnWrite = !configuration.inMemory && *m_globConfiguration.journalPath() == '\0';
+    if (m_isCopyOnWrite) {
+	m_pageReadWriter.enableCopyOnWrite();
+    }
+    setUpWarmUp(databaseFile, configuration, m_pageReadWriter);
+
     DatabaseNode *rootNode = new DatabaseNode(
 	&m_globConfiguration,
 	m_pageReadWriter,
 	m_globConfiguration.rootNodePageNumber(),
-	m_globConfiguration.isReadedFromFile());
+	m_globConfiguration.isReadedFromFile(),
+	m_isBuffered,
+	m_keyWidth);
 
-    rootNode->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    if (!m_pageReadWriter.isReadOnly()) {
+	rootNode->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    }
     delete rootNode;
+    if (m_isCopyOnWrite && !m_globConfiguration.isReadedFromFile()) {
+	m_pageReadWriter.flush(); // empty root is the first commit
+    }
 
+    // Redo of B-tree doesn't need operations committed before crash
+    m_pageReadWriter.clearCommittedOperations();
+    useKeyspace(m_pageReadWriter.pendingKeyspace());
     if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::INSERT) {
 	insert(m_pageReadWriter.pendingKey(), m_pageReadWriter.pendingValue());
     } else if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::DELETE) {
 	remove(m_pageReadWriter.pendingKey());
+    } else if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::UPSERT) {
+	upsert(m_pageReadWriter.pendingKey(), m_pageReadWriter.pendingValue());
     }
+    useKeyspace(0);
 }
 
 Database::~Database()
@@ -37,6 +124,13 @@ Database::~Database()
     close();
 }
 
+void Database::checkKeySize(const DatabaseNode::Record &key) const
+{
+    if (m_keyWidth && key.size != m_keyWidth) {
+	throw std::string("Key size doesn't match fixed key size of database");
+    }
+}
+
 size_t Database::effectivePageSize() const
 {
     //assuming "key + data < pageSize / 4"
@@ -50,7 +144,18 @@ void Database::close()
 
 void Database::insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
 {
-    m_pageReadWriter.startOperation(CachedPageReadWriter::INSERT, key, value);
+    checkKeySize(key);
+    if (m_isBuffered) {
+	putMessage(DatabaseNode::PUT, key, value);
+	return;
+    }
+    m_pageReadWriter.startOperation(CachedPageReadWriter::INSERT, key, value, m_keyspace);
+
+    trackInsertOrder(key);
+    if (appendToRightmostLeaf(key, value)) {
+	endOperation();
+	return;
+    }
 
     DatabaseNode *rootNode = readRootNode();
     if (rootNode->spaceOnDisk() + rootNode->additionalSpaceFor(key, value) > effectivePageSize()) {
@@ -60,29 +165,33 @@ void Database::insert(const DatabaseNode::Record &key, const DatabaseNode::Recor
 	s->setKeyCount(0);
 	s->linkedNodesRootPageNumbers().push_back(rootNode->rootPage());
 
-	splitChild(s, 0, rootNode);
-	rootNode->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	splitChild(s, 0, rootNode, isAppendTo(rootNode, key));
+	writeNode(rootNode);
 	delete rootNode;
 
 	rootNode = s;
-	m_globConfiguration.setRootNodePageNumber(rootNode->rootPage());
-	m_pageReadWriter.flush(); // HACK: this needed to flush new root page to disk
+	m_pageReadWriter.setKeyspaceRoot(m_keyspace, rootNode->rootPage());
     }
-    insertNonFull(rootNode, key, value);
+    insertNonFull(rootNode, key, value, true);
 
-    rootNode->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    writeNode(rootNode);
     delete rootNode;
 
-    m_pageReadWriter.endOperation();
+    endOperation();
 }
 
-void Database::insertNonFull(DatabaseNode *x, const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+void Database::insertNonFull(
+    DatabaseNode *x,
+    const DatabaseNode::Record &key,
+    const DatabaseNode::Record &value,
+    bool isRightmost)
 {
-    size_t i = std::upper_bound(x->keys().begin(), x->keys().end(), key) - x->keys().begin() - 1; // last <= key
+    size_t i = x->upperBound(key) - 1; // last <= key
 
     if (i < x->keyCount() && x->keys()[i] == key) {
 	delete[] x->data()[i].data;
 	x->data()[i] = DatabaseNode::Record::rawCopyFrom(value);
+	x->markDirty();
 	return;
     }
 
@@ -92,37 +201,83 @@ void Database::insertNonFull(DatabaseNode *x, const DatabaseNode::Record &key, c
 	x->keys().insert(x->keys().begin() + i, DatabaseNode::Record::rawCopyFrom(key));
 	x->data().insert(x->data().begin() + i, DatabaseNode::Record::rawCopyFrom(value));
 	x->setKeyCount(x->keyCount() + 1);
+
+	// Copy-on-write moves leaf on every write, so hint would go stale
+	if (isRightmost && !m_isCopyOnWrite) {
+	    m_appendLeaf = x->rootPage();
+	    m_appendMaxKey = keyString(x->keys().back());
+	}
     } else {
 	i++;
 
 	DatabaseNode *child = loadNode(x->linkedNodesRootPageNumbers()[i]);
 	if (child->spaceOnDisk() + child->additionalSpaceFor(key, value) > effectivePageSize()) {
-	    splitChild(x, i, child);
+	    splitChild(x, i, child, isRightmost && i == x->keyCount() && isAppendTo(child, key));
 	    if (key > x->keys()[i]) {
 		i++;
 	    }
-	    child->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(child);
 	}
 	delete child;
 
 	if (i < x->keyCount() && x->keys()[i] == key) {
 	    delete[] x->data()[i].data;
 	    x->data()[i] = DatabaseNode::Record::rawCopyFrom(value);
+	    x->markDirty();
 	    return;
 	}
 
 	child = loadNode(x->linkedNodesRootPageNumbers()[i]);
-	insertNonFull(child, key, value);
-	child->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	insertNonFull(child, key, value, isRightmost && i == x->keyCount());
+	writeNode(child);
 	delete child;
     }
 }
 
-void Database::splitChild(DatabaseNode *x, size_t i, DatabaseNode *y)
+bool Database::appendToRightmostLeaf(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
 {
+    if (m_appendLeaf == NO_APPEND_LEAF || compareKeys(key, m_appendMaxKey) <= 0) {
+	return false;
+    }
+    // Separators above rightmost leaf are smaller than its keys, so they
+    // stay valid while leaf takes key without split
+    std::unique_ptr<DatabaseNode> leaf(loadNode(m_appendLeaf));
+    if (leaf->spaceOnDisk() + leaf->additionalSpaceFor(key, value) > effectivePageSize()) {
+	return false;
+    }
+    leaf->keys().push_back(DatabaseNode::Record::rawCopyFrom(key));
+    leaf->data().push_back(DatabaseNode::Record::rawCopyFrom(value));
+    leaf->setKeyCount(leaf->keyCount() + 1);
+    writeNode(leaf.get());
+
+    m_appendMaxKey = keyString(key);
+    m_statistics.appendFastPathInserts++;
+    return true;
+}
+
+void Database::trackInsertOrder(const DatabaseNode::Record &key)
+{
+    m_ascendingInserts = compareKeys(key, m_lastInsertedKey) > 0 ? m_ascendingInserts + 1 : 0;
+    m_lastInsertedKey = keyString(key);
+}
+
+bool Database::isAppendTo(DatabaseNode *y, const DatabaseNode::Record &key) const
+{
+    return m_ascendingInserts >= SEQUENTIAL_RUN && y->keyCount() > 1 && key > y->keys().back();
+}
+
+void Database::splitChild(DatabaseNode *x, size_t i, DatabaseNode *y, bool isAppend)
+{
+    m_statistics.splits++;
+    m_appendLeaf = NO_APPEND_LEAF;
     DatabaseNode *z = createNode();
 
-    size_t T = y->findFirstExceeding(effectivePageSize() / 2) + 1;
+    // Keys of buffered node take at most half of effective page size.
+    // Append split moves last key of leaf up and leaves new leaf empty for
+    // coming keys, internal node gives its last key and two links to z
+    size_t T = isAppend
+	? (y->isLeaf() ? y->keyCount() : y->keyCount() - 1)
+	: y->findFirstExceeding(effectivePageSize() / (y->hasBuffer() ? 4 : 2)) + 1;
 
     z->setIsLeaf(y->isLeaf());
     z->setKeyCount(y->keyCount() - T);
@@ -151,58 +306,844 @@ void Database::splitChild(DatabaseNode *x, size_t i, DatabaseNode *y)
     y->data().erase(y->data().begin() + T - 1);
     y->setKeyCount(T - 1);
 
-    z->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    if (x->hasBuffer()) {
+	bool isMedianDeleted = false;
+	if (y->hasBuffer()) {
+	    std::vector<bool> &yDeleted = y->isKeyDeleted();
+	    z->isKeyDeleted().assign(yDeleted.begin() + T, yDeleted.end());
+	    isMedianDeleted = yDeleted[T - 1];
+	    yDeleted.resize(T - 1);
+
+	    std::vector<DatabaseNode::Message> &yMessages = y->messages();
+	    std::vector<DatabaseNode::Message>::iterator mid = findMessage(yMessages, x->keys()[i]);
+	    z->messages().assign(mid, yMessages.end());
+	    yMessages.erase(mid, yMessages.end());
+	}
+	x->isKeyDeleted().insert(x->isKeyDeleted().begin() + i, isMedianDeleted);
+
+	// Median became own key of x, newer message for it can't stay in buffer
+	std::vector<DatabaseNode::Message>::iterator it = findMessage(x->messages(), x->keys()[i]);
+	if (it != x->messages().end() && it->key == x->keys()[i]) {
+	    DatabaseNode::Message m = *it;
+	    x->messages().erase(it);
+	    applyToPair(x, i, m);
+	}
+    }
+
+    writeNode(z);
     delete z;
 }
 
 bool Database::select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite)
 {
-    DatabaseNode *rootNode = readRootNode();
-    bool result = selectFromNode(rootNode, key, toWrite);
-    delete rootNode;
-    return result;
+    if (m_keyWidth && key.size != m_keyWidth) {
+	return false;
+    }
+    std::shared_ptr<DatabaseNode> rootNode = fetchNode(m_globConfiguration.keyspaceRoot(m_keyspace), m_pageReadWriter);
+    std::vector<const DatabaseNode::Record *> upserts;
+    return selectFromNode(m_pageReadWriter, rootNode.get(), key, toWrite, upserts);
+}
+
+void Database::upsert(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+{
+    checkKeySize(key);
+    if (!m_isBuffered) {
+	DatabaseEngine::upsert(key, value);
+	return;
+    }
+    putMessage(DatabaseNode::UPSERT, key, value);
 }
 
 void Database::remove(const DatabaseNode::Record &key)
 {
-    m_pageReadWriter.startOperation(CachedPageReadWriter::DELETE, key, key);
+    if (m_keyWidth && key.size != m_keyWidth) {
+	return; // there is no such key
+    }
+    if (m_isBuffered) {
+	putMessage(DatabaseNode::DELETE, key, DatabaseNode::Record(0, nullptr));
+	return;
+    }
+    m_pageReadWriter.startOperation(CachedPageReadWriter::DELETE, key, key, m_keyspace);
+    // Merges and borrowing may move rightmost leaf
+    m_appendLeaf = NO_APPEND_LEAF;
 
-    DatabaseNode *rootNode = readRootNode();
     DatabaseNode::Record trash;
     if (!select(key, trash)) {
+	endOperation();
 	return;
     }
+    delete[] trash.data;
+
+    // Files written before roots were collapsed may keep an empty root
+    DatabaseNode *rootNode = collapseRoot(readRootNode());
     removeFromNode(rootNode, key);
-    rootNode->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    rootNode = collapseRoot(rootNode);
+    writeNode(rootNode);
     delete rootNode;
 
-    m_pageReadWriter.endOperation();
+    endOperation();
 }
 
-// TODO: To be implemented
 void Database::sync()
 {
+    m_pageReadWriter.sync();
+}
+
+void Database::setCacheSize(size_t cacheSize)
+{
+    m_pageReadWriter.setCacheSize(cacheSize);
+    m_nodeCache.setLeafCapacity(cacheSize / m_globConfiguration.pageSize() / LEAF_CACHE_DIVISOR);
+}
+
+void Database::compact()
+{
+    if (!m_snapshotRoots.empty()) {
+	throw std::string("Can't compact while snapshots are open");
+    }
+    m_pageReadWriter.checkWritable();
+    m_appendLeaf = NO_APPEND_LEAF;
+    if (m_isCopyOnWrite) {
+	// Moving nodes in place would break committed tree, copy-on-write
+	// already puts every written node to the first free page
+	m_pageReadWriter.shrink();
+	return;
+    }
+
+    // Breadth-first order keeps upper levels together and leaves in key order
+    std::vector<size_t> order;
+    ParentMap parents;
+    std::queue<size_t> toVisit;
+
+    // Root of every keyspace keeps keyspace number in place of link index
+    for (size_t keyspace = 0; keyspace < m_globConfiguration.keyspaceCount(); keyspace++) {
+	size_t root = m_globConfiguration.keyspaceRoot(keyspace);
+	toVisit.push(root);
+	parents[root] = std::make_pair(NO_PARENT, keyspace);
+    }
+    while (!toVisit.empty()) {
+	size_t pageNum = toVisit.front();
+	toVisit.pop();
+	order.push_back(pageNum);
+
+	std::unique_ptr<DatabaseNode> node(loadNode(pageNum));
+	if (!node->isLeaf()) {
+	    for (size_t i = 0; i <= node->keyCount(); i++) {
+		size_t child = node->linkedNodesRootPageNumbers()[i];
+		parents[child] = std::make_pair(pageNum, i);
+		toVisit.push(child);
+	    }
+	}
+    }
+
+    std::map<size_t, size_t> posInOrder;
+    for (size_t i = 0; i < order.size(); i++) {
+	posInOrder[order[i]] = i;
+    }
+
+    // Slots are pages which are free or belong to tree, reserved ones are skipped
+    size_t slot = 1;
+    for (size_t i = 0; i < order.size(); i++, slot++) {
+	while (parents.count(slot) == 0 && m_pageReadWriter.isPageAllocated(slot)) {
+	    slot++;
+	}
+	if (order[i] == slot) {
+	    continue;
+	}
+
+	if (parents.count(slot)) {
+	    // Slot is occupied by node placed later, moving it out of the way
+	    size_t tmp = m_pageReadWriter.allocatePageNumber();
+	    relocateNode(slot, tmp, parents);
+
+	    size_t pos = posInOrder[slot];
+	    posInOrder.erase(slot);
+	    posInOrder[tmp] = pos;
+	    order[pos] = tmp;
+	}
+
+	size_t target = m_pageReadWriter.allocatePageNumber();
+	if (target != slot) {
+	    throw std::string("Compaction slot isn't the first free page");
+	}
+	relocateNode(order[i], slot, parents);
+
+	posInOrder.erase(order[i]);
+	posInOrder[slot] = i;
+	order[i] = slot;
+    }
+
+    m_pageReadWriter.shrink();
+}
+
+size_t Database::createSnapshot()
+{
+    size_t snapshot = m_pageReadWriter.createSnapshot();
+    std::vector<size_t> &roots = m_snapshotRoots[snapshot];
+    for (size_t keyspace = 0; keyspace < m_globConfiguration.keyspaceCount(); keyspace++) {
+	roots.push_back(m_globConfiguration.keyspaceRoot(keyspace));
+    }
+    return snapshot;
+}
+
+void Database::releaseSnapshot(size_t snapshot)
+{
+    m_pageReadWriter.releaseSnapshot(snapshot);
+    m_snapshotRoots.erase(snapshot);
+}
+
+bool Database::selectAtSnapshot(size_t snapshot, const DatabaseNode::Record &key, DatabaseNode::Record &toWrite)
+{
+    std::map<size_t, std::vector<size_t> >::const_iterator roots = m_snapshotRoots.find(snapshot);
+    if (roots == m_snapshotRoots.end()) {
+	throw std::string("Unknown snapshot");
+    }
+    // Keyspace created after snapshot is empty there
+    if (m_keyspace >= roots->second.size() || (m_keyWidth && key.size != m_keyWidth)) {
+	return false;
+    }
+    SnapshotPageReadWriter view(m_pageReadWriter, snapshot);
+    std::unique_ptr<DatabaseNode> rootNode(loadNode(roots->second[m_keyspace], view));
+    std::vector<const DatabaseNode::Record *> upserts;
+    return selectFromNode(view, rootNode.get(), key, toWrite, upserts);
+}
+
+void Database::scanAtSnapshot(
+    size_t snapshot,
+    const DatabaseNode::Record *from,
+    const DatabaseNode::Record *to,
+    const ScanCallback &callback)
+{
+    std::map<size_t, std::vector<size_t> >::const_iterator roots = m_snapshotRoots.find(snapshot);
+    if (roots == m_snapshotRoots.end()) {
+	throw std::string("Unknown snapshot");
+    }
+    if (m_keyspace >= roots->second.size()) {
+	return;
+    }
+    SnapshotPageReadWriter view(m_pageReadWriter, snapshot);
+    std::unique_ptr<DatabaseNode> rootNode(loadNode(roots->second[m_keyspace], view));
+    scanNode(view, rootNode.get(), from, to, Overlay(), callback);
+}
+
+size_t Database::openKeyspace(const std::string &name)
+{
+    size_t keyspace = m_globConfiguration.findKeyspace(name);
+    if (keyspace != GlobalConfiguration::NO_KEYSPACE) {
+	return keyspace;
+    }
+    m_pageReadWriter.checkWritable();
+
+    std::unique_ptr<DatabaseNode> root(createNode()); // empty leaf
+    writeNode(root.get());
+    keyspace = m_globConfiguration.addKeyspace(name, root->rootPage());
+    m_pageReadWriter.flush(); // catalog with new root should reach header
+    m_uncommittedPages.clear();
+    return keyspace;
+}
+
+void Database::useKeyspace(size_t keyspace)
+{
+    if (keyspace >= m_globConfiguration.keyspaceCount()) {
+	throw std::string("Unknown keyspace");
+    }
+    if (keyspace == m_keyspace) {
+	return;
+    }
+    m_keyspace = keyspace;
+    // Hints belong to tree of previous keyspace
+    m_appendLeaf = NO_APPEND_LEAF;
+    m_ascendingInserts = 0;
+    m_lastInsertedKey.clear();
+}
+
+void Database::writeBatch(const std::vector<BatchOperation> &operations)
+{
+    for (const BatchOperation &op : operations) {
+	if (op.type != CachedPageReadWriter::INSERT && op.type != CachedPageReadWriter::DELETE) {
+	    throw std::string("Batch may have inserts and deletes only");
+	}
+	if (op.keyspace >= m_globConfiguration.keyspaceCount()) {
+	    throw std::string("Unknown keyspace");
+	}
+	if (op.type == CachedPageReadWriter::INSERT && m_keyWidth && op.key.size() != m_keyWidth) {
+	    throw std::string("Key size doesn't match fixed key size of database");
+	}
+    }
+    // Pages of batch stay pinned until its end
+    if (operations.size() > batchLimit()) {
+	throw std::string("Batch doesn't fit page cache");
+    }
+
+    size_t keyspace = m_keyspace;
+    std::vector<size_t> roots;
+    for (size_t i = 0; i < m_globConfiguration.keyspaceCount(); i++) {
+	roots.push_back(m_globConfiguration.keyspaceRoot(i));
+    }
+    m_pageReadWriter.startBatch(operations);
+    m_inBatch = true;
+    try {
+	for (const BatchOperation &op : operations) {
+	    useKeyspace(op.keyspace);
+	    DatabaseNode::Record key(op.key.size(), const_cast<char *>(op.key.data()));
+	    if (op.type == CachedPageReadWriter::INSERT) {
+		insert(key, DatabaseNode::Record(op.value.size(), const_cast<char *>(op.value.data())));
+	    } else {
+		remove(key);
+	    }
+	}
+    } catch (...) {
+	// Tree is put back as it was before batch
+	m_inBatch = false;
+	for (size_t i = 0; i < roots.size(); i++) {
+	    m_globConfiguration.setKeyspaceRoot(i, roots[i]);
+	}
+	m_pageReadWriter.abortBatch();
+	m_nodeCache.clear();
+	m_relocatedNodes.clear();
+	m_uncommittedPages.clear();
+	m_appendLeaf = NO_APPEND_LEAF;
+	m_ascendingInserts = 0;
+	m_lastInsertedKey.clear();
+	useKeyspace(keyspace);
+	throw;
+    }
+    m_inBatch = false;
+    useKeyspace(keyspace);
+
+    m_pageReadWriter.endBatch();
+    m_relocatedNodes.clear();
+    m_uncommittedPages.clear();
+}
+
+size_t Database::batchLimit()
+{
+    size_t height = 0;
+    for (size_t i = 0; i < m_globConfiguration.keyspaceCount(); i++) {
+	height = std::max(height, treeHeight(m_globConfiguration.keyspaceRoot(i)));
+    }
+    // Batch may split root, one cell is left for reads
+    size_t pagesPerOperation = BATCH_PAGES_PER_LEVEL * (height + 1);
+    return (m_pageReadWriter.cacheCapacity() - 1) / pagesPerOperation;
+}
+
+size_t Database::treeHeight(size_t rootPage)
+{
+    size_t height = 1;
+    std::shared_ptr<DatabaseNode> node = fetchNode(rootPage, m_pageReadWriter);
+    while (!node->isLeaf()) {
+	node = fetchNode(node->linkedNodesRootPageNumbers()[0], m_pageReadWriter);
+	height++;
+    }
+    return height;
+}
+
+bool Database::scanNode(
+    PageReadWriter &rw,
+    DatabaseNode *x,
+    const DatabaseNode::Record *from,
+    const DatabaseNode::Record *to,
+    const Overlay &newer,
+    const ScanCallback &callback)
+{
+    // Messages of x are older than ones from ancestors
+    Overlay overlay = newer;
+    if (x->hasBuffer()) {
+	for (const DatabaseNode::Message &m : x->messages()) {
+	    if ((!from || !(m.key < *from)) && (!to || m.key < *to)) {
+		addOlderUpdate(overlay, m);
+	    }
+	}
+    }
+
+    if (x->isLeaf()) {
+	// Keys of leaf merged with updates creating new keys
+	size_t i = from ? std::lower_bound(x->keys().begin(), x->keys().end(), *from) - x->keys().begin() : 0;
+	Overlay::const_iterator it = overlay.begin();
+	while (i < x->keyCount() || it != overlay.end()) {
+	    int cmp = it == overlay.end() ? -1 : i == x->keyCount() ? 1 : compareKeys(x->keys()[i], it->first);
+	    if (cmp <= 0) {
+		const DatabaseNode::Record &key = x->keys()[i];
+		if (to && !(key < *to)) {
+		    return false;
+		}
+		if (!emitScanned(key, &x->data()[i], cmp == 0 ? &it->second : nullptr, callback)) {
+		    return false;
+		}
+		i++;
+		if (cmp == 0) {
+		    it++;
+		}
+	    } else {
+		DatabaseNode::Record key(it->first.size(), const_cast<char *>(it->first.data()));
+		if (!emitScanned(key, nullptr, &it->second, callback)) {
+		    return false;
+		}
+		it++;
+	    }
+	}
+	return true;
+    }
+
+    for (size_t i = 0; i <= x->keyCount(); i++) {
+	const DatabaseNode::Record *lower = i > 0 ? &x->keys()[i - 1] : nullptr;
+	const DatabaseNode::Record *upper = i < x->keyCount() ? &x->keys()[i] : nullptr;
+
+	if (!upper || !from || !(*upper < *from)) {
+	    Overlay childOverlay(
+		lower ? overlay.upper_bound(keyString(*lower)) : overlay.begin(),
+		upper ? overlay.lower_bound(keyString(*upper)) : overlay.end());
+	    std::unique_ptr<DatabaseNode> child(loadNode(x->linkedNodesRootPageNumbers()[i], rw));
+	    if (!scanNode(rw, child.get(), from, to, childOverlay, callback)) {
+		return false;
+	    }
+	}
+
+	if (!upper) {
+	    break;
+	}
+	if (from && *upper < *from) {
+	    continue;
+	}
+	if (to && !(*upper < *to)) {
+	    return false;
+	}
+	bool isDeleted = x->hasBuffer() && x->isKeyDeleted()[i];
+	Overlay::const_iterator it = overlay.find(keyString(*upper));
+	if (!emitScanned(*upper, isDeleted ? nullptr : &x->data()[i],
+		it == overlay.end() ? nullptr : &it->second, callback)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void Database::addOlderUpdate(Database::Overlay &overlay, const DatabaseNode::Message &message)
+{
+    std::string key = keyString(message.key);
+    std::string value(message.value.data, message.value.size);
+
+    Overlay::iterator it = overlay.find(key);
+    if (it == overlay.end()) {
+	PendingUpdate &update = overlay[key];
+	update.type = message.type;
+	update.value = value;
+	return;
+    }
+
+    // Newer put or delete hides older message, newer upsert is applied on top
+    PendingUpdate &newer = it->second;
+    if (newer.type == DatabaseNode::UPSERT) {
+	if (message.type == DatabaseNode::DELETE) {
+	    newer.type = DatabaseNode::PUT;
+	} else {
+	    newer.type = message.type;
+	    newer.value = value + newer.value;
+	}
+    }
+}
+
+bool Database::emitScanned(
+    const DatabaseNode::Record &key,
+    const DatabaseNode::Record *base,
+    const PendingUpdate *update,
+    const ScanCallback &callback)
+{
+    if (!update) {
+	return !base || callback(key, *base);
+    }
+    if (update->type == DatabaseNode::DELETE) {
+	return true;
+    }
+
+    std::string value;
+    if (update->type == DatabaseNode::UPSERT && base) {
+	value.assign(base->data, base->size);
+    }
+    value += update->value;
+    return callback(key, DatabaseNode::Record(value.size(), &value[0]));
 }
 
-bool Database::selectFromNode(DatabaseNode *x, const DatabaseNode::Record &key, DatabaseNode::Record &toWrite)
+void Database::relocateNode(size_t from, size_t to, Database::ParentMap &parents)
 {
-    size_t i = std::lower_bound(x->keys().begin(), x->keys().end(), key) - x->keys().begin(); // first >= key
+    std::unique_ptr<DatabaseNode> node(loadNode(from));
+    node->setRootPage(to);
+    writeNode(node.get());
+
+    std::pair<size_t, size_t> parent = parents[from];
+    if (parent.first == NO_PARENT) {
+	m_globConfiguration.setKeyspaceRoot(parent.second, to);
+	m_pageReadWriter.flush(); // new root page number should reach header
+    } else {
+	std::unique_ptr<DatabaseNode> parentNode(loadNode(parent.first));
+	parentNode->linkedNodesRootPageNumbers()[parent.second] = to;
+	parentNode->markDirty();
+	writeNode(parentNode.get());
+    }
+
+    if (!node->isLeaf()) {
+	for (size_t i = 0; i <= node->keyCount(); i++) {
+	    parents[node->linkedNodesRootPageNumbers()[i]].first = to;
+	}
+    }
+    parents.erase(from);
+    parents[to] = parent;
+
+    m_nodeCache.invalidate(from);
+    m_pageReadWriter.deallocatePageNumber(from);
+}
+
+bool Database::selectFromNode(
+    PageReadWriter &rw,
+    DatabaseNode *x,
+    const DatabaseNode::Record &key,
+    DatabaseNode::Record &toWrite,
+    std::vector<const DatabaseNode::Record *> &upserts)
+{
+    const DatabaseNode::Record *base;
+    size_t childPage;
+    if (searchNode(x, key, upserts, base, childPage)) {
+	return resolveSelect(base, upserts, toWrite);
+    }
+    std::shared_ptr<DatabaseNode> nextNode = fetchNode(childPage, rw);
+    return selectFromNode(rw, nextNode.get(), key, toWrite, upserts);
+}
+
+bool Database::searchNode(
+    DatabaseNode *x,
+    const DatabaseNode::Record &key,
+    std::vector<const DatabaseNode::Record *> &upserts,
+    const DatabaseNode::Record *&base,
+    size_t &childPage)
+{
+    base = nullptr;
+    if (x->hasBuffer()) {
+	std::vector<DatabaseNode::Message>::iterator it = findMessage(x->messages(), key);
+	if (it != x->messages().end() && it->key == key) {
+	    if (it->type == DatabaseNode::PUT) {
+		base = &it->value;
+		return true;
+	    } else if (it->type == DatabaseNode::DELETE) {
+		return true;
+	    }
+	    upserts.push_back(&it->value);
+	}
+    }
+
+    size_t i = x->lowerBound(key); // first >= key
 
     if (i < x->keyCount() && key == x->keys()[i]) {
-	toWrite = DatabaseNode::Record::rawCopyFrom(x->data()[i]);
+	bool isDeleted = x->hasBuffer() && x->isKeyDeleted()[i];
+	base = isDeleted ? nullptr : &x->data()[i];
 	return true;
     }
     if (x->isLeaf()) {
+	return true;
+    }
+    childPage = x->linkedNodesRootPageNumbers()[i];
+    return false;
+}
+
+void Database::multiSelect(const DatabaseNode::Record *keys, size_t count, DatabaseNode::Record *values)
+{
+    for (size_t start = 0; start < count; start += MULTI_SELECT_WIDTH) {
+	size_t width = std::min(count - start, MULTI_SELECT_WIDTH);
+	std::vector<PendingLookup> lookups(width);
+	size_t active = 0;
+	for (size_t i = 0; i < width; i++) {
+	    values[start + i] = DatabaseNode::Record(0, nullptr);
+	    lookups[i].isDone = m_keyWidth && keys[start + i].size != m_keyWidth;
+	    lookups[i].nextPage = m_globConfiguration.keyspaceRoot(m_keyspace);
+	    active += !lookups[i].isDone;
+	}
+
+	// Every round takes all lookups one level down: misses of the level
+	// are read ahead together, nodes are searched after all of them are
+	// fetched and prefetched
+	while (active) {
+	    std::vector<size_t> misses;
+	    for (PendingLookup &lookup : lookups) {
+		size_t pageNum = relocatedPage(lookup.nextPage);
+		if (!lookup.isDone && !m_nodeCache.contains(pageNum)) {
+		    misses.push_back(pageNum);
+		}
+	    }
+	    if (misses.size() > 1) {
+		std::sort(misses.begin(), misses.end());
+		misses.erase(std::unique(misses.begin(), misses.end()), misses.end());
+		m_pageReadWriter.willNeed(misses);
+	    }
+
+	    for (PendingLookup &lookup : lookups) {
+		if (!lookup.isDone) {
+		    lookup.path.push_back(fetchNode(lookup.nextPage, m_pageReadWriter));
+		    lookup.path.back()->prefetchSearch();
+		}
+	    }
+
+	    for (size_t i = 0; i < width; i++) {
+		PendingLookup &lookup = lookups[i];
+		if (lookup.isDone) {
+		    continue;
+		}
+		const DatabaseNode::Record *base;
+		if (searchNode(lookup.path.back().get(), keys[start + i], lookup.upserts, base, lookup.nextPage)) {
+		    resolveSelect(base, lookup.upserts, values[start + i]);
+		    lookup.isDone = true;
+		    lookup.path.clear();
+		    active--;
+		} else if (!m_isBuffered) {
+		    lookup.path.clear(); // only upserts point into passed nodes
+		}
+	    }
+	}
+    }
+}
+
+bool Database::resolveSelect(
+    const DatabaseNode::Record *base,
+    const std::vector<const DatabaseNode::Record *> &upserts,
+    DatabaseNode::Record &toWrite)
+{
+    if (!base && upserts.empty()) {
 	return false;
+    }
+
+    size_t size = base ? base->size : 0;
+    for (const DatabaseNode::Record *u : upserts) {
+	size += u->size;
+    }
+    toWrite = DatabaseNode::Record(size, new char[size]);
+
+    // Older upserts are deeper in tree
+    size_t pos = 0;
+    if (base) {
+	memcpy(toWrite.data, base->data, base->size);
+	pos = base->size;
+    }
+    for (size_t i = upserts.size(); i-- > 0;) {
+	memcpy(toWrite.data + pos, upserts[i]->data, upserts[i]->size);
+	pos += upserts[i]->size;
+    }
+    return true;
+}
+
+bool Database::isOverflowed(DatabaseNode *node) const
+{
+    if (node->isLeaf()) {
+	return node->spaceOnDisk() > effectivePageSize();
+    }
+    return node->spaceOnDisk() - node->bufferSpaceOnDisk() > effectivePageSize() / 2;
+}
+
+void Database::putMessage(
+    DatabaseNode::MessageType type,
+    const DatabaseNode::Record &key,
+    const DatabaseNode::Record &value)
+{
+    CachedPageReadWriter::OpType op = type == DatabaseNode::PUT ? CachedPageReadWriter::INSERT
+	: type == DatabaseNode::DELETE ? CachedPageReadWriter::DELETE : CachedPageReadWriter::UPSERT;
+    m_pageReadWriter.startOperation(op, key, value, m_keyspace);
+
+    DatabaseNode::Message m;
+    m.type = type;
+    m.key = DatabaseNode::Record::rawCopyFrom(key);
+    m.value = type == DatabaseNode::DELETE ? DatabaseNode::Record(0, new char[0]) : DatabaseNode::Record::rawCopyFrom(value);
+
+    DatabaseNode *rootNode = readRootNode();
+    if (rootNode->isLeaf()) {
+	applyToLeaf(rootNode, m);
+    } else {
+	addMessage(rootNode, m);
+	flushBuffer(rootNode);
+    }
+
+    if (isOverflowed(rootNode)) {
+	DatabaseNode *s = createNode();
+
+	s->setIsLeaf(false);
+	s->setKeyCount(0);
+	s->linkedNodesRootPageNumbers().push_back(rootNode->rootPage());
+
+	splitChild(s, 0, rootNode);
+	writeNode(rootNode);
+	delete rootNode;
+
+	rootNode = s;
+	writeNode(rootNode);
+	m_pageReadWriter.setKeyspaceRoot(m_keyspace, rootNode->rootPage());
+    }
+
+    writeNode(rootNode);
+    delete rootNode;
+
+    endOperation();
+}
+
+void Database::addMessage(DatabaseNode *x, DatabaseNode::Message &message)
+{
+    x->markDirty();
+    size_t i = std::lower_bound(x->keys().begin(), x->keys().end(), message.key) - x->keys().begin();
+    if (i < x->keyCount() && x->keys()[i] == message.key) {
+	applyToPair(x, i, message);
+	return;
+    }
+
+    std::vector<DatabaseNode::Message> &messages = x->messages();
+    std::vector<DatabaseNode::Message>::iterator it = findMessage(messages, message.key);
+    if (it == messages.end() || !(it->key == message.key)) {
+	messages.insert(it, message);
+	return;
+    }
+
+    // Newer message is combined with older one for the same key
+    if (message.type == DatabaseNode::UPSERT && it->type != DatabaseNode::DELETE) {
+	appendRecord(it->value, message.value);
+	delete[] message.key.data;
+	delete[] message.value.data;
+    } else {
+	if (message.type == DatabaseNode::UPSERT) {
+	    message.type = DatabaseNode::PUT;
+	}
+	delete[] it->key.data;
+	delete[] it->value.data;
+	*it = message;
+    }
+}
+
+void Database::applyToPair(DatabaseNode *x, size_t i, DatabaseNode::Message &message)
+{
+    x->markDirty();
+    DatabaseNode::Record &data = x->data()[i];
+    std::vector<bool>::reference isDeleted = x->isKeyDeleted()[i];
+
+    if (message.type == DatabaseNode::PUT || (message.type == DatabaseNode::UPSERT && isDeleted)) {
+	delete[] data.data;
+	data = message.value;
+	isDeleted = false;
+    } else if (message.type == DatabaseNode::DELETE) {
+	delete[] data.data;
+	data = message.value; // empty
+	isDeleted = true;
     } else {
-	std::unique_ptr<DatabaseNode> nextNode(loadNode(x->linkedNodesRootPageNumbers()[i]));
-	return selectFromNode(nextNode.get(), key, toWrite);
+	appendRecord(data, message.value);
+	delete[] message.value.data;
     }
+    delete[] message.key.data;
+}
+
+void Database::applyToLeaf(DatabaseNode *leaf, DatabaseNode::Message &message)
+{
+    size_t i = std::lower_bound(leaf->keys().begin(), leaf->keys().end(), message.key) - leaf->keys().begin();
+    bool isFound = i < leaf->keyCount() && leaf->keys()[i] == message.key;
+
+    if (message.type == DatabaseNode::DELETE) {
+	if (isFound) {
+	    delete[] leaf->keys()[i].data;
+	    delete[] leaf->data()[i].data;
+	    leaf->keys().erase(leaf->keys().begin() + i);
+	    leaf->data().erase(leaf->data().begin() + i);
+	    leaf->setKeyCount(leaf->keyCount() - 1);
+	}
+	delete[] message.key.data;
+	delete[] message.value.data;
+    } else if (isFound) {
+	leaf->markDirty();
+	if (message.type == DatabaseNode::PUT) {
+	    delete[] leaf->data()[i].data;
+	    leaf->data()[i] = message.value;
+	} else {
+	    appendRecord(leaf->data()[i], message.value);
+	    delete[] message.value.data;
+	}
+	delete[] message.key.data;
+    } else {
+	leaf->keys().insert(leaf->keys().begin() + i, message.key);
+	leaf->data().insert(leaf->data().begin() + i, message.value);
+	leaf->setKeyCount(leaf->keyCount() + 1);
+    }
+}
+
+void Database::flushBuffer(DatabaseNode *x)
+{
+    // Overflowed node is split by caller, it halves buffer as well
+    while (x->spaceOnDisk() > effectivePageSize() && !x->messages().empty() && !isOverflowed(x)) {
+	std::vector<DatabaseNode::Message> &messages = x->messages();
+
+	// Messages are sorted, so every child gets continuous range of them
+	size_t bestChild = 0, bestBegin = 0, bestEnd = 0, bestBytes = 0;
+	size_t begin = 0;
+	for (size_t child = 0; child <= x->keyCount() && begin < messages.size(); child++) {
+	    size_t end = begin, bytes = 0;
+	    while (end < messages.size() && (child == x->keyCount() || messages[end].key < x->keys()[child])) {
+		bytes += x->messageSpaceOnDisk(messages[end]);
+		end++;
+	    }
+	    if (bytes > bestBytes) {
+		bestChild = child;
+		bestBegin = begin;
+		bestEnd = end;
+		bestBytes = bytes;
+	    }
+	    begin = end;
+	}
+
+	std::vector<DatabaseNode::Message> batch(messages.begin() + bestBegin, messages.begin() + bestEnd);
+	messages.erase(messages.begin() + bestBegin, messages.begin() + bestEnd);
+	x->markDirty();
+	m_statistics.bufferFlushes++;
+	flushToChild(x, bestChild, batch);
+    }
+}
+
+void Database::flushToChild(DatabaseNode *x, size_t i, std::vector<DatabaseNode::Message> &batch)
+{
+    DatabaseNode *child = loadNode(x->linkedNodesRootPageNumbers()[i]);
+    if (child->isLeaf()) {
+	for (DatabaseNode::Message &m : batch) {
+	    // Splits below move upper part of range to right siblings
+	    while (i < x->keyCount() && x->keys()[i] < m.key) {
+		writeNode(child);
+		delete child;
+		i++;
+		child = loadNode(x->linkedNodesRootPageNumbers()[i]);
+	    }
+	    if (i < x->keyCount() && x->keys()[i] == m.key) {
+		applyToPair(x, i, m);
+		continue;
+	    }
+
+	    if (m.type != DatabaseNode::DELETE
+		    && child->spaceOnDisk() + child->additionalSpaceFor(m.key, m.value) > effectivePageSize()) {
+		splitChild(x, i, child);
+		if (x->keys()[i] == m.key) {
+		    applyToPair(x, i, m);
+		    continue;
+		}
+		if (x->keys()[i] < m.key) {
+		    writeNode(child);
+		    delete child;
+		    i++;
+		    child = loadNode(x->linkedNodesRootPageNumbers()[i]);
+		}
+	    }
+	    applyToLeaf(child, m);
+	}
+    } else {
+	for (DatabaseNode::Message &m : batch) {
+	    addMessage(child, m);
+	}
+	flushBuffer(child);
+	if (isOverflowed(child)) {
+	    splitChild(x, i, child);
+	}
+    }
+    writeNode(child);
+    delete child;
 }
 
 void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 {
-    size_t i = std::lower_bound(x->keys().begin(), x->keys().end(), key) - x->keys().begin(); // first >= key
+    size_t i = x->lowerBound(key); // first >= key
     if (x->isLeaf()) { // Case 1
 	if (i < x->keyCount() && key == x->keys()[i]) {
 	    delete[] x->keys()[i].data;
@@ -227,8 +1168,9 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 	    delete[] x->data()[i].data;
 	    x->keys()[i] = replacingKey;
 	    x->data()[i] = replacingData;
+	    x->markDirty();
 
-	    y->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(y);
 	} else if (z->spaceOnDisk() >= effectivePageSize() / 2) {
 	    DatabaseNode::Record replacingKey, replacingData;
 	    findLeftmostKey(z, replacingKey, replacingData);
@@ -238,12 +1180,13 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 	    delete[] x->data()[i].data;
 	    x->keys()[i] = replacingKey;
 	    x->data()[i] = replacingData;
+	    x->markDirty();
 
-	    z->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(z);
 	} else { // Case 2 c
 	    merge(y, x, i, z);
 	    removeFromNode(y, key);
-	    y->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(y);
 	}
 	delete y;
 	delete z;
@@ -252,7 +1195,7 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 	DatabaseNode *y = loadNode(x->linkedNodesRootPageNumbers()[i]);
 	if (y->spaceOnDisk() >= effectivePageSize() / 2) {
 	    removeFromNode(y, key);
-	    y->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(y);
 	    delete y;
 	    return;
 	}
@@ -275,6 +1218,7 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 
 	    x->keys()[i - 1] = yLeft->keys().back();
 	    x->data()[i - 1] = yLeft->data().back();
+	    x->markDirty();
 
 	    yLeft->keys().pop_back();
 	    yLeft->data().pop_back();
@@ -295,6 +1239,7 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 
 	    x->keys()[i] = yRight->keys()[0];
 	    x->data()[i] = yRight->data()[0];
+	    x->markDirty();
 
 	    yRight->keys().erase(yRight->keys().begin());
 	    yRight->data().erase(yRight->data().begin());
@@ -316,18 +1261,18 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 	}
 
 	if (writeY) {
-	    y->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(y);
 	}
 	delete y;
 
 	if (yLeft) {
-	    yLeft->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    writeNode(yLeft);
 	    delete yLeft;
 	}
 
 	if (yRight) {
 	    if (writeRight) {
-		yRight->writeToPages(&m_globConfiguration, m_pageReadWriter);
+		writeNode(yRight);
 	    }
 	    delete yRight;
 	}
@@ -336,32 +1281,140 @@ void Database::removeFromNode(DatabaseNode *x, const DatabaseNode::Record &key)
 
 DatabaseNode *Database::createNode()
 {
+    size_t pageNum = m_pageReadWriter.allocatePageNumber();
+    if (m_isCopyOnWrite) {
+	m_uncommittedPages.insert(pageNum);
+    }
     return new DatabaseNode(
 	&m_globConfiguration,
 	m_pageReadWriter,
-	m_pageReadWriter.allocatePageNumber(),
-	false
+	pageNum,
+	false,
+	m_isBuffered,
+	m_keyWidth
     );
 }
 
 DatabaseNode *Database::loadNode(size_t pageNum)
+{
+    pageNum = relocatedPage(pageNum);
+    std::shared_ptr<DatabaseNode> cached = m_nodeCache.get(pageNum);
+    if (cached) {
+	return cached->clone();
+    }
+    return loadNode(pageNum, m_pageReadWriter);
+}
+
+std::shared_ptr<DatabaseNode> Database::fetchNode(size_t pageNum, PageReadWriter &rw)
+{
+    // Snapshot view may see older version of page
+    if (&rw != &m_pageReadWriter) {
+	return std::shared_ptr<DatabaseNode>(loadNode(pageNum, rw));
+    }
+
+    pageNum = relocatedPage(pageNum);
+    std::shared_ptr<DatabaseNode> node = m_nodeCache.get(pageNum);
+    if (!node) {
+	node.reset(loadNode(pageNum, rw));
+	m_nodeCache.put(pageNum, node);
+    }
+    return node;
+}
+
+size_t Database::relocatedPage(size_t pageNum) const
+{
+    // Parent may still link old page of node written in this operation
+    std::map<size_t, size_t>::const_iterator it = m_relocatedNodes.find(pageNum);
+    return it == m_relocatedNodes.end() ? pageNum : it->second;
+}
+
+void Database::writeNode(DatabaseNode *x)
+{
+    if (m_isCopyOnWrite) {
+	updateRelocatedLinks(x);
+    }
+    if (!x->isDirty()) {
+	m_statistics.nodeWritesAvoided++;
+	return;
+    }
+    if (m_isCopyOnWrite) {
+	relocateForWrite(x);
+    }
+    m_nodeCache.invalidate(x->rootPage());
+    x->writeToPages(&m_globConfiguration, m_pageReadWriter);
+}
+
+void Database::updateRelocatedLinks(DatabaseNode *x)
+{
+    // Children are written before parent, so links get their new pages here
+    if (x->isLeaf()) {
+	return;
+    }
+    for (size_t &link : x->linkedNodesRootPageNumbers()) {
+	std::map<size_t, size_t>::const_iterator it = m_relocatedNodes.find(link);
+	if (it != m_relocatedNodes.end()) {
+	    link = it->second;
+	    x->markDirty();
+	}
+    }
+}
+
+void Database::relocateForWrite(DatabaseNode *x)
+{
+    size_t oldPage = x->rootPage();
+    if (m_uncommittedPages.count(oldPage)) {
+	return;
+    }
+    size_t newPage = m_pageReadWriter.allocatePageNumber();
+    m_uncommittedPages.insert(newPage);
+    m_relocatedNodes[oldPage] = newPage;
+    x->setRootPage(newPage);
+    if (m_globConfiguration.keyspaceRoot(m_keyspace) == oldPage) {
+	m_globConfiguration.setKeyspaceRoot(m_keyspace, newPage);
+    }
+    m_nodeCache.invalidate(oldPage);
+    m_pageReadWriter.deallocatePageNumber(oldPage); // reused after commit only
+}
+
+void Database::endOperation()
+{
+    if (m_inBatch) {
+	return; // whole batch is committed by writeBatch
+    }
+    m_pageReadWriter.endOperation();
+    // Everything written by operation is committed now
+    m_relocatedNodes.clear();
+    m_uncommittedPages.clear();
+}
+
+DatabaseNode *Database::loadNode(size_t pageNum, PageReadWriter &rw)
 {
     return new DatabaseNode(
 	&m_globConfiguration,
-	m_pageReadWriter,
+	rw,
 	pageNum,
-	true
+	true,
+	m_isBuffered,
+	m_keyWidth
     );
 }
 
 DatabaseNode *Database::readRootNode()
 {
-    return new DatabaseNode(
-	&m_globConfiguration,
-	m_pageReadWriter,
-	m_globConfiguration.rootNodePageNumber(),
-	true
-    );
+    return loadNode(m_globConfiguration.keyspaceRoot(m_keyspace));
+}
+
+DatabaseNode *Database::collapseRoot(DatabaseNode *root)
+{
+    while (!root->isLeaf() && root->keyCount() == 0) {
+	size_t child = relocatedPage(root->linkedNodesRootPageNumbers()[0]);
+	m_pageReadWriter.setKeyspaceRoot(m_keyspace, child);
+	m_nodeCache.invalidate(root->rootPage());
+	root->freePages(m_pageReadWriter);
+	delete root;
+	root = loadNode(child);
+    }
+    return root;
 }
 
 void Database::findLeftmostKey(DatabaseNode *node, DatabaseNode::Record &key, DatabaseNode::Record &value)
@@ -390,6 +1443,7 @@ void Database::findRightmostKey(DatabaseNode *node, DatabaseNode::Record &key, D
 
 void Database::merge(DatabaseNode *y, DatabaseNode *x, size_t i, DatabaseNode *z)
 {
+    m_statistics.merges++;
     y->keys().push_back(x->keys()[i]);
     y->data().push_back(x->data()[i]);
     x->keys().erase(x->keys().begin() + i);
@@ -415,5 +1469,6 @@ void Database::merge(DatabaseNode *y, DatabaseNode *x, size_t i, DatabaseNode *z
     x->setKeyCount(x->keyCount() - 1);
     y->setKeyCount(y->keyCount() + 1 + z->keyCount());
     z->setKeyCount(0);
+    m_nodeCache.invalidate(z->rootPage());
     z->freePages(m_pageReadWriter);
 }
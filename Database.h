@@ -1,18 +1,22 @@
 #pragma once
 
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
 #include "CachedPageReadWriter.h"
+#include "DatabaseEngine.h"
 #include "DatabaseNode.h"
+#include "NodeCache.h"
 
-class Database
+/// B-tree engine, in buffered mode (B-epsilon tree) internal nodes keep
+/// part of page for messages which are flushed down in batches
+class Database : public DatabaseEngine
 {
-public:
-    struct Configuration
-    {
-	size_t size;
-	size_t pageSize;
-	size_t cacheSize;
-    };
+    friend class DatabaseBenchmark;
 
+public:
     Database(const char *databaseFile, const Database::Configuration &configuration);
     ~Database();
 
@@ -20,32 +24,152 @@ public:
     void remove(const DatabaseNode::Record &key);
     void insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
     bool select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite);
+    /// Interleaves lookups level by level, so page misses of a group of
+    /// lookups are read ahead together
+    void multiSelect(const DatabaseNode::Record *keys, size_t count, DatabaseNode::Record *values);
+    /// Buffered mode stores upsert as message without reading old value
+    void upsert(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
 
-    //To be implemented
     void sync();
 
+    /// Moves live nodes to the file start in key order and truncates free tail
+    void compact();
+    /// Node cache keeps leaves in proportion to page cache
+    void setCacheSize(size_t cacheSize);
+
+    size_t createSnapshot();
+    void releaseSnapshot(size_t snapshot);
+    bool selectAtSnapshot(size_t snapshot, const DatabaseNode::Record &key, DatabaseNode::Record &toWrite);
+    void scanAtSnapshot(
+	size_t snapshot,
+	const DatabaseNode::Record *from,
+	const DatabaseNode::Record *to,
+	const ScanCallback &callback
+    );
+
+    size_t openKeyspace(const std::string &name);
+    void useKeyspace(size_t keyspace);
+    /// Inserts and deletes only: batch which fails or is cut by crash
+    /// leaves no change. Batch longer than batchLimit() is refused
+    void writeBatch(const std::vector<BatchOperation> &operations);
+    size_t batchLimit();
+
 private:
+    /// Parent page and link index of every node, root has no parent
+    typedef std::map<size_t, std::pair<size_t, size_t> > ParentMap;
+    static const size_t NO_PARENT = static_cast<size_t>(-1);
+    /// Decoded leaves are kept for this share of page cache cells
+    static const size_t LEAF_CACHE_DIVISOR = 4;
+    static const size_t NO_APPEND_LEAF = static_cast<size_t>(-1);
+    /// Ascending inserts in a row after which splits keep left node full
+    static const size_t SEQUENTIAL_RUN = 8;
+    /// Lookups of multiSelect going down the tree together
+    static const size_t MULTI_SELECT_WIDTH = 16;
+    /// Pages one batch operation usually changes on every level of tree:
+    /// node and its split or merged sibling. Batch over estimate is aborted
+    static const size_t BATCH_PAGES_PER_LEVEL = 2;
+
+    /// Same order as DatabaseNode::Record
+    struct KeyLess
+    {
+	bool operator()(const std::string &a, const std::string &b) const;
+    };
+
+    /// Buffered messages for one key combined from newest to oldest
+    struct PendingUpdate
+    {
+	DatabaseNode::MessageType type;
+	std::string value;
+    };
+    typedef std::map<std::string, PendingUpdate, KeyLess> Overlay;
+
+    /// Lookup of multiSelect stopped before node at nextPage
+    struct PendingLookup
+    {
+	/// Nodes passed by lookup, upserts point into them
+	std::vector<std::shared_ptr<DatabaseNode> > path;
+	std::vector<const DatabaseNode::Record *> upserts;
+	size_t nextPage;
+	bool isDone;
+    };
+
     GlobalConfiguration m_globConfiguration;
     CachedPageReadWriter m_pageReadWriter;
+    NodeCache m_nodeCache;
+    bool m_isBuffered;
+    /// Size of every key, 0 when keys may have any size
+    size_t m_keyWidth;
+    /// Root pages of all keyspaces of every open snapshot
+    std::map<size_t, std::vector<size_t> > m_snapshotRoots;
+    /// Keyspace of tree which operations go to
+    size_t m_keyspace;
+    /// Operations of batch are committed together by writeBatch
+    bool m_inBatch;
+
+    /// Copy-on-write: committed nodes are written to new pages, old page
+    /// is released by page read writer after commit
+    bool m_isCopyOnWrite;
+    /// Old page to new one for nodes written in current operation
+    std::map<size_t, size_t> m_relocatedNodes;
+    /// Pages allocated in current operation, they are written in place
+    std::set<size_t> m_uncommittedPages;
+
+    /// Rightmost leaf and its last key, insert of bigger key goes straight
+    /// to the leaf while it has room. Reset by every change of tree shape
+    size_t m_appendLeaf;
+    std::string m_appendMaxKey;
+    /// Previous inserted key and count of ascending inserts ending with it
+    std::string m_lastInsertedKey;
+    size_t m_ascendingInserts;
 
     size_t effectivePageSize() const;
+    void checkKeySize(const DatabaseNode::Record &key) const;
 
+    /// Upserts are collected from buffers on the way down, newest first
     bool selectFromNode(
+	PageReadWriter &rw,
 	DatabaseNode *node,
 	const DatabaseNode::Record &key,
+	DatabaseNode::Record &toWrite,
+	std::vector<const DatabaseNode::Record *> &upserts
+    );
+
+    /// Returns true when search result is known, base is value found in
+    /// node x or nullptr. Otherwise sets page of child where search goes on
+    bool searchNode(
+	DatabaseNode *x,
+	const DatabaseNode::Record &key,
+	std::vector<const DatabaseNode::Record *> &upserts,
+	const DatabaseNode::Record *&base,
+	size_t &childPage
+    );
+
+    bool resolveSelect(
+	const DatabaseNode::Record *base,
+	const std::vector<const DatabaseNode::Record *> &upserts,
 	DatabaseNode::Record &toWrite
     );
 
+    /// Node is on rightmost path when every link to it was the last one
     void insertNonFull(
 	DatabaseNode *node,
 	const DatabaseNode::Record &key,
-	const DatabaseNode::Record &value
+	const DatabaseNode::Record &value,
+	bool isRightmost
     );
 
+    /// Returns false when rightmost leaf hint can't take key
+    bool appendToRightmostLeaf(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
+    void trackInsertOrder(const DatabaseNode::Record &key);
+    /// Sequential insert of key bigger than all keys of rightmost node y
+    bool isAppendTo(DatabaseNode *y, const DatabaseNode::Record &key) const;
+
+    /// Append split leaves y full and moves only its last keys to new node
     void splitChild(
 	DatabaseNode *x,
 	size_t i,
-	DatabaseNode *y
+	DatabaseNode *y,
+	bool isAppend = false
     );
 
     void removeFromNode(
@@ -53,9 +177,23 @@ private:
 	const DatabaseNode::Record &key
     );
 
+    /// Returns own copy for changing, follows relocations of current operation
     DatabaseNode *loadNode(size_t pageNum);
+    DatabaseNode *loadNode(size_t pageNum, PageReadWriter &rw);
+    /// Read-only node, shared with node cache unless rw is snapshot view
+    std::shared_ptr<DatabaseNode> fetchNode(size_t pageNum, PageReadWriter &rw);
+    size_t relocatedPage(size_t pageNum) const;
     DatabaseNode *createNode();
     DatabaseNode *readRootNode();
+    /// Internal root left without keys by merge is replaced by its only
+    /// child and freed, returns the new root
+    DatabaseNode *collapseRoot(DatabaseNode *root);
+    void writeNode(DatabaseNode *node);
+    void updateRelocatedLinks(DatabaseNode *node);
+    void relocateForWrite(DatabaseNode *node);
+    void endOperation();
+    /// Levels of tree, counted down its leftmost path
+    size_t treeHeight(size_t rootPage);
 
     void findRightmostKey(
 	DatabaseNode *node,
@@ -75,4 +213,47 @@ private:
 	size_t i,
 	DatabaseNode *z
     );
+
+    /// Buffered mode: node has more keys than half of effective page size,
+    /// leaf has more than effective page size
+    bool isOverflowed(DatabaseNode *node) const;
+
+    /// Returns false when scan is over
+    bool scanNode(
+	PageReadWriter &rw,
+	DatabaseNode *node,
+	const DatabaseNode::Record *from,
+	const DatabaseNode::Record *to,
+	const Overlay &newer,
+	const ScanCallback &callback
+    );
+
+    static void addOlderUpdate(Overlay &overlay, const DatabaseNode::Message &message);
+    static bool emitScanned(
+	const DatabaseNode::Record &key,
+	const DatabaseNode::Record *base,
+	const PendingUpdate *update,
+	const ScanCallback &callback
+    );
+
+    void putMessage(
+	DatabaseNode::MessageType type,
+	const DatabaseNode::Record &key,
+	const DatabaseNode::Record &value
+    );
+
+    // Functions below take ownership of message records
+    void addMessage(DatabaseNode *x, DatabaseNode::Message &message);
+    void applyToPair(DatabaseNode *x, size_t i, DatabaseNode::Message &message);
+    void applyToLeaf(DatabaseNode *leaf, DatabaseNode::Message &message);
+
+    /// Moves messages of children with most buffered bytes down until buffer fits
+    void flushBuffer(DatabaseNode *x);
+    void flushToChild(DatabaseNode *x, size_t i, std::vector<DatabaseNode::Message> &batch);
+
+    void relocateNode(
+	size_t from,
+	size_t to,
+	ParentMap &parents
+    );
 };
@@ -0,0 +1,196 @@
+#include "DatabaseEngine.h"
+
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Database.h"
+#include "DiskPageReadWriter.h"
+#include "HashDatabase.h"
+#include "LsmDatabase.h"
+#include "MemoryPageReadWriter.h"
+
+DatabaseEngine *DatabaseEngine::create(const char *databaseFile, const Configuration &configuration)
+{
+    Configuration actual = configuration;
+    if (configuration.readOnly != READ_WRITE && configuration.inMemory) {
+	throw std::string("In-memory database can't be opened read-only");
+    }
+    if (!configuration.inMemory) {
+	int fd = open(databaseFile, O_RDONLY);
+	if (fd != -1) {
+	    GlobalConfiguration stored(0, 0, 0, 0, 0, 0, "");
+	    try {
+		stored.readFromFile(fd);
+	    } catch (std::string err) {
+		::close(fd);
+		throw;
+	    }
+	    ::close(fd);
+	    actual.engine = static_cast<EngineType>(stored.engineType() & ENGINE_TYPE_MASK);
+	    actual.fixedKeySize = stored.engineType() >> KEY_SIZE_SHIFT;
+	    actual.compactFormat = stored.formatVersion() == GlobalConfiguration::FORMAT_COMPACT;
+	    actual.copyOnWrite = false; // stored journal path decides
+	} else if (configuration.readOnly != READ_WRITE) {
+	    throw std::string("Read-only database file doesn't exist");
+	}
+    }
+
+    if (actual.copyOnWrite && actual.engine != BTREE && actual.engine != BTREE_BUFFERED) {
+	throw std::string("Copy-on-write mode is supported by B-tree engines only");
+    }
+    if (actual.fixedKeySize && actual.engine != BTREE && actual.engine != BTREE_BUFFERED) {
+	throw std::string("Fixed key size is supported by B-tree engines only");
+    }
+    if (actual.compactFormat && actual.engine != BTREE && actual.engine != BTREE_BUFFERED) {
+	throw std::string("Compact format is supported by B-tree engines only");
+    }
+
+    switch (actual.engine) {
+    case BTREE:
+    case BTREE_BUFFERED:
+	return new Database(databaseFile, actual);
+    case HASH:
+	return new HashDatabase(databaseFile, actual);
+    case LSM:
+	return new LsmDatabase(databaseFile, actual);
+    }
+    throw std::string("Unknown database engine");
+}
+
+DatabaseEngine::DatabaseEngine(const Configuration &configuration)
+    : m_memoryBudget(configuration.memoryBudget)
+{
+}
+
+DatabaseEngine::~DatabaseEngine()
+{
+}
+
+void DatabaseEngine::upsert(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+{
+    DatabaseNode::Record old;
+    if (!select(key, old)) {
+	insert(key, value);
+	return;
+    }
+
+    std::string joined(old.data, old.size);
+    delete[] old.data;
+    joined.append(value.data, value.size);
+    insert(key, DatabaseNode::Record(joined.size(), &joined[0]));
+}
+
+void DatabaseEngine::multiSelect(const DatabaseNode::Record *keys, size_t count, DatabaseNode::Record *values)
+{
+    for (size_t i = 0; i < count; i++) {
+	values[i] = DatabaseNode::Record(0, nullptr);
+	select(keys[i], values[i]);
+    }
+}
+
+size_t DatabaseEngine::createSnapshot()
+{
+    throw std::string("Snapshots aren't supported by this engine");
+}
+
+void DatabaseEngine::releaseSnapshot(size_t)
+{
+    throw std::string("Snapshots aren't supported by this engine");
+}
+
+bool DatabaseEngine::selectAtSnapshot(size_t, const DatabaseNode::Record &, DatabaseNode::Record &)
+{
+    throw std::string("Snapshots aren't supported by this engine");
+}
+
+void DatabaseEngine::scanAtSnapshot(
+    size_t,
+    const DatabaseNode::Record *,
+    const DatabaseNode::Record *,
+    const ScanCallback &)
+{
+    throw std::string("Scans aren't supported by this engine");
+}
+
+void DatabaseEngine::scan(
+    const DatabaseNode::Record *from,
+    const DatabaseNode::Record *to,
+    const ScanCallback &callback)
+{
+    size_t snapshot = createSnapshot();
+    try {
+	scanAtSnapshot(snapshot, from, to, callback);
+    } catch (...) {
+	releaseSnapshot(snapshot);
+	throw;
+    }
+    releaseSnapshot(snapshot);
+}
+
+size_t DatabaseEngine::openKeyspace(const std::string &)
+{
+    throw std::string("Keyspaces are supported by B-tree engines only");
+}
+
+void DatabaseEngine::useKeyspace(size_t keyspace)
+{
+    if (keyspace != 0) {
+	throw std::string("Keyspaces are supported by B-tree engines only");
+    }
+}
+
+void DatabaseEngine::writeBatch(const std::vector<BatchOperation> &)
+{
+    throw std::string("Batches are supported by B-tree engines only");
+}
+
+size_t DatabaseEngine::batchLimit()
+{
+    return 0;
+}
+
+Statistics &DatabaseEngine::statistics()
+{
+    return m_statistics;
+}
+
+const MemoryBudget &DatabaseEngine::memoryBudget() const
+{
+    return m_memoryBudget;
+}
+
+std::string DatabaseEngine::journalFile(const char *databaseFile)
+{
+    // Files created before keep journal path stored in their header
+    return std::string(databaseFile) + ".journal";
+}
+
+void DatabaseEngine::setUpWarmUp(
+    const char *databaseFile,
+    const Configuration &configuration,
+    CachedPageReadWriter &pageReadWriter)
+{
+    if (configuration.inMemory || configuration.warmUp == WARM_UP_NONE) {
+	return;
+    }
+    pageReadWriter.enableWarmUp(std::string(databaseFile) + ".warm", configuration.warmUp == WARM_UP_BACKGROUND);
+}
+
+PageReadWriter *DatabaseEngine::createSource(
+    const char *databaseFile,
+    const Configuration &configuration,
+    GlobalConfiguration *globConf,
+    Statistics *stats)
+{
+    if (configuration.inMemory) {
+	return new MemoryPageReadWriter(globConf, stats);
+    }
+    return new DiskPageReadWriter(
+	databaseFile,
+	globConf,
+	stats,
+	configuration.readOnly != READ_WRITE,
+	configuration.readOnly == READ_ONLY_MMAP);
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "CachedPageReadWriter.h"
+#include "DatabaseNode.h"
+#include "GlobalConfiguration.h"
+#include "MemoryBudget.h"
+#include "PageReadWriter.h"
+#include "Statistics.h"
+
+/// Key-value storage behind the C API
+class DatabaseEngine
+{
+public:
+    enum EngineType {
+	BTREE = 0,
+	HASH = 1,
+	LSM = 2,
+	/// B-tree with message buffers in internal nodes
+	BTREE_BUFFERED = 3
+    };
+
+    /// Engine type word of file header keeps fixed key size of B-tree
+    /// in bits above engine type
+    static const size_t ENGINE_TYPE_MASK = 0xFF;
+    static const size_t KEY_SIZE_SHIFT = 8;
+
+    enum WarmUp {
+	WARM_UP_NONE = 0,
+	WARM_UP_LOAD = 1,
+	/// Only kernel read-ahead is requested
+	WARM_UP_BACKGROUND = 2
+    };
+
+    enum ReadOnly {
+	READ_WRITE = 0,
+	READ_ONLY = 1,
+	/// File is read through shared mapping
+	READ_ONLY_MMAP = 2
+    };
+
+    struct Configuration
+    {
+	size_t size;
+	size_t pageSize;
+	size_t cacheSize;
+	/// Keep pages in memory only, without file and journal
+	bool inMemory;
+	/// Used for new databases, existing ones keep the stored type
+	EngineType engine;
+	/// New B-tree database is updated by copy-on-write instead of journal
+	bool copyOnWrite;
+	/// Page cache of file database is restored from <file>.warm
+	WarmUp warmUp;
+	/// New B-tree database takes keys of this size only and stores them
+	/// without sizes, 0 allows keys of any size
+	size_t fixedKeySize;
+	/// New B-tree database stores nodes in GlobalConfiguration::FORMAT_COMPACT
+	bool compactFormat;
+	/// Limit of memory counted by MemoryBudget, 0 for no limit
+	size_t memoryBudget;
+	/// Existing file database is opened without journal and header writes
+	ReadOnly readOnly;
+    };
+
+    /// Gets every key and value in scan order, returns false to stop scan
+    typedef std::function<bool(const DatabaseNode::Record &, const DatabaseNode::Record &)> ScanCallback;
+
+    /// Operation of atomic batch, keyspace says which tree it changes
+    typedef CachedPageReadWriter::LoggedOperation BatchOperation;
+
+    /// Opens database with the engine it was created with
+    static DatabaseEngine *create(const char *databaseFile, const Configuration &configuration);
+
+    virtual ~DatabaseEngine();
+
+    virtual void close() = 0;
+    virtual void remove(const DatabaseNode::Record &key) = 0;
+    virtual void insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value) = 0;
+    virtual bool select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite) = 0;
+    /// Looks count keys up, value data is nullptr for absent key
+    virtual void multiSelect(const DatabaseNode::Record *keys, size_t count, DatabaseNode::Record *values);
+    /// Appends value to stored one or stores value if key is absent
+    virtual void upsert(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
+    virtual void sync() = 0;
+    /// Releases unused space of database file
+    virtual void compact() = 0;
+    /// Resizes page cache of open database, stored cache size isn't changed
+    virtual void setCacheSize(size_t cacheSize) = 0;
+
+    /// Snapshot reads see database as it was at snapshot creation
+    virtual size_t createSnapshot();
+    virtual void releaseSnapshot(size_t snapshot);
+    virtual bool selectAtSnapshot(size_t snapshot, const DatabaseNode::Record &key, DatabaseNode::Record &toWrite);
+    /// Keys from *from inclusive to *to exclusive in DatabaseNode::Record order,
+    /// nullptr bound means no bound
+    virtual void scanAtSnapshot(
+	size_t snapshot,
+	const DatabaseNode::Record *from,
+	const DatabaseNode::Record *to,
+	const ScanCallback &callback
+    );
+    /// Scans temporary snapshot, so callback may change database
+    void scan(const DatabaseNode::Record *from, const DatabaseNode::Record *to, const ScanCallback &callback);
+
+    /// Named keyspaces are separate trees of one file sharing page cache
+    /// and journal, keyspace 0 is the default one. Creates missing keyspace
+    virtual size_t openKeyspace(const std::string &name);
+    /// Operations below go to this keyspace
+    virtual void useKeyspace(size_t keyspace);
+    /// Applies inserts and deletes of all keyspaces as one operation
+    virtual void writeBatch(const std::vector<BatchOperation> &operations);
+    /// Most operations batch may have at current cache size and tree
+    /// heights, 0 when batches aren't supported
+    virtual size_t batchLimit();
+
+    Statistics &statistics();
+    const MemoryBudget &memoryBudget() const;
+
+protected:
+    Statistics m_statistics;
+    MemoryBudget m_memoryBudget;
+
+    explicit DatabaseEngine(const Configuration &configuration);
+
+    /// Journal of new database file, lives next to it
+    static std::string journalFile(const char *databaseFile);
+
+    /// Turns warm-up on for file databases when configuration asks for it
+    static void setUpWarmUp(
+	const char *databaseFile,
+	const Configuration &configuration,
+	CachedPageReadWriter &pageReadWriter
+    );
+
+    static PageReadWriter *createSource(
+	const char *databaseFile,
+	const Configuration &configuration,
+	GlobalConfiguration *globConf,
+	Statistics *stats
+    );
+};
@@ -1,9 +1,116 @@
 #include "DatabaseNode.h"
 
 #include <string>
+#include <algorithm>
 #include <climits>
+#include <cstdint>
 #include <cstring>
 
+namespace {
+
+/// Fixed-width key read as big-endian word compares like memcmp
+template <size_t Width>
+struct KeyWord;
+
+template <>
+struct KeyWord<4>
+{
+    typedef uint32_t Type;
+    static Type load(const char *data)
+    {
+	Type res;
+	memcpy(&res, data, sizeof(res));
+	return __builtin_bswap32(res);
+    }
+};
+
+template <>
+struct KeyWord<8>
+{
+    typedef uint64_t Type;
+    static Type load(const char *data)
+    {
+	Type res;
+	memcpy(&res, data, sizeof(res));
+	return __builtin_bswap64(res);
+    }
+};
+
+template <size_t Width>
+size_t lowerBoundFixed(const std::vector<DatabaseNode::Record> &keys, size_t count, const DatabaseNode::Record &key)
+{
+    if (!count) {
+	return 0;
+    }
+    typename KeyWord<Width>::Type target = KeyWord<Width>::load(key.data);
+    const DatabaseNode::Record *base = keys.data();
+    while (count > 1) {
+	size_t half = count / 2;
+	base = KeyWord<Width>::load(base[half].data) < target ? base + half : base;
+	count -= half;
+    }
+    return base - keys.data() + (KeyWord<Width>::load(base->data) < target);
+}
+
+/// Keys of other sizes are ordered by size, so size of key with variable
+/// size goes to top bits of its prefix
+const size_t PREFIX_SIZE_LIMIT = 0xFFFF;
+
+/// First 8 bytes as big-endian word, missing bytes are zero
+uint64_t loadPrefix(const char *data, size_t size)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (size >= 8) {
+	return KeyWord<8>::load(data);
+    }
+#endif
+    uint64_t res = 0;
+    for (size_t i = 0; i < 8; i++) {
+	res = res << 8 | (i < size ? static_cast<unsigned char>(data[i]) : 0);
+    }
+    return res;
+}
+
+/// Little-endian base 128: 7 bits per byte, high bit is set on all bytes
+/// but the last
+size_t varintSize(size_t value)
+{
+    size_t res = 1;
+    while (value >= 0x80) {
+	value >>= 7;
+	res++;
+    }
+    return res;
+}
+
+void writeVarint(Page &p, size_t value)
+{
+    unsigned char buf[10];
+    size_t size = 0;
+    while (value >= 0x80) {
+	buf[size++] = static_cast<unsigned char>(value) | 0x80;
+	value >>= 7;
+    }
+    buf[size++] = static_cast<unsigned char>(value);
+    p.write(buf, size);
+}
+
+size_t readVarint(Page &p)
+{
+    size_t res = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+	unsigned char byte;
+	p.read(&byte, sizeof(byte));
+	res |= static_cast<size_t>(byte & 0x7F) << shift;
+	if (!(byte & 0x80)) {
+	    return res;
+	}
+    }
+    throw std::string("Corrupted varint in node page");
+}
+
+}
+
 DatabaseNode::Record::Record(size_t _size, char *_data)
     : size(_size)
     , data(_data)
@@ -53,7 +160,19 @@ DatabaseNode::Record DatabaseNode::Record::rawCopyFrom(const DatabaseNode::Recor
     return res;
 }
 
-DatabaseNode::DatabaseNode(GlobalConfiguration *globConf, PageReadWriter &rw, size_t rootPageNumber, bool needRead)
+DatabaseNode::DatabaseNode(
+    GlobalConfiguration *globConf,
+    PageReadWriter &rw,
+    size_t rootPageNumber,
+    bool needRead,
+    bool isBuffered,
+    size_t keyWidth)
+    : m_isBuffered(isBuffered)
+    , m_isDirty(!needRead)
+    , m_keyWidth(keyWidth)
+    , m_isCompact(globConf->formatVersion() == GlobalConfiguration::FORMAT_COMPACT)
+    , m_prefixSkip(0)
+    , m_searchCount(0)
 {
     if (needRead) {
 	m_rootPageNumber = rootPageNumber;
@@ -63,11 +182,13 @@ DatabaseNode::DatabaseNode(GlobalConfiguration *globConf, PageReadWriter &rw, si
 
 	p->seek(0);
 	p->read(&m_isLeaf, sizeof(m_isLeaf));
-	p->read(&m_keyCount, sizeof(m_keyCount));
+	m_keyCount = readWord(*p);
 
 	for (size_t i = 0; i < m_keyCount; i++) {
-	    size_t keySize;
-	    p->read(&keySize, sizeof(keySize));
+	    size_t keySize = m_keyWidth;
+	    if (!m_keyWidth) {
+		keySize = readLength(*p);
+	    }
 
 	    char *keyValue = new char[keySize];
 	    p->read(keyValue, keySize);
@@ -76,20 +197,46 @@ DatabaseNode::DatabaseNode(GlobalConfiguration *globConf, PageReadWriter &rw, si
 	}
 
 	for (size_t i = 0; i < m_keyCount; i++) {
-	    size_t dataSize;
-	    p->read(&dataSize, sizeof(dataSize));
+	    size_t dataSize = readLength(*p);
 
 	    char *dataValue = new char[dataSize];
-	    p->read(dataValue, dataSize);
+	    if (dataSize) {
+		p->read(dataValue, dataSize);
+	    }
 
 	    m_data.push_back(Record(dataSize, dataValue));
 	}
 
 	if (!m_isLeaf) {
 	    for (size_t i = 0; i <= m_keyCount; i++) {
-		size_t linkedNodePageNumber;
-		p->read(&linkedNodePageNumber, sizeof(linkedNodePageNumber));
-		m_linkedNodesRootPageNumbers.push_back(linkedNodePageNumber);
+		m_linkedNodesRootPageNumbers.push_back(readWord(*p));
+	    }
+	}
+
+	if (hasBuffer()) {
+	    for (size_t i = 0; i < m_keyCount; i++) {
+		char isDeleted;
+		p->read(&isDeleted, sizeof(isDeleted));
+		m_isKeyDeleted.push_back(isDeleted != 0);
+	    }
+
+	    size_t messageCount = readWord(*p);
+	    for (size_t i = 0; i < messageCount; i++) {
+		Message m;
+		char type;
+		p->read(&type, sizeof(type));
+		m.type = static_cast<MessageType>(type);
+
+		m.key.size = readLength(*p);
+		m.key.data = new char[m.key.size];
+		p->read(m.key.data, m.key.size);
+
+		m.value.size = readLength(*p);
+		m.value.data = new char[m.value.size];
+		if (m.value.size) {
+		    p->read(m.value.data, m.value.size);
+		}
+		m_messages.push_back(m);
 	    }
 	}
 
@@ -101,53 +248,133 @@ DatabaseNode::DatabaseNode(GlobalConfiguration *globConf, PageReadWriter &rw, si
     }
 }
 
+DatabaseNode::DatabaseNode(const DatabaseNode &other)
+    : m_isLeaf(other.m_isLeaf)
+    , m_keyCount(other.m_keyCount)
+    , m_rootPageNumber(other.m_rootPageNumber)
+    , m_linkedNodesRootPageNumbers(other.m_linkedNodesRootPageNumbers)
+    , m_isBuffered(other.m_isBuffered)
+    , m_isKeyDeleted(other.m_isKeyDeleted)
+    , m_isDirty(other.m_isDirty)
+    , m_keyWidth(other.m_keyWidth)
+    , m_isCompact(other.m_isCompact)
+    , m_keyPrefixes(other.m_keyPrefixes)
+    , m_prefixSkip(other.m_prefixSkip)
+    , m_searchCount(other.m_searchCount)
+{
+    m_keys.reserve(m_keyCount);
+    m_data.reserve(m_keyCount);
+    for (size_t i = 0; i < m_keyCount; i++) {
+	m_keys.push_back(Record::rawCopyFrom(other.m_keys[i]));
+	m_data.push_back(Record::rawCopyFrom(other.m_data[i]));
+    }
+    m_messages.reserve(other.m_messages.size());
+    for (const Message &m : other.m_messages) {
+	Message copy;
+	copy.type = m.type;
+	copy.key = Record::rawCopyFrom(m.key);
+	copy.value = Record::rawCopyFrom(m.value);
+	m_messages.push_back(copy);
+    }
+}
+
+DatabaseNode *DatabaseNode::clone() const
+{
+    return new DatabaseNode(*this);
+}
+
 DatabaseNode::~DatabaseNode()
 {
     for (size_t i = 0; i < m_keyCount; i++) {
 	delete[] m_keys[i].data;
 	delete[] m_data[i].data;
     }
+    for (Message &m : m_messages) {
+	delete[] m.key.data;
+	delete[] m.value.data;
+    }
+}
+
+size_t DatabaseNode::memoryUsage() const
+{
+    size_t res = sizeof(*this)
+	+ (m_keys.capacity() + m_data.capacity()) * sizeof(Record)
+	+ m_linkedNodesRootPageNumbers.capacity() * sizeof(size_t)
+	+ m_messages.capacity() * sizeof(Message)
+	+ m_isKeyDeleted.capacity() / 8
+	+ std::max(m_keyPrefixes.capacity(), m_keys.size()) * sizeof(uint64_t);
+    for (size_t i = 0; i < m_keys.size(); i++) {
+	res += m_keys[i].size;
+    }
+    for (size_t i = 0; i < m_data.size(); i++) {
+	res += m_data[i].size;
+    }
+    for (const Message &m : m_messages) {
+	res += m.key.size + m.value.size;
+    }
+    return res;
 }
 
 size_t DatabaseNode::spaceOnDisk() const
 {
-    size_t curSpace = sizeof(m_isLeaf) + sizeof(m_keyCount);
+    size_t curSpace = sizeof(m_isLeaf) + wordSizeOnDisk();
     for (size_t i = 0; i < m_keyCount; i++) {
-	curSpace += m_keys[i].size + sizeof(m_keys[i].size);
-	curSpace += m_data[i].size + sizeof(m_data[i].size);
+	curSpace += m_keys[i].size + keySizeOnDisk(m_keys[i]);
+	curSpace += m_data[i].size + lengthSizeOnDisk(m_data[i].size);
     }
     if (!m_isLeaf) {
-	curSpace += (m_keyCount + 1) * sizeof(decltype(m_linkedNodesRootPageNumbers.back()));
+	curSpace += (m_keyCount + 1) * wordSizeOnDisk();
+    }
+    if (hasBuffer()) {
+	curSpace += m_keyCount * sizeof(char) + bufferSpaceOnDisk();
     }
     return curSpace;
 }
 
+size_t DatabaseNode::bufferSpaceOnDisk() const
+{
+    size_t curSpace = wordSizeOnDisk(); // message count
+    for (const Message &m : m_messages) {
+	curSpace += messageSpaceOnDisk(m);
+    }
+    return curSpace;
+}
+
+size_t DatabaseNode::messageSpaceOnDisk(const DatabaseNode::Message &message) const
+{
+    return sizeof(char) + lengthSizeOnDisk(message.key.size) + message.key.size
+	+ lengthSizeOnDisk(message.value.size) + message.value.size;
+}
+
 size_t DatabaseNode::additionalSpaceFor(const DatabaseNode::Record &key, const DatabaseNode::Record &data) const
 {
-    size_t result = sizeof(key.size) + key.size;
-    result += sizeof(data.size) + data.size;
+    size_t result = keySizeOnDisk(key) + key.size;
+    result += lengthSizeOnDisk(data.size) + data.size;
     if (!m_isLeaf) {
-	result += sizeof(decltype(m_linkedNodesRootPageNumbers.back()));
+	result += wordSizeOnDisk();
+    }
+    if (hasBuffer()) {
+	result += sizeof(char);
     }
     return result;
 }
 
 size_t DatabaseNode::findFirstExceeding(size_t limitSize) const
 {
-    size_t curSpace = sizeof(m_isLeaf) + sizeof(m_keyCount);
+    size_t curSpace = sizeof(m_isLeaf) + wordSizeOnDisk();
     size_t i = 0;
-    curSpace += sizeof(m_keys[0].size) + m_keys[0].size;
-    curSpace += sizeof(m_data[0].size) + m_data[0].size;
+    curSpace += keySizeOnDisk(m_keys[0]) + m_keys[0].size;
+    curSpace += lengthSizeOnDisk(m_data[0].size) + m_data[0].size;
     if (!m_isLeaf) {
-	curSpace += 2 * sizeof(decltype(m_linkedNodesRootPageNumbers.back()));
+	curSpace += 2 * wordSizeOnDisk();
     }
 
     while (curSpace <= limitSize && i < m_keyCount) {
 	i++;
-	curSpace += sizeof(m_keys[i].size) + m_keys[i].size;
-	curSpace += sizeof(m_data[i].size) + m_data[i].size;
+	curSpace += keySizeOnDisk(m_keys[i]) + m_keys[i].size;
+	curSpace += lengthSizeOnDisk(m_data[i].size) + m_data[i].size;
 	if (!m_isLeaf) {
-	    curSpace += sizeof(decltype(m_linkedNodesRootPageNumbers.back()));
+	    curSpace += wordSizeOnDisk();
 	}
     }
 
@@ -159,26 +386,60 @@ void DatabaseNode::writeToPages(GlobalConfiguration *globConf, PageReadWriter &r
     Page *p = new Page(m_rootPageNumber, globConf->pageSize());
 
     p->write(&m_isLeaf, sizeof(m_isLeaf));
-    p->write(&m_keyCount, sizeof(m_keyCount));
+    writeWord(*p, m_keyCount);
 
     for (size_t i = 0; i < m_keyCount; i++) {
-	p->write(&m_keys[i].size, sizeof(m_keys[i].size));
+	if (!m_keyWidth) {
+	    writeLength(*p, m_keys[i].size);
+	}
 	p->write(m_keys[i].data, m_keys[i].size);
     }
 
     for (size_t i = 0; i < m_keyCount; i++) {
-	p->write(&m_data[i].size, sizeof(m_data[i].size));
-	p->write(m_data[i].data, m_data[i].size);
+	writeLength(*p, m_data[i].size);
+	if (m_data[i].size) {
+	    p->write(m_data[i].data, m_data[i].size);
+	}
     }
 
     if (!m_isLeaf) {
 	for (size_t i = 0; i <= m_keyCount; i++) {
-	    size_t pageNum = m_linkedNodesRootPageNumbers[i];
-	    p->write(&pageNum, sizeof(pageNum));
+	    writeWord(*p, m_linkedNodesRootPageNumbers[i]);
+	}
+    }
+
+    if (hasBuffer()) {
+	for (size_t i = 0; i < m_keyCount; i++) {
+	    char isDeleted = m_isKeyDeleted[i];
+	    p->write(&isDeleted, sizeof(isDeleted));
+	}
+
+	writeWord(*p, m_messages.size());
+	for (const Message &m : m_messages) {
+	    char type = m.type;
+	    p->write(&type, sizeof(type));
+	    writeLength(*p, m.key.size);
+	    p->write(m.key.data, m.key.size);
+	    writeLength(*p, m.value.size);
+	    if (m.value.size) {
+		p->write(m.value.data, m.value.size);
+	    }
 	}
     }
     rw.write(*p);
     delete p;
+    m_isDirty = false;
+    m_keyPrefixes.clear(); // written keys may differ from read ones
+}
+
+bool DatabaseNode::isDirty() const
+{
+    return m_isDirty;
+}
+
+void DatabaseNode::markDirty()
+{
+    m_isDirty = true;
 }
 
 bool DatabaseNode::isLeaf() const
@@ -189,6 +450,7 @@ bool DatabaseNode::isLeaf() const
 void DatabaseNode::setIsLeaf(bool val)
 {
     m_isLeaf = val;
+    m_isDirty = true;
 }
 
 size_t DatabaseNode::keyCount() const
@@ -199,6 +461,7 @@ size_t DatabaseNode::keyCount() const
 void DatabaseNode::setKeyCount(size_t newSize)
 {
     m_keyCount = newSize;
+    m_isDirty = true;
 }
 
 std::vector<DatabaseNode::Record> &DatabaseNode::data()
@@ -211,16 +474,204 @@ std::vector<DatabaseNode::Record> &DatabaseNode::keys()
     return m_keys;
 }
 
+uint64_t DatabaseNode::keyPrefix(const DatabaseNode::Record &key) const
+{
+    uint64_t bytes = 0;
+    if (key.size >= m_prefixSkip) {
+	int cmp = memcmp(key.data, m_keys[0].data, m_prefixSkip);
+	// Key without common part of node keys goes before or after all of them
+	bytes = cmp < 0 ? 0 : cmp > 0 ? UINT64_MAX
+	    : loadPrefix(key.data + m_prefixSkip, key.size - m_prefixSkip);
+    }
+    if (m_keyWidth) {
+	return bytes;
+    }
+    return static_cast<uint64_t>(std::min(key.size, PREFIX_SIZE_LIMIT)) << 48 | bytes >> 16;
+}
+
+bool DatabaseNode::buildKeyPrefixes() const
+{
+    m_prefixSkip = m_keys[0].size;
+    for (size_t i = 0; i < m_keyCount; i++) {
+	if (!m_keyWidth && m_keys[i].size >= PREFIX_SIZE_LIMIT) {
+	    return false; // order of such keys doesn't fit to word
+	}
+	size_t common = 0;
+	size_t limit = std::min(m_prefixSkip, m_keys[i].size);
+	while (common < limit && m_keys[i].data[common] == m_keys[0].data[common]) {
+	    common++;
+	}
+	m_prefixSkip = common;
+    }
+
+    m_keyPrefixes.reserve(m_keyCount);
+    for (size_t i = 0; i < m_keyCount; i++) {
+	m_keyPrefixes.push_back(keyPrefix(m_keys[i]));
+    }
+    return true;
+}
+
+bool DatabaseNode::narrowByPrefixes(const DatabaseNode::Record &key, size_t &from, size_t &to) const
+{
+    // Prefixes describe keys as they were read, changes mark node dirty
+    if (m_isDirty || !m_keyCount || (m_keyWidth && key.size != m_keyWidth)) {
+	return false;
+    }
+    // Node read for single lookup isn't worth building prefixes for
+    if (m_keyPrefixes.size() != m_keyCount) {
+	if (++m_searchCount < PREFIX_BUILD_SEARCHES || !buildKeyPrefixes()) {
+	    m_keyPrefixes.clear();
+	    return false;
+	}
+    }
+
+    // Branchless search over contiguous words, only keys with prefix
+    // equal to prefix of key are compared in full
+    uint64_t prefix = keyPrefix(key);
+    const uint64_t *base = m_keyPrefixes.data();
+    size_t count = m_keyCount;
+    while (count > 1) {
+	size_t half = count / 2;
+	base = base[half - 1] < prefix ? base + half : base;
+	count -= half;
+    }
+    from = base - m_keyPrefixes.data() + (*base < prefix);
+    to = from;
+    while (to < m_keyCount && m_keyPrefixes[to] == prefix) {
+	to++;
+    }
+    return true;
+}
+
+size_t DatabaseNode::lowerBound(const DatabaseNode::Record &key) const
+{
+    size_t from, to;
+    if (narrowByPrefixes(key, from, to)) {
+	return std::lower_bound(m_keys.begin() + from, m_keys.begin() + to, key) - m_keys.begin();
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (m_keyWidth == 8 && key.size == 8) {
+	return lowerBoundFixed<8>(m_keys, m_keyCount, key);
+    }
+    if (m_keyWidth == 4 && key.size == 4) {
+	return lowerBoundFixed<4>(m_keys, m_keyCount, key);
+    }
+#endif
+    return std::lower_bound(m_keys.begin(), m_keys.begin() + m_keyCount, key) - m_keys.begin();
+}
+
+size_t DatabaseNode::upperBound(const DatabaseNode::Record &key) const
+{
+    size_t from = 0, to = m_keyCount;
+    narrowByPrefixes(key, from, to);
+    return std::upper_bound(m_keys.begin() + from, m_keys.begin() + to, key) - m_keys.begin();
+}
+
+void DatabaseNode::prefetchSearch() const
+{
+    if (!m_keyCount) {
+	return;
+    }
+    // Binary search probes middle and quarters first
+    for (size_t i = 1; i < 4; i++) {
+	size_t pos = m_keyCount * i / 4;
+	if (!m_keyPrefixes.empty()) {
+	    __builtin_prefetch(&m_keyPrefixes[pos]);
+	}
+	__builtin_prefetch(&m_keys[pos]);
+    }
+}
+
+size_t DatabaseNode::keySizeOnDisk(const DatabaseNode::Record &key) const
+{
+    return m_keyWidth ? 0 : lengthSizeOnDisk(key.size);
+}
+
+size_t DatabaseNode::lengthSizeOnDisk(size_t length) const
+{
+    return m_isCompact ? varintSize(length) : sizeof(size_t);
+}
+
+void DatabaseNode::writeLength(Page &p, size_t length) const
+{
+    if (m_isCompact) {
+	writeVarint(p, length);
+    } else {
+	p.write(&length, sizeof(length));
+    }
+}
+
+size_t DatabaseNode::readLength(Page &p) const
+{
+    if (m_isCompact) {
+	return readVarint(p);
+    }
+    size_t length;
+    p.read(&length, sizeof(length));
+    return length;
+}
+
+size_t DatabaseNode::wordSizeOnDisk() const
+{
+    return m_isCompact ? sizeof(uint32_t) : sizeof(size_t);
+}
+
+void DatabaseNode::writeWord(Page &p, size_t word) const
+{
+    if (!m_isCompact) {
+	p.write(&word, sizeof(word));
+	return;
+    }
+    if (word > UINT32_MAX) {
+	throw std::string("Value doesn't fit to 32 bits of compact node format");
+    }
+    uint32_t compactWord = word;
+    p.write(&compactWord, sizeof(compactWord));
+}
+
+size_t DatabaseNode::readWord(Page &p) const
+{
+    if (!m_isCompact) {
+	size_t word;
+	p.read(&word, sizeof(word));
+	return word;
+    }
+    uint32_t compactWord;
+    p.read(&compactWord, sizeof(compactWord));
+    return compactWord;
+}
+
 std::vector<size_t> &DatabaseNode::linkedNodesRootPageNumbers()
 {
     return m_linkedNodesRootPageNumbers;
 }
 
+std::vector<DatabaseNode::Message> &DatabaseNode::messages()
+{
+    return m_messages;
+}
+
+std::vector<bool> &DatabaseNode::isKeyDeleted()
+{
+    return m_isKeyDeleted;
+}
+
+bool DatabaseNode::hasBuffer() const
+{
+    return m_isBuffered && !m_isLeaf;
+}
+
 size_t DatabaseNode::rootPage() const
 {
     return m_rootPageNumber;
 }
 
+void DatabaseNode::setRootPage(size_t newRootPage)
+{
+    m_rootPageNumber = newRootPage;
+    m_isDirty = true;
+}
+
 void DatabaseNode::freePages(PageReadWriter &rw)
 {
     rw.deallocatePageNumber(m_rootPageNumber);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include "Page.h"
@@ -23,30 +24,78 @@ public:
 	char *data;
     };
 
+    enum MessageType {
+	PUT = 0,
+	DELETE = 1,
+	/// Appends value to stored one, stores value if key is absent
+	UPSERT = 2
+    };
+
+    /// Pending update for key in subtree of buffered node
+    struct Message
+    {
+	MessageType type;
+	Record key;
+	Record value;
+    };
+
+    /// Keys of non-zero keyWidth are written without sizes
     DatabaseNode(
 	GlobalConfiguration *globConf,
 	PageReadWriter &rw,
 	size_t rootPageNumber,
-	bool needRead);
+	bool needRead,
+	bool isBuffered = false,
+	size_t keyWidth = 0);
 
     ~DatabaseNode();
 
+    /// Deep copy, page number included
+    DatabaseNode *clone() const;
+
     void writeToPages(GlobalConfiguration *globConf, PageReadWriter &rw);
 
+    /// Node is dirty from creation or change until written, setters mark it,
+    /// changes through vector accessors have to be marked by caller
+    bool isDirty() const;
+    void markDirty();
+
     bool isLeaf() const;
     void setIsLeaf(bool val);
     size_t keyCount() const;
     void setKeyCount(size_t newsize);
 
     std::vector<Record> &keys();
+    /// Index of first own key not less than key. Node read from page and
+    /// not changed since is searched by key prefixes, other nodes with
+    /// 4 and 8 byte wide keys are searched without branches
+    size_t lowerBound(const Record &key) const;
+    /// Index of first own key greater than key
+    size_t upperBound(const Record &key) const;
+    /// Asks CPU to load first lines probed by lowerBound
+    void prefetchSearch() const;
     std::vector<Record> &data();
     std::vector<size_t> &linkedNodesRootPageNumbers();
 
+    /// Internal nodes of buffered tree only: messages sorted by key,
+    /// never for own keys of node
+    std::vector<Message> &messages();
+    /// Internal nodes of buffered tree only: own keys removed by messages,
+    /// they stay as separators with empty data
+    std::vector<bool> &isKeyDeleted();
+    bool hasBuffer() const;
+
     size_t rootPage() const;
+    void setRootPage(size_t newRootPage);
 
     void freePages(PageReadWriter &rw);
 
+    /// Bytes node takes in memory, key prefixes of search are counted
+    /// before they are built
+    size_t memoryUsage() const;
     size_t spaceOnDisk() const;
+    size_t bufferSpaceOnDisk() const;
+    size_t messageSpaceOnDisk(const Message &message) const;
     size_t additionalSpaceFor(const Record &key, const Record &data) const;
     size_t findFirstExceeding(size_t limitSize) const;
 
@@ -57,8 +106,40 @@ private:
     std::vector<Record> m_keys;
     std::vector<Record> m_data;
     std::vector<size_t> m_linkedNodesRootPageNumbers;
+    bool m_isBuffered;
+    std::vector<Message> m_messages;
+    std::vector<bool> m_isKeyDeleted;
+    bool m_isDirty;
+    size_t m_keyWidth;
+    /// Node is stored in GlobalConfiguration::FORMAT_COMPACT
+    bool m_isCompact;
+    /// Searches of clean node after which key prefixes are built
+    static const size_t PREFIX_BUILD_SEARCHES = 2;
+    /// Order preserving words of keys read from page, see lowerBound.
+    /// Prefix is taken after bytes all keys of node start with, for
+    /// variable key size it keeps size in top 16 bits and 6 bytes
+    mutable std::vector<uint64_t> m_keyPrefixes;
+    mutable size_t m_prefixSkip;
+    mutable size_t m_searchCount;
+
+    /// Bytes written before key
+    size_t keySizeOnDisk(const Record &key) const;
+    /// Key, value and message lengths: varints in compact format
+    size_t lengthSizeOnDisk(size_t length) const;
+    void writeLength(Page &p, size_t length) const;
+    size_t readLength(Page &p) const;
+    /// Counts and page numbers of children: 32-bit in compact format
+    size_t wordSizeOnDisk() const;
+    void writeWord(Page &p, size_t word) const;
+    size_t readWord(Page &p) const;
+    /// Returns false when keys are too long for prefixes
+    bool buildKeyPrefixes() const;
+    uint64_t keyPrefix(const Record &key) const;
+    /// Narrows [from, to) to keys with prefix equal to prefix of key,
+    /// returns false when prefixes can't be used
+    bool narrowByPrefixes(const Record &key, size_t &from, size_t &to) const;
 
     DatabaseNode();
-    DatabaseNode(const DatabaseNode &) { }
+    DatabaseNode(const DatabaseNode &other);
     void operator=(const DatabaseNode &p) { }
 };
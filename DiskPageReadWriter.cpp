@@ -1,26 +1,42 @@
 #include "DiskPageReadWriter.h"
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string>
 #include <cstring>
+#include <algorithm>
 
-DiskPageReadWriter::DiskPageReadWriter(const char* file, GlobalConfiguration *_globConf)
+DiskPageReadWriter::DiskPageReadWriter(
+    const char* file,
+    GlobalConfiguration *_globConf,
+    Statistics *stats,
+    bool isReadOnly,
+    bool isMapped)
     : m_fd(-1)
+    , m_isReadOnly(isReadOnly)
+    , m_map(nullptr)
+    , m_mapSize(0)
     , m_globConf(_globConf)
+    , m_stats(stats)
 {
     if (!m_globConf) {
 	throw std::string("globConf can't be null");
     }
     //check file existence
     if (access(file, F_OK) == -1) { // No file
+	if (m_isReadOnly) {
+	    throw std::string("Read-only database file doesn't exist");
+	}
 	m_globConf->initialize(
 	    m_globConf->desiredPageCount(),
 	    m_globConf->desiredPageSize(),
 	    m_globConf->desiredRootNodePageNumber(),
 	    m_globConf->desiredCacheSize(),
+	    m_globConf->desiredEngineType(),
+	    m_globConf->desiredFormatVersion(),
 	    m_globConf->desiredJournalPath());
 
 	m_fd = creat(file, 0644);
@@ -44,12 +60,27 @@ DiskPageReadWriter::DiskPageReadWriter(const char* file, GlobalConfiguration *_g
 	::close(m_fd);
 	m_fd = open(file, O_RDWR);
     } else {
-	m_fd = open(file, O_RDWR);
+	m_fd = open(file, m_isReadOnly ? O_RDONLY : O_RDWR);
 	if (m_fd == -1) {
 	    throw std::string("Error opening file");
 	}
 
 	m_globConf->readFromFile(m_fd);
+	if (isMapped) {
+	    struct stat st;
+	    if (fstat(m_fd, &st) == -1) {
+		::close(m_fd);
+		throw std::string("Error mapping file");
+	    }
+	    // Shrunk file is shorter than its pages
+	    m_mapSize = st.st_size;
+	    void *map = mmap(nullptr, m_mapSize, PROT_READ, MAP_SHARED, m_fd, 0);
+	    if (map == MAP_FAILED) {
+		::close(m_fd);
+		throw std::string("Error mapping file");
+	    }
+	    m_map = static_cast<char *>(map);
+	}
 
 	Page firstPage(0, m_globConf->pageSize());
 	read(firstPage);
@@ -57,7 +88,9 @@ DiskPageReadWriter::DiskPageReadWriter(const char* file, GlobalConfiguration *_g
 	m_globConf->skipDataOnPage(firstPage);
 
 	m_bitset.read(m_globConf, firstPage, *this);
+	m_globConf->readCatalogFromPage(firstPage);
     }
+    m_isCopyOnWrite = *m_globConf->journalPath() == '\0';
 }
 
 void DiskPageReadWriter::writeGlobConfAndBitset()
@@ -66,38 +99,82 @@ void DiskPageReadWriter::writeGlobConfAndBitset()
     firstPage.seek(0);
     m_globConf->writeToPage(firstPage);
     m_bitset.write(firstPage, *this);
+    m_globConf->writeCatalogToPage(firstPage);
     write(firstPage);
 }
 
+DiskPageReadWriter::~DiskPageReadWriter()
+{
+    if (m_map) {
+	munmap(m_map, m_mapSize);
+    }
+    if (m_fd != -1) {
+	::close(m_fd);
+    }
+}
+
+void DiskPageReadWriter::checkWritable() const
+{
+    if (m_isReadOnly) {
+	throw std::string("Database is opened read-only");
+    }
+}
+
 size_t DiskPageReadWriter::allocatePageNumber()
 {
+    checkWritable();
     size_t res = m_bitset.freePageNumber();
     m_bitset.set(res, 1);
-    writeGlobConfAndBitset(); // HACK: dirty hack!
+    if (!m_isCopyOnWrite) {
+	writeGlobConfAndBitset(); // HACK: dirty hack!
+    }
     return res;
 }
 
 void DiskPageReadWriter::deallocatePageNumber(const size_t &number)
 {
+    checkWritable();
+    if (m_isCopyOnWrite) {
+	m_pendingFrees.push_back(number);
+	return;
+    }
     m_bitset.set(number, 0);
     writeGlobConfAndBitset(); // HACK: dirty hack!
 }
 
+bool DiskPageReadWriter::isPageAllocated(const size_t &number)
+{
+    return m_bitset.get(number);
+}
+
 void DiskPageReadWriter::read(Page &p)
 {
     if (p.number() >= m_globConf->pageCount()) {
 	throw std::string("Invalid page number read\n");
     }
+    if (m_map) {
+	size_t offset = p.number() * m_globConf->pageSize();
+	size_t mappedBytes = offset < m_mapSize ? std::min(m_globConf->pageSize(), m_mapSize - offset) : 0;
+	memcpy(p.rawData(), m_map + offset, mappedBytes);
+	memset(p.rawData() + mappedBytes, 0, m_globConf->pageSize() - mappedBytes);
+	m_stats->pagesRead++;
+	return;
+    }
     if (lseek(m_fd, p.number() * m_globConf->pageSize(), SEEK_SET) == -1) {
 	throw std::string("Error seeking page");
     }
-    if (::read(m_fd, p.rawData(), m_globConf->pageSize()) != m_globConf->pageSize()) {
+    ssize_t readBytes = ::read(m_fd, p.rawData(), m_globConf->pageSize());
+    if (readBytes == -1) {
 	throw std::string("Error reading page");
     }
+    // Pages behind the end of shrunk file are never written yet
+    memset(p.rawData() + readBytes, 0, m_globConf->pageSize() - readBytes);
+    m_stats->pagesRead++;
 }
 
 void DiskPageReadWriter::write(const Page &p)
 {
+    checkWritable();
     if (p.number() >= m_globConf->pageCount()) {
 	throw std::string("Invalid page number write\n");
     }
@@ -107,19 +184,91 @@ void DiskPageReadWriter::write(const Page &p)
     if (::write(m_fd, p.rawData(), m_globConf->pageSize()) != m_globConf->pageSize()) {
 	throw std::string("Error writing page");
     }
+    m_stats->pagesWritten++;
+}
+
+void DiskPageReadWriter::willNeed(const std::vector<size_t> &pages)
+{
+    size_t pageSize = m_globConf->pageSize();
+    for (size_t i = 0; i < pages.size();) {
+	size_t j = i + 1;
+	while (j < pages.size() && pages[j] == pages[j - 1] + 1) {
+	    j++;
+	}
+	posix_fadvise(m_fd, pages[i] * pageSize, (j - i) * pageSize, POSIX_FADV_WILLNEED);
+	i = j;
+    }
+}
+
+bool DiskPageReadWriter::isReadOnly() const
+{
+    return m_isReadOnly;
+}
+
+bool DiskPageReadWriter::isMapped() const
+{
+    return m_map != nullptr;
 }
 
 void DiskPageReadWriter::flush()
 {
+    if (m_isReadOnly) {
+	return; // nothing is changed, header stays as it was
+    }
+    if (!m_isCopyOnWrite) {
+	// Caller writes checkpoint to journal next, pages must be on disk before it
+	writeGlobConfAndBitset();
+	syncFile();
+	return;
+    }
+
+    // Caller has written all pages of new tree. They and bitmap with their
+    // allocations reach disk first, then header write commits new root
+    m_bitset.writeIndex(*this);
+    syncFile();
     writeGlobConfAndBitset();
+    syncFile();
+
+    // Old tree isn't reachable anymore, crash before its pages are written
+    // as free only leaks them
+    if (!m_pendingFrees.empty()) {
+	for (const size_t &number : m_pendingFrees) {
+	    m_bitset.set(number, 0);
+	}
+	m_pendingFrees.clear();
+	m_bitset.writeIndex(*this);
+    }
+}
+
+void DiskPageReadWriter::syncFile()
+{
+    if (fdatasync(m_fd) == -1) {
+	throw std::string("Error syncing file");
+    }
+}
+
+void DiskPageReadWriter::shrink()
+{
+    checkWritable();
+    flush();
+    size_t usedSize = (m_bitset.lastUsedPageNumber() + 1) * m_globConf->pageSize();
+    if (ftruncate(m_fd, usedSize) == -1) {
+	throw std::string("Error shrinking file");
+    }
+    syncFile();
 }
 
 void DiskPageReadWriter::close()
 {
     if (m_fd != -1) {
 	flush();
+	if (m_map) {
+	    munmap(m_map, m_mapSize);
+	    m_map = nullptr;
+	}
 	if (::close(m_fd) == -1) {
 	    throw std::string("Error closing file");
 	}
+	m_fd = -1;
     }
 }
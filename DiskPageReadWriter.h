@@ -1,26 +1,60 @@
 #pragma once
 
+#include <vector>
+
 #include "GlobalConfiguration.h"
 #include "PageReadWriter.h"
 #include "Bitset.h"
+#include "Statistics.h"
 
+/// File without journal is updated by copy-on-write: header and bitmap are
+/// written by flush only. Flush syncs new pages and bitmap, then writes and
+/// syncs header, which commits the tree of the new root. Pages freed before
+/// it stay allocated until the commit is done.
+/// Read-only file must exist and is never written, flush and close leave
+/// header as it is
 class DiskPageReadWriter : public PageReadWriter
 {
 public:
-    DiskPageReadWriter(const char *file, GlobalConfiguration *globConf);
+    /// Mapped file is read from shared mapping instead of read calls
+    DiskPageReadWriter(
+	const char *file,
+	GlobalConfiguration *globConf,
+	Statistics *stats,
+	bool isReadOnly = false,
+	bool isMapped = false);
+    /// Releases file left open by failed open, close() writes header first
+    ~DiskPageReadWriter();
 
     // implemented virtual functions
     virtual size_t allocatePageNumber();
     virtual void deallocatePageNumber(const size_t &number);
+    virtual bool isPageAllocated(const size_t &number);
     void read(Page &p);
     void write(const Page &page);
     void close();
+    /// Returns when changes are on disk, so sync() is the same
     void flush();
+    void shrink();
+    /// Asks kernel to read ahead every run of adjacent pages
+    void willNeed(const std::vector<size_t> &pages);
+    bool isReadOnly() const;
+    bool isMapped() const;
 
 private:
     int m_fd;
+    bool m_isReadOnly;
+    /// nullptr when file isn't mapped
+    char *m_map;
+    size_t m_mapSize;
     GlobalConfiguration *m_globConf;
+    Statistics *m_stats;
     Bitset m_bitset;
+    bool m_isCopyOnWrite;
+    /// Copy-on-write: pages of committed tree freed by uncommitted changes
+    std::vector<size_t> m_pendingFrees;
 
     void writeGlobConfAndBitset();
+    void syncFile();
+    void checkWritable() const;
 };
@@ -5,19 +5,24 @@
 #include <string>
 #include <unistd.h>
 
-const char GlobalConfiguration::MAGIC[GlobalConfiguration::MAGIC_SIZE] = "MYDB";
+const char GlobalConfiguration::MAGIC[GlobalConfiguration::MAGIC_SIZE] = "MYD2";
+const char GlobalConfiguration::LEGACY_MAGIC[GlobalConfiguration::MAGIC_SIZE] = "MYDB";
 
 GlobalConfiguration::GlobalConfiguration(
     const size_t &desiredPageCount,
     const size_t &desiredPageSize,
     const size_t &desiredRootNodePageNumber,
     const size_t &desiredCacheSize,
+    const size_t &desiredEngineType,
+    const size_t &desiredFormatVersion,
     const char *journalPath)
     : m_isInitialized(false)
     , m_pageCount(desiredPageCount)
     , m_pageSize(desiredPageSize)
     , m_rootNodePageNumber(desiredRootNodePageNumber)
     , m_cacheSize(desiredCacheSize)
+    , m_engineType(desiredEngineType)
+    , m_formatVersion(desiredFormatVersion)
     , m_journalPath(strdup(journalPath))
     , m_isReadedFromFile(false)
 {
@@ -33,6 +38,8 @@ void GlobalConfiguration::initialize(
     const size_t &pageSize,
     const size_t &rootNodePageNumber,
     const size_t &cacheSize,
+    const size_t &engineType,
+    const size_t &formatVersion,
     const char *journalPath)
 {
     if (m_isInitialized) {
@@ -44,6 +51,8 @@ void GlobalConfiguration::initialize(
     m_pageSize = pageSize;
     m_rootNodePageNumber = rootNodePageNumber;
     m_cacheSize = cacheSize;
+    m_engineType = engineType;
+    m_formatVersion = formatVersion;
     char *oldMem = m_journalPath;
     m_journalPath = strdup(journalPath);
     if (oldMem) {
@@ -91,6 +100,22 @@ size_t GlobalConfiguration::desiredCacheSize() const
     return m_cacheSize;
 }
 
+size_t GlobalConfiguration::desiredEngineType() const
+{
+    if (m_isInitialized) {
+	throw std::string("GlobalConfiguration is already initialized");
+    }
+    return m_engineType;
+}
+
+size_t GlobalConfiguration::desiredFormatVersion() const
+{
+    if (m_isInitialized) {
+	throw std::string("GlobalConfiguration is already initialized");
+    }
+    return m_formatVersion;
+}
+
 char *GlobalConfiguration::desiredJournalPath() const
 {
     if (m_isInitialized) {
@@ -139,6 +164,22 @@ size_t GlobalConfiguration::cacheSize() const
     return m_cacheSize;
 }
 
+size_t GlobalConfiguration::engineType() const
+{
+    if (!m_isInitialized) {
+	throw std::string("GlobalConfiguration isn't initialized");
+    }
+    return m_engineType;
+}
+
+size_t GlobalConfiguration::formatVersion() const
+{
+    if (!m_isInitialized) {
+	throw std::string("GlobalConfiguration isn't initialized");
+    }
+    return m_formatVersion;
+}
+
 char *GlobalConfiguration::journalPath() const
 {
     if (!m_isInitialized) {
@@ -167,7 +208,10 @@ void GlobalConfiguration::readFromFile(int fd)
     if (read(fd, magic, MAGIC_SIZE) != MAGIC_SIZE) {
 	throw std::string("Error reading global configuration");
     }
-    if (strcmp(magic, MAGIC)) {
+    if (!memcmp(magic, LEGACY_MAGIC, MAGIC_SIZE)) {
+	throw std::string("Database file was written by older version and has different header layout");
+    }
+    if (memcmp(magic, MAGIC, MAGIC_SIZE)) {
 	throw std::string("Invalid magic in database file");
     }
     if (read(fd, &m_pageCount, sizeof(m_pageCount)) != sizeof(m_pageCount)) {
@@ -182,15 +226,27 @@ void GlobalConfiguration::readFromFile(int fd)
     if (read(fd, &m_cacheSize, sizeof(m_cacheSize)) != sizeof(m_cacheSize)) {
 	throw std::string("Error reading global configuration");
     }
+    if (read(fd, &m_engineType, sizeof(m_engineType)) != sizeof(m_engineType)) {
+	throw std::string("Error reading global configuration");
+    }
+    m_formatVersion = m_engineType >> FORMAT_VERSION_SHIFT;
+    m_engineType &= (static_cast<size_t>(1) << FORMAT_VERSION_SHIFT) - 1;
+    if (m_formatVersion > FORMAT_COMPACT) {
+	throw std::string("Unsupported format version of database file");
+    }
     size_t journalPathSize;
     if (read(fd, &journalPathSize, sizeof(journalPathSize)) != sizeof(journalPathSize)) {
 	throw std::string("Error reading global configuration");
     }
+    if (journalPathSize == 0 || journalPathSize > m_pageSize) {
+	throw std::string("Corrupted global configuration");
+    }
     free(m_journalPath);
     m_journalPath = static_cast<char *>(malloc(journalPathSize));
-    if (read(fd, m_journalPath, journalPathSize) != journalPathSize) {
+    if (read(fd, m_journalPath, journalPathSize) != static_cast<ssize_t>(journalPathSize)) {
 	throw std::string("Error reading global configuration");
     }
+    m_journalPath[journalPathSize - 1] = '\0';
 }
 
 void GlobalConfiguration::setRootNodePageNumber(const size_t &newRootNodePageNumber)
@@ -210,6 +266,7 @@ void GlobalConfiguration::skipDataOnPage(Page &page) const
     totalSeek += sizeof(m_pageSize);
     totalSeek += sizeof(m_rootNodePageNumber);
     totalSeek += sizeof(m_cacheSize);
+    totalSeek += sizeof(m_engineType);
     totalSeek += sizeof(size_t); // journal path size
     totalSeek += (strlen(m_journalPath) + 1) * sizeof(*m_journalPath);
     page.seekForward(totalSeek);
@@ -227,7 +284,100 @@ void GlobalConfiguration::writeToPage(Page &page) const
     page.write(&m_pageSize, sizeof(m_pageSize));
     page.write(&m_rootNodePageNumber, sizeof(m_rootNodePageNumber));
     page.write(&m_cacheSize, sizeof(m_cacheSize));
+    size_t engineWord = m_engineType | m_formatVersion << FORMAT_VERSION_SHIFT;
+    page.write(&engineWord, sizeof(engineWord));
     size_t journalPathSize = (strlen(m_journalPath) + 1) * sizeof(*m_journalPath);
     page.write(&journalPathSize, sizeof(journalPathSize));
     page.write(m_journalPath, journalPathSize);
 }
+
+size_t GlobalConfiguration::keyspaceCount() const
+{
+    return m_keyspaces.size() + 1;
+}
+
+size_t GlobalConfiguration::findKeyspace(const std::string &name) const
+{
+    for (size_t i = 0; i < m_keyspaces.size(); i++) {
+	if (m_keyspaces[i].first == name) {
+	    return i + 1;
+	}
+    }
+    return NO_KEYSPACE;
+}
+
+size_t GlobalConfiguration::addKeyspace(const std::string &name, size_t rootPage)
+{
+    if (name.empty()) {
+	throw std::string("Keyspace name can't be empty");
+    }
+    // Rest of header page is kept for configuration and bitset data
+    if (catalogSize() + 2 * sizeof(size_t) + name.size() > m_pageSize / 2) {
+	throw std::string("Catalog of keyspaces doesn't fit header page");
+    }
+    m_keyspaces.push_back(std::make_pair(name, rootPage));
+    return m_keyspaces.size();
+}
+
+size_t GlobalConfiguration::keyspaceRoot(size_t keyspace) const
+{
+    if (keyspace == 0) {
+	return rootNodePageNumber();
+    }
+    if (keyspace > m_keyspaces.size()) {
+	throw std::string("Unknown keyspace");
+    }
+    return m_keyspaces[keyspace - 1].second;
+}
+
+void GlobalConfiguration::setKeyspaceRoot(size_t keyspace, size_t rootPage)
+{
+    if (keyspace == 0) {
+	setRootNodePageNumber(rootPage);
+	return;
+    }
+    if (keyspace > m_keyspaces.size()) {
+	throw std::string("Unknown keyspace");
+    }
+    m_keyspaces[keyspace - 1].second = rootPage;
+}
+
+size_t GlobalConfiguration::catalogSize() const
+{
+    size_t res = sizeof(size_t); // keyspace count
+    for (const std::pair<std::string, size_t> &keyspace : m_keyspaces) {
+	res += sizeof(size_t) + keyspace.first.size() + sizeof(keyspace.second);
+    }
+    return res;
+}
+
+void GlobalConfiguration::readCatalogFromPage(Page &page)
+{
+    size_t count;
+    page.read(&count, sizeof(count));
+    m_keyspaces.clear();
+    for (size_t i = 0; i < count; i++) {
+	size_t nameSize;
+	page.read(&nameSize, sizeof(nameSize));
+	if (nameSize > page.freeSpace()) {
+	    throw std::string("Corrupted catalog of keyspaces");
+	}
+	std::string name(nameSize, '\0');
+	page.read(&name[0], nameSize);
+	size_t rootPage;
+	page.read(&rootPage, sizeof(rootPage));
+	m_keyspaces.push_back(std::make_pair(name, rootPage));
+    }
+}
+
+void GlobalConfiguration::writeCatalogToPage(Page &page) const
+{
+    size_t count = m_keyspaces.size();
+    page.write(&count, sizeof(count));
+    for (const std::pair<std::string, size_t> &keyspace : m_keyspaces) {
+	size_t nameSize = keyspace.first.size();
+	page.write(&nameSize, sizeof(nameSize));
+	page.write(keyspace.first.data(), nameSize);
+	page.write(&keyspace.second, sizeof(keyspace.second));
+    }
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "Page.h"
 
@@ -9,12 +12,28 @@ class GlobalConfiguration
 public:
     static const int MAGIC_SIZE = 5;
     static const char MAGIC[MAGIC_SIZE];
+    /// Magic of files written before header had engine type word, they
+    /// can't be read by this version
+    static const char LEGACY_MAGIC[MAGIC_SIZE];
+
+    /// Layout of B-tree nodes. Version is kept in top byte of engine type
+    /// word of header
+    enum FormatVersion {
+	/// Lengths, counts and page numbers take size_t each
+	FORMAT_WIDE = 0,
+	/// Lengths are varints, counts and page numbers are 32-bit
+	FORMAT_COMPACT = 1
+    };
+    static const size_t FORMAT_VERSION_SHIFT = 56;
+    static const size_t NO_KEYSPACE = static_cast<size_t>(-1);
 
     GlobalConfiguration(
 	const size_t &desiredPageCount,
 	const size_t &desiredPageSize,
 	const size_t &desiredRootNodePageNumber,
 	const size_t &desiredCacheSize,
+	const size_t &desiredEngineType,
+	const size_t &desiredFormatVersion,
 	const char *desiredJournalPath
     );
 
@@ -25,6 +44,8 @@ public:
 	const size_t &pageSize,
 	const size_t &rootNodePageNumber,
 	const size_t &cacheSize,
+	const size_t &engineType,
+	const size_t &formatVersion,
 	const char *journalPath
     );
 
@@ -33,21 +54,38 @@ public:
     size_t desiredDatabaseSize() const;
     size_t desiredRootNodePageNumber() const;
     size_t desiredCacheSize() const;
+    size_t desiredEngineType() const;
+    size_t desiredFormatVersion() const;
     char *desiredJournalPath() const;
     size_t pageCount() const;
     size_t pageSize() const;
     size_t databaseSize() const;
     size_t rootNodePageNumber() const;
     size_t cacheSize() const;
+    size_t engineType() const;
+    size_t formatVersion() const;
     char *journalPath() const;
 
     void setRootNodePageNumber(const size_t &newRootNodePageNumber);
 
+    /// Named keyspaces are trees sharing file with default one, keyspace 0
+    /// is default tree with root at rootNodePageNumber()
+    size_t keyspaceCount() const;
+    /// Returns NO_KEYSPACE when there is no keyspace with the name
+    size_t findKeyspace(const std::string &name) const;
+    size_t addKeyspace(const std::string &name, size_t rootPage);
+    size_t keyspaceRoot(size_t keyspace) const;
+    void setKeyspaceRoot(size_t keyspace, size_t rootPage);
+
     bool isReadedFromFile() const;
 
     void readFromFile(int m_fd);
     void skipDataOnPage(Page &page) const;
     void writeToPage(Page &page) const;
+    /// Catalog of named keyspaces follows bitset data on header page,
+    /// files written without it have zero keyspaces there
+    void readCatalogFromPage(Page &page);
+    void writeCatalogToPage(Page &page) const;
 
 private:
     bool m_isInitialized;
@@ -55,8 +93,14 @@ private:
     size_t m_pageSize;
     size_t m_rootNodePageNumber;
     size_t m_cacheSize;
+    size_t m_engineType;
+    size_t m_formatVersion;
     char *m_journalPath;
     bool m_isReadedFromFile;
+    /// Name and root page of every named keyspace
+    std::vector<std::pair<std::string, size_t> > m_keyspaces;
+
+    size_t catalogSize() const;
 
     GlobalConfiguration(GlobalConfiguration &) { };
     void operator=(const GlobalConfiguration &) { };
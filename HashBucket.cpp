@@ -0,0 +1,150 @@
+#include "HashBucket.h"
+
+#include <string>
+#include <cstring>
+
+HashBucket::HashBucket(GlobalConfiguration *globConf, PageReadWriter &rw, size_t pageNumber, bool needRead)
+    : m_pageNumber(pageNumber)
+    , m_localDepth(0)
+{
+    if (!needRead) {
+	return;
+    }
+
+    Page p(pageNumber, globConf->pageSize());
+    rw.read(p);
+
+    size_t count;
+    p.seek(0);
+    p.read(&m_localDepth, sizeof(m_localDepth));
+    p.read(&count, sizeof(count));
+    for (size_t i = 0; i < count; i++) {
+	size_t keySize, dataSize;
+	p.read(&keySize, sizeof(keySize));
+	char *keyValue = new char[keySize];
+	p.read(keyValue, keySize);
+	m_keys.push_back(Record(keySize, keyValue));
+
+	p.read(&dataSize, sizeof(dataSize));
+	char *dataValue = new char[dataSize];
+	p.read(dataValue, dataSize);
+	m_data.push_back(Record(dataSize, dataValue));
+    }
+}
+
+HashBucket::~HashBucket()
+{
+    for (size_t i = 0; i < m_keys.size(); i++) {
+	delete[] m_keys[i].data;
+	delete[] m_data[i].data;
+    }
+}
+
+void HashBucket::writeToPages(GlobalConfiguration *globConf, PageReadWriter &rw)
+{
+    Page p(m_pageNumber, globConf->pageSize());
+
+    size_t count = m_keys.size();
+    p.write(&m_localDepth, sizeof(m_localDepth));
+    p.write(&count, sizeof(count));
+    for (size_t i = 0; i < count; i++) {
+	p.write(&m_keys[i].size, sizeof(m_keys[i].size));
+	p.write(m_keys[i].data, m_keys[i].size);
+	p.write(&m_data[i].size, sizeof(m_data[i].size));
+	p.write(m_data[i].data, m_data[i].size);
+    }
+    rw.write(p);
+}
+
+bool HashBucket::lookup(const Page &page, size_t pageSize, const Record &key, Record &toWrite)
+{
+    const char *data = page.rawData();
+    size_t pos = sizeof(size_t); // local depth
+    size_t count;
+    memcpy(&count, data + pos, sizeof(count));
+    pos += sizeof(count);
+
+    for (size_t i = 0; i < count; i++) {
+	size_t keySize, dataSize;
+	if (pos + sizeof(keySize) > pageSize) {
+	    throw std::string("Corrupted hash bucket");
+	}
+	memcpy(&keySize, data + pos, sizeof(keySize));
+	pos += sizeof(keySize);
+	const char *keyValue = data + pos;
+	pos += keySize;
+
+	if (pos + sizeof(dataSize) > pageSize) {
+	    throw std::string("Corrupted hash bucket");
+	}
+	memcpy(&dataSize, data + pos, sizeof(dataSize));
+	pos += sizeof(dataSize);
+	if (pos + dataSize > pageSize) {
+	    throw std::string("Corrupted hash bucket");
+	}
+
+	if (keySize == key.size && !memcmp(keyValue, key.data, keySize)) {
+	    toWrite = Record::rawCopyFrom(Record(dataSize, const_cast<char *>(data + pos)));
+	    return true;
+	}
+	pos += dataSize;
+    }
+    return false;
+}
+
+size_t HashBucket::localDepth() const
+{
+    return m_localDepth;
+}
+
+void HashBucket::setLocalDepth(size_t depth)
+{
+    m_localDepth = depth;
+}
+
+std::vector<HashBucket::Record> &HashBucket::keys()
+{
+    return m_keys;
+}
+
+std::vector<HashBucket::Record> &HashBucket::data()
+{
+    return m_data;
+}
+
+size_t HashBucket::pageNumber() const
+{
+    return m_pageNumber;
+}
+
+size_t HashBucket::find(const Record &key) const
+{
+    for (size_t i = 0; i < m_keys.size(); i++) {
+	if (m_keys[i] == key) {
+	    return i;
+	}
+    }
+    return m_keys.size();
+}
+
+void HashBucket::erase(size_t index)
+{
+    delete[] m_keys[index].data;
+    delete[] m_data[index].data;
+    m_keys.erase(m_keys.begin() + index);
+    m_data.erase(m_data.begin() + index);
+}
+
+size_t HashBucket::spaceOnDisk() const
+{
+    size_t curSpace = sizeof(m_localDepth) + sizeof(size_t);
+    for (size_t i = 0; i < m_keys.size(); i++) {
+	curSpace += additionalSpaceFor(m_keys[i], m_data[i]);
+    }
+    return curSpace;
+}
+
+size_t HashBucket::additionalSpaceFor(const Record &key, const Record &data)
+{
+    return sizeof(key.size) + key.size + sizeof(data.size) + data.size;
+}
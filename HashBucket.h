@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+#include "Page.h"
+#include "PageReadWriter.h"
+#include "GlobalConfiguration.h"
+#include "DatabaseNode.h"
+
+/// Page of hash engine holding records whose hashes share localDepth low bits
+class HashBucket
+{
+public:
+    typedef DatabaseNode::Record Record;
+
+    HashBucket(
+	GlobalConfiguration *globConf,
+	PageReadWriter &rw,
+	size_t pageNumber,
+	bool needRead);
+
+    ~HashBucket();
+
+    void writeToPages(GlobalConfiguration *globConf, PageReadWriter &rw);
+
+    /// Searches key right in the page image without decoding whole bucket
+    static bool lookup(const Page &page, size_t pageSize, const Record &key, Record &toWrite);
+
+    size_t localDepth() const;
+    void setLocalDepth(size_t depth);
+
+    std::vector<Record> &keys();
+    std::vector<Record> &data();
+
+    size_t pageNumber() const;
+    /// Returns index of key or keys().size() if there is no such key
+    size_t find(const Record &key) const;
+    void erase(size_t index);
+
+    size_t spaceOnDisk() const;
+    static size_t additionalSpaceFor(const Record &key, const Record &data);
+
+private:
+    size_t m_pageNumber;
+    size_t m_localDepth;
+    std::vector<Record> m_keys;
+    std::vector<Record> m_data;
+
+    HashBucket(const HashBucket &) { }
+    void operator=(const HashBucket &) { }
+};
@@ -0,0 +1,249 @@
+#include "HashDatabase.h"
+
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <set>
+
+HashDatabase::HashDatabase(const char *databaseFile, const Configuration &configuration)
+    : DatabaseEngine(configuration)
+    , m_globConfiguration(
+	configuration.size / configuration.pageSize,
+	configuration.pageSize,
+	1,
+	configuration.cacheSize,
+	HASH,
+	GlobalConfiguration::FORMAT_WIDE,
+	configuration.inMemory ? "" : journalFile(databaseFile).c_str()) //desired params
+    // line below will init m_globConfiguration if file exists
+    , m_pageReadWriter(
+	createSource(databaseFile, configuration, &m_globConfiguration, &m_statistics),
+	&m_globConfiguration,
+	&m_statistics,
+	&m_memoryBudget)
+    , m_globalDepth(0)
+{
+    if (m_globConfiguration.engineType() != HASH) {
+	throw std::string("Database file wasn't created by hash engine");
+    }
+    if (directoryEntriesPerPage() == 0) {
+	throw std::string("Page size is too small for hash directory");
+    }
+
+    setUpWarmUp(databaseFile, configuration, m_pageReadWriter);
+
+    m_directoryPages.push_back(m_globConfiguration.rootNodePageNumber());
+    if (m_globConfiguration.isReadedFromFile()) {
+	readDirectory();
+    } else {
+	HashBucket bucket(&m_globConfiguration, m_pageReadWriter, m_pageReadWriter.allocatePageNumber(), false);
+	bucket.writeToPages(&m_globConfiguration, m_pageReadWriter);
+	m_directory.push_back(bucket.pageNumber());
+	writeDirectoryPage(0);
+    }
+
+    // Redo doesn't need operations committed before crash
+    m_pageReadWriter.clearCommittedOperations();
+    if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::INSERT) {
+	insert(m_pageReadWriter.pendingKey(), m_pageReadWriter.pendingValue());
+    } else if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::DELETE) {
+	remove(m_pageReadWriter.pendingKey());
+    }
+}
+
+HashDatabase::~HashDatabase()
+{
+    close();
+}
+
+void HashDatabase::close()
+{
+    m_pageReadWriter.close();
+}
+
+void HashDatabase::sync()
+{
+    m_pageReadWriter.sync();
+}
+
+void HashDatabase::compact()
+{
+    m_pageReadWriter.shrink();
+}
+
+void HashDatabase::setCacheSize(size_t cacheSize)
+{
+    m_pageReadWriter.setCacheSize(cacheSize);
+}
+
+uint64_t HashDatabase::hash(const DatabaseNode::Record &key)
+{
+    // FNV-1a
+    uint64_t res = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < key.size; i++) {
+	res ^= static_cast<unsigned char>(key.data[i]);
+	res *= 0x100000001B3ULL;
+    }
+    return res;
+}
+
+size_t HashDatabase::directoryEntriesPerPage() const
+{
+    return (m_globConfiguration.pageSize() - DIRECTORY_HEADER_SIZE) / sizeof(size_t);
+}
+
+size_t HashDatabase::bucketPageFor(uint64_t keyHash) const
+{
+    return m_directory[keyHash & ((1ULL << m_globalDepth) - 1)];
+}
+
+void HashDatabase::readDirectory()
+{
+    size_t perPage = directoryEntriesPerPage();
+    for (size_t i = 0; i < m_directoryPages.size(); i++) {
+	Page p(m_directoryPages[i], m_globConfiguration.pageSize());
+	m_pageReadWriter.read(p);
+
+	size_t globalDepth, nextPage;
+	p.read(&globalDepth, sizeof(globalDepth));
+	p.read(&nextPage, sizeof(nextPage));
+	if (i == 0) {
+	    m_globalDepth = globalDepth;
+	    m_directory.resize(1ULL << m_globalDepth);
+	}
+
+	size_t count = std::min(perPage, m_directory.size() - i * perPage);
+	p.read(&m_directory[i * perPage], count * sizeof(size_t));
+	if (nextPage) {
+	    m_directoryPages.push_back(nextPage);
+	}
+    }
+}
+
+void HashDatabase::writeDirectoryPage(size_t index)
+{
+    size_t perPage = directoryEntriesPerPage();
+    Page p(m_directoryPages[index], m_globConfiguration.pageSize());
+
+    size_t nextPage = index + 1 < m_directoryPages.size() ? m_directoryPages[index + 1] : 0;
+    p.write(&m_globalDepth, sizeof(m_globalDepth));
+    p.write(&nextPage, sizeof(nextPage));
+    if (index * perPage < m_directory.size()) {
+	size_t count = std::min(perPage, m_directory.size() - index * perPage);
+	p.write(&m_directory[index * perPage], count * sizeof(size_t));
+    }
+    m_pageReadWriter.write(p);
+}
+
+void HashDatabase::splitBucket(HashBucket *bucket)
+{
+    size_t depth = bucket->localDepth();
+    if (depth >= MAX_DEPTH) {
+	throw std::string("Too many keys with equal hash");
+    }
+    m_statistics.splits++;
+
+    size_t perPage = directoryEntriesPerPage();
+    std::set<size_t> changedPages;
+    if (depth == m_globalDepth) {
+	size_t oldSize = m_directory.size();
+	m_directory.insert(m_directory.end(), m_directory.begin(), m_directory.end());
+	m_globalDepth++;
+
+	size_t oldPageCount = m_directoryPages.size();
+	while (m_directoryPages.size() * perPage < m_directory.size()) {
+	    m_directoryPages.push_back(m_pageReadWriter.allocatePageNumber());
+	}
+	changedPages.insert(0); // global depth
+	if (oldPageCount != m_directoryPages.size()) {
+	    changedPages.insert(oldPageCount - 1); // next page link
+	}
+	for (size_t i = oldSize; i < m_directory.size(); i++) {
+	    changedPages.insert(i / perPage);
+	}
+    }
+
+    HashBucket sibling(&m_globConfiguration, m_pageReadWriter, m_pageReadWriter.allocatePageNumber(), false);
+    bucket->setLocalDepth(depth + 1);
+    sibling.setLocalDepth(depth + 1);
+
+    for (size_t i = 0; i < bucket->keys().size(); ) {
+	if ((hash(bucket->keys()[i]) >> depth) & 1) {
+	    sibling.keys().push_back(bucket->keys()[i]);
+	    sibling.data().push_back(bucket->data()[i]);
+	    bucket->keys().erase(bucket->keys().begin() + i);
+	    bucket->data().erase(bucket->data().begin() + i);
+	} else {
+	    i++;
+	}
+    }
+
+    // Entries pointing to the bucket with set bit `depth` now go to sibling
+    for (size_t i = (1ULL << depth); i < m_directory.size(); i++) {
+	if (m_directory[i] == bucket->pageNumber() && ((i >> depth) & 1)) {
+	    m_directory[i] = sibling.pageNumber();
+	    changedPages.insert(i / perPage);
+	}
+    }
+
+    sibling.writeToPages(&m_globConfiguration, m_pageReadWriter);
+    bucket->writeToPages(&m_globConfiguration, m_pageReadWriter);
+    for (size_t page : changedPages) {
+	writeDirectoryPage(page);
+    }
+}
+
+void HashDatabase::insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+{
+    size_t headerSize = 2 * sizeof(size_t);
+    if (headerSize + HashBucket::additionalSpaceFor(key, value) > m_globConfiguration.pageSize()) {
+	throw std::string("Record doesn't fit into page");
+    }
+
+    m_pageReadWriter.startOperation(CachedPageReadWriter::INSERT, key, value);
+
+    uint64_t keyHash = hash(key);
+    while (true) {
+	std::unique_ptr<HashBucket> bucket(new HashBucket(
+	    &m_globConfiguration,
+	    m_pageReadWriter,
+	    bucketPageFor(keyHash),
+	    true));
+
+	size_t pos = bucket->find(key);
+	if (pos != bucket->keys().size()) {
+	    bucket->erase(pos);
+	}
+
+	if (bucket->spaceOnDisk() + HashBucket::additionalSpaceFor(key, value) <= m_globConfiguration.pageSize()) {
+	    bucket->keys().push_back(DatabaseNode::Record::rawCopyFrom(key));
+	    bucket->data().push_back(DatabaseNode::Record::rawCopyFrom(value));
+	    bucket->writeToPages(&m_globConfiguration, m_pageReadWriter);
+	    break;
+	}
+	splitBucket(bucket.get());
+    }
+
+    m_pageReadWriter.endOperation();
+}
+
+bool HashDatabase::select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite)
+{
+    Page p(bucketPageFor(hash(key)), m_globConfiguration.pageSize());
+    m_pageReadWriter.read(p);
+    return HashBucket::lookup(p, m_globConfiguration.pageSize(), key, toWrite);
+}
+
+void HashDatabase::remove(const DatabaseNode::Record &key)
+{
+    m_pageReadWriter.startOperation(CachedPageReadWriter::DELETE, key, key);
+
+    HashBucket bucket(&m_globConfiguration, m_pageReadWriter, bucketPageFor(hash(key)), true);
+    size_t pos = bucket.find(key);
+    if (pos != bucket.keys().size()) {
+	bucket.erase(pos);
+	bucket.writeToPages(&m_globConfiguration, m_pageReadWriter);
+    }
+
+    m_pageReadWriter.endOperation();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "CachedPageReadWriter.h"
+#include "DatabaseEngine.h"
+#include "HashBucket.h"
+
+/// Extendible hashing engine for point lookups, no ordered access
+class HashDatabase : public DatabaseEngine
+{
+public:
+    HashDatabase(const char *databaseFile, const Configuration &configuration);
+    ~HashDatabase();
+
+    void close();
+    void remove(const DatabaseNode::Record &key);
+    void insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
+    bool select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite);
+
+    void sync();
+
+    /// Buckets never move, only free tail of file is released
+    void compact();
+    void setCacheSize(size_t cacheSize);
+
+private:
+    // Directory page: global depth, next directory page (0 for last), entries
+    static const size_t DIRECTORY_HEADER_SIZE = 2 * sizeof(size_t);
+    static const size_t MAX_DEPTH = 48;
+
+    GlobalConfiguration m_globConfiguration;
+    CachedPageReadWriter m_pageReadWriter;
+
+    size_t m_globalDepth;
+    /// Bucket page for every hash suffix of m_globalDepth bits, kept in memory
+    std::vector<size_t> m_directory;
+    /// Pages holding directory, first one is the root page
+    std::vector<size_t> m_directoryPages;
+
+    static uint64_t hash(const DatabaseNode::Record &key);
+
+    size_t directoryEntriesPerPage() const;
+    size_t bucketPageFor(uint64_t keyHash) const;
+    void readDirectory();
+    void writeDirectoryPage(size_t index);
+    void splitBucket(HashBucket *bucket);
+};
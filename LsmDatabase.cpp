@@ -0,0 +1,502 @@
+#include "LsmDatabase.h"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "Utils.h"
+
+LsmDatabase::LsmDatabase(const char *databaseFile, const Configuration &configuration)
+    : DatabaseEngine(configuration)
+    , m_databaseFile(databaseFile)
+    , m_inMemory(configuration.inMemory)
+    , m_globConfiguration(
+	configuration.size / configuration.pageSize,
+	configuration.pageSize,
+	1,
+	configuration.cacheSize,
+	LSM,
+	GlobalConfiguration::FORMAT_WIDE,
+	configuration.inMemory ? "" : journalFile(databaseFile).c_str()) //desired params
+    // line below will init m_globConfiguration if file exists
+    , m_pageReadWriter(
+	createSource(databaseFile, configuration, &m_globConfiguration, &m_statistics),
+	&m_globConfiguration,
+	&m_statistics,
+	&m_memoryBudget)
+    , m_stopCompaction(false)
+    , m_hasFinishedCompaction(false)
+    , m_memtableBytes(0)
+    , m_levels(1)
+    , m_nextRunId(1)
+    , m_isClosed(false)
+{
+    if (m_globConfiguration.engineType() != LSM) {
+	throw std::string("Database file wasn't created by LSM engine");
+    }
+    m_memtableLimit = std::max(m_globConfiguration.cacheSize() / 2, m_globConfiguration.pageSize() * 16);
+
+    if (m_globConfiguration.isReadedFromFile()) {
+	readManifest();
+    } else {
+	writeManifest();
+    }
+
+    // Memtable content since last flush lives only in journal
+    for (const CachedPageReadWriter::LoggedOperation &op : m_pageReadWriter.committedOperations()) {
+	apply(op.key, op.value, op.type == CachedPageReadWriter::DELETE);
+    }
+    m_pageReadWriter.clearCommittedOperations();
+
+    if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::INSERT) {
+	insert(m_pageReadWriter.pendingKey(), m_pageReadWriter.pendingValue());
+    } else if (m_pageReadWriter.pendingOperation() == CachedPageReadWriter::DELETE) {
+	remove(m_pageReadWriter.pendingKey());
+    }
+
+    startCompactionThread();
+}
+
+LsmDatabase::~LsmDatabase()
+{
+    close();
+}
+
+void LsmDatabase::close()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_isClosed) {
+	return;
+    }
+    m_isClosed = true;
+
+    stopCompactionThread(lock);
+    installCompaction();
+    flushMemtable();
+    if (!m_inMemory && !m_pageReadWriter.isReadOnly()) {
+	m_pageReadWriter.shrink(); // journal of checkpoints isn't needed anymore
+    }
+    m_pageReadWriter.close();
+}
+
+void LsmDatabase::sync()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    installCompaction();
+    // Checkpoint ends replay of journal, so memtable has to be in run first
+    flushMemtable();
+    m_pageReadWriter.sync();
+}
+
+void LsmDatabase::insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    installCompaction();
+
+    if (2 * sizeof(size_t) + key.size + value.size > m_globConfiguration.pageSize()) {
+	throw std::string("Record doesn't fit journal record");
+    }
+    m_pageReadWriter.startOperation(CachedPageReadWriter::INSERT, key, value);
+    apply(std::string(key.data, key.size), std::string(value.data, value.size), false);
+    m_pageReadWriter.endOperation();
+
+    if (shouldFlushMemtable()) {
+	flushMemtable();
+    }
+}
+
+void LsmDatabase::remove(const DatabaseNode::Record &key)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    installCompaction();
+
+    m_pageReadWriter.startOperation(CachedPageReadWriter::DELETE, key, key);
+    apply(std::string(key.data, key.size), std::string(), true);
+    m_pageReadWriter.endOperation();
+
+    if (shouldFlushMemtable()) {
+	flushMemtable();
+    }
+}
+
+bool LsmDatabase::select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite)
+{
+    std::string k(key.data, key.size);
+    RunList runs;
+    {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	installCompaction();
+
+	Memtable::const_iterator it = m_memtable.find(k);
+	if (it != m_memtable.end()) {
+	    if (it->second.isDeleted) {
+		return false;
+	    }
+	    const std::string &value = it->second.value;
+	    toWrite = DatabaseNode::Record::rawCopyFrom(
+		DatabaseNode::Record(value.size(), const_cast<char *>(value.data())));
+	    return true;
+	}
+
+	// Runs are immutable, so they are searched without lock
+	for (const RunList &level : m_levels) {
+	    runs.insert(runs.end(), level.begin(), level.end());
+	}
+    }
+
+    std::string value;
+    size_t blocksRead = 0;
+    LsmRun::LookupResult res = LsmRun::NOT_FOUND;
+    for (size_t i = 0; i < runs.size() && res == LsmRun::NOT_FOUND; i++) {
+	res = runs[i]->lookup(k, value, blocksRead);
+    }
+    m_statistics.pagesRead += blocksRead;
+
+    if (res != LsmRun::FOUND) {
+	return false;
+    }
+    toWrite = DatabaseNode::Record::rawCopyFrom(DatabaseNode::Record(value.size(), &value[0]));
+    return true;
+}
+
+void LsmDatabase::setCacheSize(size_t cacheSize)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    installCompaction();
+    m_pageReadWriter.setCacheSize(cacheSize);
+    m_memtableLimit = std::max(cacheSize / 2, m_globConfiguration.pageSize() * 16);
+    if (shouldFlushMemtable()) {
+	flushMemtable();
+    }
+}
+
+void LsmDatabase::compact()
+{
+    m_pageReadWriter.checkWritable();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    stopCompactionThread(lock);
+    installCompaction();
+    flushMemtable();
+
+    RunList inputs;
+    for (const RunList &level : m_levels) {
+	inputs.insert(inputs.end(), level.begin(), level.end());
+    }
+    if (!inputs.empty()) {
+	size_t targetLevel = std::max<size_t>(1, m_levels.size() - 1);
+	std::shared_ptr<LsmRun> output = mergeRuns(inputs, m_nextRunId++, targetLevel, true);
+	m_levels.assign(targetLevel + 1, RunList());
+	if (output) {
+	    m_levels[targetLevel].push_back(output);
+	}
+	writeManifest();
+	// Inputs are deleted only after manifest without them is on disk
+	m_pageReadWriter.sync();
+	for (const std::shared_ptr<LsmRun> &run : inputs) {
+	    run->markObsolete();
+	}
+    }
+    m_pageReadWriter.shrink();
+
+    startCompactionThread();
+}
+
+std::string LsmDatabase::runPath(size_t id) const
+{
+    return m_databaseFile + "." + std::to_string(id) + ".run";
+}
+
+size_t LsmDatabase::levelLimit(size_t level) const
+{
+    size_t res = m_memtableLimit * L0_COMPACTION_TRIGGER;
+    for (size_t i = 1; i < level; i++) {
+	res *= LEVEL_SIZE_RATIO;
+    }
+    return res;
+}
+
+void LsmDatabase::readManifest()
+{
+    // Manifest page: next run id, run count, (id, level) of every run
+    Page p(m_globConfiguration.rootNodePageNumber(), m_globConfiguration.pageSize());
+    m_pageReadWriter.read(p);
+
+    size_t runCount;
+    p.read(&m_nextRunId, sizeof(m_nextRunId));
+    p.read(&runCount, sizeof(runCount));
+    for (size_t i = 0; i < runCount; i++) {
+	size_t id, level;
+	p.read(&id, sizeof(id));
+	p.read(&level, sizeof(level));
+	if (m_levels.size() <= level) {
+	    m_levels.resize(level + 1);
+	}
+	m_levels[level].push_back(std::make_shared<LsmRun>(runPath(id), id, level));
+    }
+
+    // Newer level 0 runs have bigger ids
+    std::sort(m_levels[0].begin(), m_levels[0].end(),
+	[](const std::shared_ptr<LsmRun> &a, const std::shared_ptr<LsmRun> &b) {
+	    return a->id() > b->id();
+	});
+}
+
+void LsmDatabase::writeManifest()
+{
+    size_t runCount = 0;
+    for (const RunList &level : m_levels) {
+	runCount += level.size();
+    }
+    if ((2 + 2 * runCount) * sizeof(size_t) > m_globConfiguration.pageSize()) {
+	throw std::string("Too many runs for manifest page");
+    }
+
+    Page p(m_globConfiguration.rootNodePageNumber(), m_globConfiguration.pageSize());
+    p.write(&m_nextRunId, sizeof(m_nextRunId));
+    p.write(&runCount, sizeof(runCount));
+    for (const RunList &level : m_levels) {
+	for (const std::shared_ptr<LsmRun> &run : level) {
+	    size_t id = run->id();
+	    size_t levelNumber = run->level();
+	    p.write(&id, sizeof(id));
+	    p.write(&levelNumber, sizeof(levelNumber));
+	}
+    }
+    m_pageReadWriter.write(p);
+}
+
+void LsmDatabase::apply(const std::string &key, const std::string &value, bool isDeleted)
+{
+    Memtable::iterator it = m_memtable.find(key);
+    if (it != m_memtable.end()) {
+	size_t entryBytes = it->first.size() + it->second.value.size() + MEMTABLE_ENTRY_OVERHEAD;
+	m_memtableBytes -= entryBytes;
+	m_memoryBudget.release(MemoryBudget::MEMTABLE, entryBytes);
+    }
+
+    bool hasRuns = false;
+    for (const RunList &level : m_levels) {
+	hasRuns = hasRuns || !level.empty();
+    }
+    if (isDeleted && !hasRuns) {
+	// Nothing older to hide
+	if (it != m_memtable.end()) {
+	    m_memtable.erase(it);
+	}
+	return;
+    }
+
+    MemtableValue &entry = m_memtable[key];
+    entry.value = value;
+    entry.isDeleted = isDeleted;
+    size_t entryBytes = key.size() + value.size() + MEMTABLE_ENTRY_OVERHEAD;
+    m_memtableBytes += entryBytes;
+    m_memoryBudget.charge(MemoryBudget::MEMTABLE, entryBytes);
+}
+
+bool LsmDatabase::shouldFlushMemtable()
+{
+    if (m_memtableBytes >= m_memtableLimit) {
+	return true;
+    }
+    // Over memory budget memtable goes to run early, but not as tiny runs
+    if (m_memoryBudget.isOverLimit() && !m_inMemory
+	    && m_memtableBytes >= MIN_SHED_MEMTABLE_PAGES * m_globConfiguration.pageSize()) {
+	m_statistics.memorySheds++;
+	return true;
+    }
+    return false;
+}
+
+void LsmDatabase::flushMemtable()
+{
+    if (m_inMemory || m_memtable.empty()) {
+	return;
+    }
+
+    size_t id = m_nextRunId++;
+    {
+	LsmRun::Writer writer(runPath(id), m_globConfiguration.pageSize());
+	for (const Memtable::value_type &e : m_memtable) {
+	    writer.add(e.first, e.second.value, e.second.isDeleted);
+	}
+	writer.finish();
+    }
+    std::shared_ptr<LsmRun> run = std::make_shared<LsmRun>(runPath(id), id, 0);
+    m_levels[0].insert(m_levels[0].begin(), run);
+    m_statistics.pagesWritten += Utils::roundUpDiv(run->fileSize(), m_globConfiguration.pageSize());
+
+    m_memtable.clear();
+    m_memoryBudget.release(MemoryBudget::MEMTABLE, m_memtableBytes);
+    m_memtableBytes = 0;
+
+    writeManifest();
+    // Flushed operations are in the run now, recovery starts behind checkpoint
+    m_pageReadWriter.flush();
+    if (m_pageReadWriter.journalSize() > MAX_JOURNAL_BYTES) {
+	m_pageReadWriter.shrink();
+    }
+
+    m_compactionWakeup.notify_one();
+}
+
+void LsmDatabase::startCompactionThread()
+{
+    // Read-only database keeps its runs as they are
+    if (m_inMemory || m_pageReadWriter.isReadOnly()) {
+	return;
+    }
+    m_compactionThread = std::thread(&LsmDatabase::compactionLoop, this);
+}
+
+void LsmDatabase::stopCompactionThread(std::unique_lock<std::mutex> &lock)
+{
+    if (!m_compactionThread.joinable()) {
+	return;
+    }
+    m_stopCompaction = true;
+    m_compactionWakeup.notify_all();
+    lock.unlock();
+    m_compactionThread.join();
+    lock.lock();
+    m_stopCompaction = false;
+}
+
+void LsmDatabase::compactionLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopCompaction) {
+	Compaction compaction;
+	if (m_hasFinishedCompaction || !pickCompaction(compaction)) {
+	    m_compactionWakeup.wait(lock);
+	    continue;
+	}
+	size_t id = m_nextRunId++;
+
+	lock.unlock();
+	try {
+	    compaction.output = mergeRuns(compaction.inputs, id, compaction.targetLevel, compaction.dropTombstones);
+	} catch (std::string err) {
+	    unlink(runPath(id).c_str());
+	    lock.lock();
+	    // Error is reported by next call, merge is retried after next wakeup
+	    m_compactionError = err;
+	    m_compactionWakeup.wait(lock);
+	    continue;
+	}
+	lock.lock();
+
+	// Installed by caller thread, which owns page read writer
+	m_finishedCompaction = compaction;
+	m_hasFinishedCompaction = true;
+    }
+}
+
+bool LsmDatabase::pickCompaction(Compaction &compaction) const
+{
+    if (m_levels[0].size() >= L0_COMPACTION_TRIGGER) {
+	compaction.inputs = m_levels[0];
+	compaction.targetLevel = 1;
+    } else {
+	size_t level = 1;
+	while (level < m_levels.size()
+		&& (m_levels[level].empty() || m_levels[level][0]->fileSize() <= levelLimit(level))) {
+	    level++;
+	}
+	if (level == m_levels.size()) {
+	    return false;
+	}
+	compaction.inputs = m_levels[level];
+	compaction.targetLevel = level + 1;
+    }
+    if (compaction.targetLevel < m_levels.size()) {
+	const RunList &target = m_levels[compaction.targetLevel];
+	compaction.inputs.insert(compaction.inputs.end(), target.begin(), target.end());
+    }
+
+    // Tombstones are needed only while some older run may still hold the key
+    compaction.dropTombstones = true;
+    for (size_t i = compaction.targetLevel + 1; i < m_levels.size(); i++) {
+	compaction.dropTombstones = compaction.dropTombstones && m_levels[i].empty();
+    }
+    return true;
+}
+
+void LsmDatabase::installCompaction()
+{
+    if (!m_compactionError.empty()) {
+	std::string err;
+	err.swap(m_compactionError);
+	throw err;
+    }
+    if (!m_hasFinishedCompaction) {
+	return;
+    }
+
+    Compaction &compaction = m_finishedCompaction;
+    for (const std::shared_ptr<LsmRun> &run : compaction.inputs) {
+	RunList &level = m_levels[run->level()];
+	level.erase(std::find(level.begin(), level.end(), run));
+    }
+    if (m_levels.size() <= compaction.targetLevel) {
+	m_levels.resize(compaction.targetLevel + 1);
+    }
+    if (compaction.output) {
+	m_levels[compaction.targetLevel].push_back(compaction.output);
+    }
+    writeManifest();
+    // Inputs are deleted only after manifest without them is on disk
+    m_pageReadWriter.sync();
+    for (const std::shared_ptr<LsmRun> &run : compaction.inputs) {
+	run->markObsolete();
+    }
+
+    m_finishedCompaction = Compaction();
+    m_hasFinishedCompaction = false;
+    m_compactionWakeup.notify_one();
+}
+
+std::shared_ptr<LsmRun> LsmDatabase::mergeRuns(const RunList &inputs, size_t id, size_t level, bool dropTombstones)
+{
+    std::vector<std::unique_ptr<LsmRun::Iterator> > iterators;
+    for (const std::shared_ptr<LsmRun> &run : inputs) {
+	iterators.push_back(std::unique_ptr<LsmRun::Iterator>(new LsmRun::Iterator(*run)));
+    }
+
+    LsmRun::KeyLess less;
+    size_t entryCount;
+    {
+	LsmRun::Writer writer(runPath(id), m_globConfiguration.pageSize());
+	while (true) {
+	    // Smallest key, the newest run wins on equal keys
+	    size_t best = iterators.size();
+	    for (size_t i = 0; i < iterators.size(); i++) {
+		if (iterators[i]->isValid() && (best == iterators.size()
+			|| less(iterators[i]->entry().key, iterators[best]->entry().key))) {
+		    best = i;
+		}
+	    }
+	    if (best == iterators.size()) {
+		break;
+	    }
+
+	    const LsmRun::Entry &entry = iterators[best]->entry();
+	    if (!dropTombstones || !entry.isDeleted) {
+		writer.add(entry.key, entry.value, entry.isDeleted);
+	    }
+	    std::string key = entry.key;
+	    for (size_t i = 0; i < iterators.size(); i++) {
+		while (iterators[i]->isValid() && iterators[i]->entry().key == key) {
+		    iterators[i]->next();
+		}
+	    }
+	}
+	entryCount = writer.finish();
+    }
+
+    if (entryCount == 0) {
+	unlink(runPath(id).c_str());
+	return std::shared_ptr<LsmRun>();
+    }
+    return std::make_shared<LsmRun>(runPath(id), id, level);
+}
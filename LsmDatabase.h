@@ -0,0 +1,104 @@
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CachedPageReadWriter.h"
+#include "DatabaseEngine.h"
+#include "LsmRun.h"
+
+/// Log-structured merge tree engine for write-heavy loads
+/// Writes go to journal and sorted memtable, full memtable becomes level 0 run,
+/// background thread merges runs into deeper levels, one run per level >= 1
+class LsmDatabase : public DatabaseEngine
+{
+public:
+    LsmDatabase(const char *databaseFile, const Configuration &configuration);
+    ~LsmDatabase();
+
+    void close();
+    void remove(const DatabaseNode::Record &key);
+    void insert(const DatabaseNode::Record &key, const DatabaseNode::Record &value);
+    bool select(const DatabaseNode::Record &key, DatabaseNode::Record &toWrite);
+
+    /// Memtable goes to run, so journal is only checkpointed
+    void sync();
+
+    /// Merges all runs into single one without tombstones
+    void compact();
+    /// Memtable limit follows cache size
+    void setCacheSize(size_t cacheSize);
+
+private:
+    static const size_t L0_COMPACTION_TRIGGER = 4;
+    static const size_t LEVEL_SIZE_RATIO = 10;
+    // Memtable entry overhead besides key and value bytes
+    static const size_t MEMTABLE_ENTRY_OVERHEAD = 64;
+    /// Smallest memtable flushed to get under memory budget
+    static const size_t MIN_SHED_MEMTABLE_PAGES = 16;
+    /// Journal longer than this is cut after memtable flush
+    static const size_t MAX_JOURNAL_BYTES = 64 << 20;
+
+    typedef std::vector<std::shared_ptr<LsmRun> > RunList;
+
+    struct MemtableValue
+    {
+	std::string value;
+	bool isDeleted;
+    };
+    typedef std::map<std::string, MemtableValue, LsmRun::KeyLess> Memtable;
+
+    struct Compaction
+    {
+	/// Newest first
+	RunList inputs;
+	size_t targetLevel;
+	bool dropTombstones;
+	std::shared_ptr<LsmRun> output;
+    };
+
+    std::string m_databaseFile;
+    bool m_inMemory;
+    GlobalConfiguration m_globConfiguration;
+    CachedPageReadWriter m_pageReadWriter;
+
+    /// Guards all state below, page read writer is used only by caller thread
+    std::mutex m_mutex;
+    std::condition_variable m_compactionWakeup;
+    std::thread m_compactionThread;
+    bool m_stopCompaction;
+    bool m_hasFinishedCompaction;
+    Compaction m_finishedCompaction;
+    std::string m_compactionError;
+
+    Memtable m_memtable;
+    size_t m_memtableBytes;
+    size_t m_memtableLimit;
+    /// Level 0 runs newest first, deeper levels hold at most one run
+    std::vector<RunList> m_levels;
+    size_t m_nextRunId;
+    bool m_isClosed;
+
+    std::string runPath(size_t id) const;
+    size_t levelLimit(size_t level) const;
+
+    void readManifest();
+    void writeManifest();
+
+    void apply(const std::string &key, const std::string &value, bool isDeleted);
+    /// Memtable is full or has to give memory back
+    bool shouldFlushMemtable();
+    void flushMemtable();
+
+    void startCompactionThread();
+    void stopCompactionThread(std::unique_lock<std::mutex> &lock);
+    void compactionLoop();
+    bool pickCompaction(Compaction &compaction) const;
+    void installCompaction();
+    std::shared_ptr<LsmRun> mergeRuns(const RunList &inputs, size_t id, size_t level, bool dropTombstones);
+};
@@ -0,0 +1,372 @@
+#include "LsmRun.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+bool LsmRun::KeyLess::operator()(const std::string &a, const std::string &b) const
+{
+    if (a.size() != b.size()) {
+	return a.size() < b.size();
+    }
+    return memcmp(a.data(), b.data(), a.size()) < 0;
+}
+
+// New file name is durable only when its directory is synced
+static void syncDirectory(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+	throw std::string("Can't open directory of run file");
+    }
+    int res = fsync(fd);
+    ::close(fd);
+    if (res == -1) {
+	throw std::string("Error syncing directory of run file");
+    }
+}
+
+LsmRun::Writer::Writer(const std::string &path, size_t blockSize)
+    : m_path(path)
+    , m_blockSize(blockSize)
+    , m_offset(0)
+    , m_indexCount(0)
+{
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (m_fd == -1) {
+	throw std::string("Can't create run file");
+    }
+}
+
+LsmRun::Writer::~Writer()
+{
+    if (m_fd != -1) {
+	::close(m_fd);
+    }
+}
+
+void LsmRun::Writer::add(const std::string &key, const std::string &value, bool isDeleted)
+{
+    if (m_block.empty()) {
+	m_blockFirstKey = key;
+    }
+
+    uint8_t flags = isDeleted;
+    size_t keySize = key.size();
+    size_t valueSize = isDeleted ? 0 : value.size();
+    m_block.append(reinterpret_cast<const char *>(&flags), sizeof(flags));
+    m_block.append(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+    m_block.append(key);
+    m_block.append(reinterpret_cast<const char *>(&valueSize), sizeof(valueSize));
+    m_block.append(value.data(), valueSize);
+    m_keyHashes.push_back(hash(key));
+
+    if (m_block.size() >= m_blockSize) {
+	flushBlock();
+    }
+}
+
+void LsmRun::Writer::flushBlock()
+{
+    if (m_block.empty()) {
+	return;
+    }
+    size_t keySize = m_blockFirstKey.size();
+    uint64_t blockSize = m_block.size();
+    m_index.append(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+    m_index.append(m_blockFirstKey);
+    m_index.append(reinterpret_cast<const char *>(&m_offset), sizeof(m_offset));
+    m_index.append(reinterpret_cast<const char *>(&blockSize), sizeof(blockSize));
+    m_indexCount++;
+
+    writeAll(m_block.data(), m_block.size());
+    m_offset += blockSize;
+    m_block.clear();
+}
+
+size_t LsmRun::Writer::finish()
+{
+    flushBlock();
+
+    Footer footer;
+    footer.indexOffset = m_offset;
+    footer.indexCount = m_indexCount;
+    writeAll(m_index.data(), m_index.size());
+    m_offset += m_index.size();
+
+    footer.bloomOffset = m_offset;
+    footer.bloomBits = std::max<uint64_t>(64, m_keyHashes.size() * BLOOM_BITS_PER_KEY);
+    std::vector<uint8_t> bloom((footer.bloomBits + 7) / 8, 0);
+    for (const uint64_t &h : m_keyHashes) {
+	uint64_t delta = (h >> 33) | 1;
+	for (size_t i = 0; i < BLOOM_HASHES; i++) {
+	    uint64_t bit = (h + i * delta) % footer.bloomBits;
+	    bloom[bit / 8] |= 1 << (bit % 8);
+	}
+    }
+    writeAll(bloom.data(), bloom.size());
+    m_offset += bloom.size();
+
+    footer.entryCount = m_keyHashes.size();
+    footer.magic = FOOTER_MAGIC;
+    writeAll(&footer, sizeof(footer));
+
+    if (fdatasync(m_fd) == -1) {
+	throw std::string("Error syncing run file");
+    }
+    ::close(m_fd);
+    m_fd = -1;
+    syncDirectory(m_path);
+    return footer.entryCount;
+}
+
+void LsmRun::Writer::writeAll(const void *data, size_t size)
+{
+    const char *pos = static_cast<const char *>(data);
+    while (size > 0) {
+	ssize_t written = ::write(m_fd, pos, size);
+	if (written <= 0) {
+	    throw std::string("Error writing run file");
+	}
+	pos += written;
+	size -= written;
+    }
+}
+
+LsmRun::Iterator::Iterator(const LsmRun &run)
+    : m_run(run)
+    , m_blockIndex(0)
+    , m_pos(0)
+    , m_isValid(true)
+{
+    next();
+}
+
+bool LsmRun::Iterator::isValid() const
+{
+    return m_isValid;
+}
+
+const LsmRun::Entry &LsmRun::Iterator::entry() const
+{
+    return m_entry;
+}
+
+void LsmRun::Iterator::next()
+{
+    while (m_pos >= m_block.size()) {
+	if (m_blockIndex == m_run.m_index.size()) {
+	    m_isValid = false;
+	    return;
+	}
+	m_run.readBlock(m_blockIndex++, m_block);
+	m_pos = 0;
+    }
+    if (!parseEntry(m_block, m_pos, m_entry)) {
+	throw std::string("Corrupted run block");
+    }
+}
+
+LsmRun::LsmRun(const std::string &path, size_t id, size_t level)
+    : m_path(path)
+    , m_id(id)
+    , m_level(level)
+    , m_isObsolete(false)
+{
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd == -1) {
+	throw std::string("Can't open run file");
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(Footer)) {
+	::close(m_fd);
+	throw std::string("Corrupted run file");
+    }
+    m_fileSize = st.st_size;
+
+    Footer footer;
+    readAt(m_fileSize - sizeof(footer), &footer, sizeof(footer));
+    if (footer.magic != FOOTER_MAGIC || footer.indexOffset > footer.bloomOffset
+	    || footer.bloomOffset + (footer.bloomBits + 7) / 8 + sizeof(footer) != m_fileSize) {
+	::close(m_fd);
+	throw std::string("Corrupted run file");
+    }
+    m_entryCount = footer.entryCount;
+    m_bloomBits = footer.bloomBits;
+
+    std::string index(footer.bloomOffset - footer.indexOffset, '\0');
+    readAt(footer.indexOffset, &index[0], index.size());
+    size_t pos = 0;
+    for (uint64_t i = 0; i < footer.indexCount; i++) {
+	IndexEntry e;
+	size_t keySize;
+	memcpy(&keySize, index.data() + pos, sizeof(keySize));
+	pos += sizeof(keySize);
+	e.firstKey.assign(index.data() + pos, keySize);
+	pos += keySize;
+	memcpy(&e.offset, index.data() + pos, sizeof(e.offset));
+	pos += sizeof(e.offset);
+	memcpy(&e.size, index.data() + pos, sizeof(e.size));
+	pos += sizeof(e.size);
+	m_index.push_back(e);
+    }
+
+    m_bloom.resize((m_bloomBits + 7) / 8);
+    readAt(footer.bloomOffset, m_bloom.data(), m_bloom.size());
+}
+
+LsmRun::~LsmRun()
+{
+    ::close(m_fd);
+    if (m_isObsolete) {
+	unlink(m_path.c_str());
+    }
+}
+
+size_t LsmRun::id() const
+{
+    return m_id;
+}
+
+size_t LsmRun::level() const
+{
+    return m_level;
+}
+
+size_t LsmRun::fileSize() const
+{
+    return m_fileSize;
+}
+
+size_t LsmRun::entryCount() const
+{
+    return m_entryCount;
+}
+
+const std::string &LsmRun::path() const
+{
+    return m_path;
+}
+
+void LsmRun::markObsolete()
+{
+    m_isObsolete = true;
+}
+
+LsmRun::LookupResult LsmRun::lookup(const std::string &key, std::string &value, size_t &blocksRead) const
+{
+    if (!mayContain(key)) {
+	return NOT_FOUND;
+    }
+
+    // Last block with first key not greater than key
+    size_t l = 0, r = m_index.size();
+    KeyLess less;
+    while (l < r) {
+	size_t m = (l + r) / 2;
+	if (less(key, m_index[m].firstKey)) {
+	    r = m;
+	} else {
+	    l = m + 1;
+	}
+    }
+    if (l == 0) {
+	return NOT_FOUND;
+    }
+
+    std::string block;
+    readBlock(l - 1, block);
+    blocksRead++;
+
+    size_t pos = 0;
+    Entry entry;
+    while (parseEntry(block, pos, entry)) {
+	if (entry.key == key) {
+	    if (entry.isDeleted) {
+		return DELETED;
+	    }
+	    value.swap(entry.value);
+	    return FOUND;
+	}
+	if (less(key, entry.key)) {
+	    break;
+	}
+    }
+    return NOT_FOUND;
+}
+
+uint64_t LsmRun::hash(const std::string &key)
+{
+    // FNV-1a
+    uint64_t res = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+	res ^= static_cast<unsigned char>(key[i]);
+	res *= 0x100000001B3ULL;
+    }
+    return res;
+}
+
+bool LsmRun::parseEntry(const std::string &block, size_t &pos, Entry &entry)
+{
+    uint8_t flags;
+    size_t keySize, valueSize;
+    if (pos + sizeof(flags) + sizeof(keySize) > block.size()) {
+	return false;
+    }
+    memcpy(&flags, block.data() + pos, sizeof(flags));
+    pos += sizeof(flags);
+    memcpy(&keySize, block.data() + pos, sizeof(keySize));
+    pos += sizeof(keySize);
+    if (pos + keySize + sizeof(valueSize) > block.size()) {
+	return false;
+    }
+    entry.key.assign(block.data() + pos, keySize);
+    pos += keySize;
+    memcpy(&valueSize, block.data() + pos, sizeof(valueSize));
+    pos += sizeof(valueSize);
+    if (pos + valueSize > block.size()) {
+	return false;
+    }
+    entry.value.assign(block.data() + pos, valueSize);
+    pos += valueSize;
+    entry.isDeleted = flags != 0;
+    return true;
+}
+
+bool LsmRun::mayContain(const std::string &key) const
+{
+    uint64_t h = hash(key);
+    uint64_t delta = (h >> 33) | 1;
+    for (size_t i = 0; i < BLOOM_HASHES; i++) {
+	uint64_t bit = (h + i * delta) % m_bloomBits;
+	if (!(m_bloom[bit / 8] & (1 << (bit % 8)))) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void LsmRun::readBlock(size_t index, std::string &block) const
+{
+    block.resize(m_index[index].size);
+    readAt(m_index[index].offset, &block[0], block.size());
+}
+
+void LsmRun::readAt(uint64_t offset, void *data, size_t size) const
+{
+    char *pos = static_cast<char *>(data);
+    while (size > 0) {
+	ssize_t got = pread(m_fd, pos, size, offset);
+	if (got <= 0) {
+	    throw std::string("Error reading run file");
+	}
+	pos += got;
+	size -= got;
+	offset += got;
+    }
+}
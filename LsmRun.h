@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Immutable file of entries sorted by key, deleted keys are kept as tombstones
+/// Layout: data blocks, sparse index (first key of every block), Bloom filter, footer
+class LsmRun
+{
+public:
+    enum LookupResult {
+	NOT_FOUND,
+	FOUND,
+	DELETED
+    };
+
+    struct Entry
+    {
+	std::string key;
+	std::string value;
+	bool isDeleted;
+    };
+
+    /// Same order as DatabaseNode::Record: shorter keys first, then bytes
+    struct KeyLess
+    {
+	bool operator()(const std::string &a, const std::string &b) const;
+    };
+
+    /// Writes entries added in key order
+    class Writer
+    {
+    public:
+	Writer(const std::string &path, size_t blockSize);
+	~Writer();
+
+	void add(const std::string &key, const std::string &value, bool isDeleted);
+	/// Writes index, filter and footer and syncs file and its directory,
+	/// returns entry count
+	size_t finish();
+
+    private:
+	std::string m_path;
+	int m_fd;
+	size_t m_blockSize;
+	uint64_t m_offset;
+	std::string m_block;
+	std::string m_blockFirstKey;
+	std::string m_index;
+	size_t m_indexCount;
+	std::vector<uint64_t> m_keyHashes;
+
+	void flushBlock();
+	void writeAll(const void *data, size_t size);
+    };
+
+    /// Reads all entries in key order
+    class Iterator
+    {
+    public:
+	Iterator(const LsmRun &run);
+
+	bool isValid() const;
+	const Entry &entry() const;
+	void next();
+
+    private:
+	const LsmRun &m_run;
+	size_t m_blockIndex;
+	std::string m_block;
+	size_t m_pos;
+	Entry m_entry;
+	bool m_isValid;
+    };
+
+    LsmRun(const std::string &path, size_t id, size_t level);
+    ~LsmRun();
+
+    size_t id() const;
+    size_t level() const;
+    size_t fileSize() const;
+    size_t entryCount() const;
+    const std::string &path() const;
+
+    LookupResult lookup(const std::string &key, std::string &value, size_t &blocksRead) const;
+
+    /// File is removed when the last reference to run is gone
+    void markObsolete();
+
+private:
+    static const uint64_t FOOTER_MAGIC = 0x314E55524D534C4DULL; // "MLSMRUN1"
+    static const size_t BLOOM_BITS_PER_KEY = 10;
+    static const size_t BLOOM_HASHES = 7;
+
+    struct IndexEntry
+    {
+	std::string firstKey;
+	uint64_t offset;
+	uint64_t size;
+    };
+
+    struct Footer
+    {
+	uint64_t indexOffset;
+	uint64_t indexCount;
+	uint64_t bloomOffset;
+	uint64_t bloomBits;
+	uint64_t entryCount;
+	uint64_t magic;
+    };
+
+    std::string m_path;
+    size_t m_id;
+    size_t m_level;
+    int m_fd;
+    size_t m_fileSize;
+    size_t m_entryCount;
+    std::vector<IndexEntry> m_index;
+    std::vector<uint8_t> m_bloom;
+    uint64_t m_bloomBits;
+    bool m_isObsolete;
+
+    static uint64_t hash(const std::string &key);
+    static bool parseEntry(const std::string &block, size_t &pos, Entry &entry);
+
+    bool mayContain(const std::string &key) const;
+    void readBlock(size_t index, std::string &block) const;
+    void readAt(uint64_t offset, void *data, size_t size) const;
+
+    LsmRun(const LsmRun &);
+    void operator=(const LsmRun &);
+};
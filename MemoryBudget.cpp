@@ -0,0 +1,70 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <sstream>
+
+static const char *COMPONENT_NAMES[MemoryBudget::COMPONENT_COUNT] = {
+    "page_cache",
+    "node_cache",
+    "operation_buffers",
+    "memtable",
+    "snapshots"
+};
+
+MemoryBudget::MemoryBudget(size_t limit)
+    : m_limit(limit)
+    , m_total(0)
+    , m_peak(0)
+{
+    std::fill(m_used, m_used + COMPONENT_COUNT, 0);
+}
+
+void MemoryBudget::charge(Component component, size_t bytes)
+{
+    m_used[component] += bytes;
+    m_total += bytes;
+    m_peak = std::max(m_peak, m_total);
+}
+
+void MemoryBudget::release(Component component, size_t bytes)
+{
+    m_used[component] -= bytes;
+    m_total -= bytes;
+}
+
+size_t MemoryBudget::limit() const
+{
+    return m_limit;
+}
+
+size_t MemoryBudget::used() const
+{
+    return m_total;
+}
+
+size_t MemoryBudget::used(Component component) const
+{
+    return m_used[component];
+}
+
+size_t MemoryBudget::peak() const
+{
+    return m_peak;
+}
+
+bool MemoryBudget::isOverLimit() const
+{
+    return m_limit && m_total > m_limit;
+}
+
+std::string MemoryBudget::dump() const
+{
+    std::ostringstream out;
+    out << "memory_limit " << m_limit << "\n";
+    out << "memory_used " << m_total << "\n";
+    out << "memory_peak " << m_peak << "\n";
+    for (size_t i = 0; i < COMPONENT_COUNT; i++) {
+	out << "memory_" << COMPONENT_NAMES[i] << " " << m_used[i] << "\n";
+    }
+    return out.str();
+}
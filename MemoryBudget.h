@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/// Memory held by one database, counted by component against common limit.
+/// Components charge what they allocate and, while total is over limit,
+/// give back what can be rebuilt: decoded nodes, cached pages, memtable
+class MemoryBudget
+{
+public:
+    enum Component {
+	/// Page frames of CachedPageReadWriter
+	PAGE_CACHE,
+	/// Decoded B-tree nodes of NodeCache
+	NODE_CACHE,
+	/// Copies of logged operations: current batch and ones restored from journal
+	OPERATION_BUFFERS,
+	/// Records of LSM memtable
+	MEMTABLE,
+	/// Page pre-images of open snapshots, they can't be given back
+	SNAPSHOTS,
+	COMPONENT_COUNT
+    };
+
+    /// Zero limit counts memory without limiting it
+    explicit MemoryBudget(size_t limit);
+
+    void charge(Component component, size_t bytes);
+    void release(Component component, size_t bytes);
+
+    size_t limit() const;
+    size_t used() const;
+    size_t used(Component component) const;
+    size_t peak() const;
+    bool isOverLimit() const;
+
+    /// Text dump in Statistics::dump format
+    std::string dump() const;
+
+private:
+    size_t m_limit;
+    size_t m_used[COMPONENT_COUNT];
+    size_t m_total;
+    size_t m_peak;
+
+    MemoryBudget(const MemoryBudget &);
+    void operator=(const MemoryBudget &);
+};
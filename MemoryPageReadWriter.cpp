@@ -0,0 +1,98 @@
+#include "MemoryPageReadWriter.h"
+
+#include <string>
+#include <cstring>
+
+MemoryPageReadWriter::MemoryPageReadWriter(GlobalConfiguration *_globConf, Statistics *stats)
+    : m_globConf(_globConf)
+    , m_stats(stats)
+{
+    if (!m_globConf) {
+	throw std::string("globConf can't be null");
+    }
+    m_globConf->initialize(
+	m_globConf->desiredPageCount(),
+	m_globConf->desiredPageSize(),
+	m_globConf->desiredRootNodePageNumber(),
+	m_globConf->desiredCacheSize(),
+	m_globConf->desiredEngineType(),
+	m_globConf->desiredFormatVersion(),
+	m_globConf->desiredJournalPath());
+
+    // Same layout as on disk: configuration page, root node page, index pages
+    m_bitset.initialize(
+	m_globConf,
+	{0, m_globConf->rootNodePageNumber()},
+	m_globConf->rootNodePageNumber() + 1
+    );
+    m_pages.assign(m_globConf->pageCount(), nullptr);
+}
+
+MemoryPageReadWriter::~MemoryPageReadWriter()
+{
+    close();
+}
+
+void MemoryPageReadWriter::freePage(size_t number)
+{
+    delete[] m_pages[number];
+    m_pages[number] = nullptr;
+}
+
+size_t MemoryPageReadWriter::allocatePageNumber()
+{
+    size_t res = m_bitset.freePageNumber();
+    m_bitset.set(res, 1);
+    return res;
+}
+
+void MemoryPageReadWriter::deallocatePageNumber(const size_t &number)
+{
+    m_bitset.set(number, 0);
+    freePage(number);
+}
+
+bool MemoryPageReadWriter::isPageAllocated(const size_t &number)
+{
+    return m_bitset.get(number);
+}
+
+void MemoryPageReadWriter::read(Page &p)
+{
+    if (p.number() >= m_pages.size()) {
+	throw std::string("Invalid page number read\n");
+    }
+    if (m_pages[p.number()]) {
+	memcpy(p.rawData(), m_pages[p.number()], m_globConf->pageSize());
+    } else {
+	memset(p.rawData(), 0, m_globConf->pageSize());
+    }
+    m_stats->pagesRead++;
+}
+
+void MemoryPageReadWriter::write(const Page &p)
+{
+    if (p.number() >= m_pages.size()) {
+	throw std::string("Invalid page number write\n");
+    }
+    if (!m_pages[p.number()]) {
+	m_pages[p.number()] = new char[m_globConf->pageSize()];
+    }
+    memcpy(m_pages[p.number()], p.rawData(), m_globConf->pageSize());
+    m_stats->pagesWritten++;
+}
+
+void MemoryPageReadWriter::flush()
+{
+}
+
+void MemoryPageReadWriter::shrink()
+{
+}
+
+void MemoryPageReadWriter::close()
+{
+    for (size_t i = 0; i < m_pages.size(); i++) {
+	freePage(i);
+    }
+}
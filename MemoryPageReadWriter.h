@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+
+#include "GlobalConfiguration.h"
+#include "PageReadWriter.h"
+#include "Bitset.h"
+#include "Statistics.h"
+
+/// Keeps pages in process memory, nothing survives close
+class MemoryPageReadWriter : public PageReadWriter
+{
+public:
+    MemoryPageReadWriter(GlobalConfiguration *globConf, Statistics *stats);
+    ~MemoryPageReadWriter();
+
+    // implemented virtual functions
+    virtual size_t allocatePageNumber();
+    virtual void deallocatePageNumber(const size_t &number);
+    virtual bool isPageAllocated(const size_t &number);
+    void read(Page &p);
+    void write(const Page &page);
+    void close();
+    void flush();
+    void shrink();
+
+private:
+    GlobalConfiguration *m_globConf;
+    Statistics *m_stats;
+    Bitset m_bitset;
+    /// Page contents, nullptr stands for never written page
+    std::vector<char *> m_pages;
+
+    void freePage(size_t number);
+};
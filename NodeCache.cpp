@@ -0,0 +1,106 @@
+#include "NodeCache.h"
+
+NodeCache::NodeCache(size_t leafCapacity, Statistics *stats, MemoryBudget *budget)
+    : m_leafCapacity(leafCapacity)
+    , m_stats(stats)
+    , m_budget(budget)
+{
+}
+
+std::shared_ptr<DatabaseNode> NodeCache::get(size_t pageNum)
+{
+    std::map<size_t, InternalEntry>::iterator internal = m_internalNodes.find(pageNum);
+    if (internal != m_internalNodes.end()) {
+	m_stats->nodeCacheHits++;
+	return internal->second.node;
+    }
+
+    std::map<size_t, LeafEntry>::iterator leaf = m_leaves.find(pageNum);
+    if (leaf != m_leaves.end()) {
+	m_stats->nodeCacheHits++;
+	m_leafLru.splice(m_leafLru.begin(), m_leafLru, leaf->second.lruPos);
+	return leaf->second.node;
+    }
+
+    m_stats->nodeCacheMisses++;
+    return std::shared_ptr<DatabaseNode>();
+}
+
+bool NodeCache::contains(size_t pageNum) const
+{
+    return m_internalNodes.count(pageNum) || m_leaves.count(pageNum);
+}
+
+void NodeCache::put(size_t pageNum, const std::shared_ptr<DatabaseNode> &node)
+{
+    invalidate(pageNum);
+    size_t bytes = node->memoryUsage();
+    while (m_budget->isOverLimit() && !m_leaves.empty()) {
+	evictLeaf();
+	m_stats->memorySheds++;
+    }
+    if (m_budget->isOverLimit()) {
+	return; // node is decoded again from cached page when needed
+    }
+
+    if (!node->isLeaf()) {
+	InternalEntry &entry = m_internalNodes[pageNum];
+	entry.node = node;
+	entry.bytes = bytes;
+	m_budget->charge(MemoryBudget::NODE_CACHE, bytes);
+	return;
+    }
+    if (!m_leafCapacity) {
+	return;
+    }
+
+    if (m_leaves.size() == m_leafCapacity) {
+	evictLeaf();
+    }
+    m_leafLru.push_front(pageNum);
+    LeafEntry &entry = m_leaves[pageNum];
+    entry.node = node;
+    entry.bytes = bytes;
+    entry.lruPos = m_leafLru.begin();
+    m_budget->charge(MemoryBudget::NODE_CACHE, bytes);
+}
+
+void NodeCache::invalidate(size_t pageNum)
+{
+    std::map<size_t, InternalEntry>::iterator internal = m_internalNodes.find(pageNum);
+    if (internal != m_internalNodes.end()) {
+	m_budget->release(MemoryBudget::NODE_CACHE, internal->second.bytes);
+	m_internalNodes.erase(internal);
+	return;
+    }
+    std::map<size_t, LeafEntry>::iterator leaf = m_leaves.find(pageNum);
+    if (leaf != m_leaves.end()) {
+	m_budget->release(MemoryBudget::NODE_CACHE, leaf->second.bytes);
+	m_leafLru.erase(leaf->second.lruPos);
+	m_leaves.erase(leaf);
+    }
+}
+
+void NodeCache::clear()
+{
+    m_budget->release(MemoryBudget::NODE_CACHE, m_budget->used(MemoryBudget::NODE_CACHE));
+    m_internalNodes.clear();
+    m_leaves.clear();
+    m_leafLru.clear();
+}
+
+void NodeCache::setLeafCapacity(size_t leafCapacity)
+{
+    m_leafCapacity = leafCapacity;
+    while (m_leaves.size() > m_leafCapacity) {
+	evictLeaf();
+    }
+}
+
+void NodeCache::evictLeaf()
+{
+    std::map<size_t, LeafEntry>::iterator leaf = m_leaves.find(m_leafLru.back());
+    m_budget->release(MemoryBudget::NODE_CACHE, leaf->second.bytes);
+    m_leaves.erase(leaf);
+    m_leafLru.pop_back();
+}
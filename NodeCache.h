@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+
+#include "DatabaseNode.h"
+#include "MemoryBudget.h"
+#include "Statistics.h"
+
+/// Decoded nodes of live tree by page number, so hot nodes aren't parsed
+/// from pages on every operation. Internal nodes stay resident, leaves are
+/// evicted in LRU order. Nodes in cache are never changed, writer drops them.
+/// Over memory budget leaves are evicted early and new nodes aren't kept
+class NodeCache
+{
+public:
+    NodeCache(size_t leafCapacity, Statistics *stats, MemoryBudget *budget);
+
+    /// Returns nullptr if node isn't cached
+    std::shared_ptr<DatabaseNode> get(size_t pageNum);
+    /// Doesn't count as cache access
+    bool contains(size_t pageNum) const;
+    void put(size_t pageNum, const std::shared_ptr<DatabaseNode> &node);
+    void invalidate(size_t pageNum);
+    void clear();
+    /// Evicts least recently used leaves above new capacity
+    void setLeafCapacity(size_t leafCapacity);
+
+private:
+    typedef std::list<size_t> LruList;
+
+    struct InternalEntry
+    {
+	std::shared_ptr<DatabaseNode> node;
+	/// Charged to memory budget
+	size_t bytes;
+    };
+
+    struct LeafEntry
+    {
+	std::shared_ptr<DatabaseNode> node;
+	size_t bytes;
+	LruList::iterator lruPos;
+    };
+
+    size_t m_leafCapacity;
+    Statistics *m_stats;
+    MemoryBudget *m_budget;
+    std::map<size_t, InternalEntry> m_internalNodes;
+    std::map<size_t, LeafEntry> m_leaves;
+    /// Most recently used leaf first
+    LruList m_leafLru;
+
+    void evictLeaf();
+
+    NodeCache(const NodeCache &);
+    void operator=(const NodeCache &);
+};
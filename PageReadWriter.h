@@ -1,14 +1,19 @@
 #pragma once
 
+#include <vector>
+
 #include "Page.h"
 
 class PageReadWriter
 {
 public:
+    virtual ~PageReadWriter() {}
     /// Returns free page number
     virtual size_t allocatePageNumber() = 0;
     /// Deallocates page number
     virtual void deallocatePageNumber(const size_t &number) = 0;
+    /// Checks whether page number is allocated
+    virtual bool isPageAllocated(const size_t &number) = 0;
     /// Reads page to memory
     virtual void read(Page &page) = 0;
     /// Writes page to storage
@@ -17,4 +22,14 @@ public:
     virtual void close() = 0;
     /// Flushes changes
     virtual void flush() = 0;
+    /// Flushes changes and waits until storage has them
+    virtual void sync() { flush(); }
+    /// Flushes changes and releases storage after the last allocated page
+    virtual void shrink() = 0;
+    /// Hints that pages will be read soon, numbers are sorted
+    virtual void willNeed(const std::vector<size_t> &/*pages*/) {}
+    /// Read-only storage refuses writes and allocations
+    virtual bool isReadOnly() const { return false; }
+    /// Reads are copies from mapped memory, so caching them saves nothing
+    virtual bool isMapped() const { return false; }
 };
@@ -0,0 +1,47 @@
+#include "SnapshotPageReadWriter.h"
+
+#include <string>
+
+SnapshotPageReadWriter::SnapshotPageReadWriter(CachedPageReadWriter &source, size_t snapshot)
+    : m_source(source)
+    , m_snapshot(snapshot)
+{
+}
+
+size_t SnapshotPageReadWriter::allocatePageNumber()
+{
+    throw std::string("Snapshot is read-only");
+}
+
+void SnapshotPageReadWriter::deallocatePageNumber(const size_t &)
+{
+    throw std::string("Snapshot is read-only");
+}
+
+bool SnapshotPageReadWriter::isPageAllocated(const size_t &number)
+{
+    return m_source.isPageAllocated(number);
+}
+
+void SnapshotPageReadWriter::read(Page &p)
+{
+    m_source.readAtSnapshot(m_snapshot, p);
+}
+
+void SnapshotPageReadWriter::write(const Page &)
+{
+    throw std::string("Snapshot is read-only");
+}
+
+void SnapshotPageReadWriter::close()
+{
+}
+
+void SnapshotPageReadWriter::flush()
+{
+}
+
+void SnapshotPageReadWriter::shrink()
+{
+    throw std::string("Snapshot is read-only");
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "CachedPageReadWriter.h"
+#include "PageReadWriter.h"
+
+/// Read-only view of pages as they were at snapshot creation
+class SnapshotPageReadWriter : public PageReadWriter
+{
+public:
+    SnapshotPageReadWriter(CachedPageReadWriter &source, size_t snapshot);
+
+    // implemented virtual functions
+    virtual size_t allocatePageNumber();
+    virtual void deallocatePageNumber(const size_t &number);
+    virtual bool isPageAllocated(const size_t &number);
+    void read(Page &p);
+    void write(const Page &page);
+    void close();
+    void flush();
+    void shrink();
+
+private:
+    CachedPageReadWriter &m_source;
+    size_t m_snapshot;
+};
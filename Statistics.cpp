@@ -0,0 +1,188 @@
+#include "Statistics.h"
+
+#include <cstring>
+#include <sstream>
+
+#include <time.h>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    memset(m_counts, 0, sizeof(m_counts));
+    m_count = 0;
+    m_sum = 0;
+    m_max = 0;
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKET_COUNT) {
+	return value;
+    }
+    size_t exponent = 63 - __builtin_clzll(value);
+    size_t mantissa = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + mantissa;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+	return index;
+    }
+    size_t exponent = index / SUB_BUCKET_COUNT + SUB_BUCKET_BITS - 1;
+    uint64_t mantissa = index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT;
+    uint64_t step = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return mantissa * step + step - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    m_counts[bucketIndex(nanoseconds)]++;
+    m_count++;
+    m_sum += nanoseconds;
+    if (nanoseconds > m_max) {
+	m_max = nanoseconds;
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+	m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_max > m_max) {
+	m_max = other.m_max;
+    }
+}
+
+size_t LatencyHistogram::count() const
+{
+    return m_count;
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+    return m_count ? m_sum / m_count : 0;
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return m_max;
+}
+
+uint64_t LatencyHistogram::percentile(double quantile) const
+{
+    if (!m_count) {
+	return 0;
+    }
+    size_t rank = static_cast<size_t>(quantile * m_count);
+    if (rank >= m_count) {
+	rank = m_count - 1;
+    }
+
+    size_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+	seen += m_counts[i];
+	if (seen > rank) {
+	    uint64_t bound = bucketUpperBound(i);
+	    return bound < m_max ? bound : m_max;
+	}
+    }
+    return m_max;
+}
+
+Statistics::Statistics()
+{
+    reset();
+}
+
+void Statistics::reset()
+{
+    insertLatency.reset();
+    selectLatency.reset();
+    deleteLatency.reset();
+
+    cacheHits = 0;
+    cacheMisses = 0;
+    cacheEvictions = 0;
+    cacheDirtyEvictions = 0;
+
+    pagesRead = 0;
+    pagesWritten = 0;
+
+    journalBytes = 0;
+    journalRecords = 0;
+
+    splits = 0;
+    merges = 0;
+    bufferFlushes = 0;
+    snapshotPageCopies = 0;
+    nodeCacheHits = 0;
+    nodeCacheMisses = 0;
+    nodeWritesAvoided = 0;
+    appendFastPathInserts = 0;
+    warmUpPages = 0;
+    memorySheds = 0;
+}
+
+static void dumpLatency(std::ostringstream &out, const char *name, const LatencyHistogram &histogram)
+{
+    out << name << "_count " << histogram.count() << "\n";
+    out << name << "_mean_ns " << histogram.mean() << "\n";
+    out << name << "_p50_ns " << histogram.percentile(0.5) << "\n";
+    out << name << "_p99_ns " << histogram.percentile(0.99) << "\n";
+    out << name << "_p999_ns " << histogram.percentile(0.999) << "\n";
+    out << name << "_max_ns " << histogram.max() << "\n";
+}
+
+std::string Statistics::dump() const
+{
+    std::ostringstream out;
+    dumpLatency(out, "insert", insertLatency);
+    dumpLatency(out, "select", selectLatency);
+    dumpLatency(out, "delete", deleteLatency);
+
+    out << "cache_hits " << cacheHits << "\n";
+    out << "cache_misses " << cacheMisses << "\n";
+    out << "cache_evictions " << cacheEvictions << "\n";
+    out << "cache_dirty_evictions " << cacheDirtyEvictions << "\n";
+    out << "pages_read " << pagesRead << "\n";
+    out << "pages_written " << pagesWritten << "\n";
+    out << "journal_bytes " << journalBytes << "\n";
+    out << "journal_records " << journalRecords << "\n";
+    out << "splits " << splits << "\n";
+    out << "merges " << merges << "\n";
+    out << "buffer_flushes " << bufferFlushes << "\n";
+    out << "snapshot_page_copies " << snapshotPageCopies << "\n";
+    out << "node_cache_hits " << nodeCacheHits << "\n";
+    out << "node_cache_misses " << nodeCacheMisses << "\n";
+    out << "node_writes_avoided " << nodeWritesAvoided << "\n";
+    out << "append_fast_path_inserts " << appendFastPathInserts << "\n";
+    out << "warm_up_pages " << warmUpPages << "\n";
+    out << "memory_sheds " << memorySheds << "\n";
+    return out.str();
+}
+
+ScopedLatency::ScopedLatency(LatencyHistogram &histogram)
+    : m_histogram(histogram)
+    , m_start(now())
+{
+}
+
+ScopedLatency::~ScopedLatency()
+{
+    m_histogram.record(now() - m_start);
+}
+
+uint64_t ScopedLatency::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
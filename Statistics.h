@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(uint64_t nanoseconds);
+    void merge(const LatencyHistogram &other);
+    void reset();
+
+    size_t count() const;
+    uint64_t mean() const;
+    uint64_t max() const;
+    /// Returns upper bound of the bucket holding given quantile (0..1)
+    uint64_t percentile(double quantile) const;
+
+private:
+    // Log-linear buckets as in HDR histogram: 16 linear sub-buckets
+    // per power of two, so relative error is below 1/16
+    static const size_t SUB_BUCKET_BITS = 4;
+    static const size_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    size_t m_counts[BUCKET_COUNT];
+    size_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+
+    static size_t bucketIndex(uint64_t value);
+    static uint64_t bucketUpperBound(size_t index);
+};
+
+struct Statistics
+{
+    Statistics();
+
+    void reset();
+    /// Text dump, one "name value" pair per line
+    std::string dump() const;
+
+    LatencyHistogram insertLatency;
+    LatencyHistogram selectLatency;
+    LatencyHistogram deleteLatency;
+
+    size_t cacheHits;
+    size_t cacheMisses;
+    size_t cacheEvictions;
+    size_t cacheDirtyEvictions;
+
+    size_t pagesRead;
+    size_t pagesWritten;
+
+    size_t journalBytes;
+    size_t journalRecords;
+
+    size_t splits;
+    size_t merges;
+    /// Message batches moved down in buffered B-tree
+    size_t bufferFlushes;
+    /// Page pre-images saved for open snapshots
+    size_t snapshotPageCopies;
+    /// Lookups of decoded B-tree nodes
+    size_t nodeCacheHits;
+    size_t nodeCacheMisses;
+    /// Writes of unchanged B-tree nodes which were skipped
+    size_t nodeWritesAvoided;
+    /// Inserts put to rightmost leaf without descent from root
+    size_t appendFastPathInserts;
+    /// Pages loaded to page cache from warm file on open
+    size_t warmUpPages;
+    /// Cached pages, decoded nodes and memtables given back to get under memory budget
+    size_t memorySheds;
+};
+
+/// Records time between construction and destruction into histogram
+class ScopedLatency
+{
+public:
+    ScopedLatency(LatencyHistogram &histogram);
+    ~ScopedLatency();
+
+private:
+    LatencyHistogram &m_histogram;
+    uint64_t m_start;
+
+    static uint64_t now();
+};
@@ -0,0 +1,590 @@
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mydb.h"
+#include "Statistics.h"
+
+/*
+ * Self-contained YCSB-like workload driver.
+ *
+ * Loads `records` keys, then runs `operations` requests of a YCSB core
+ * workload from `threads` client threads and reports throughput and
+ * latency percentiles per operation type.
+ */
+
+struct BenchConfig
+{
+    std::string dbPath;
+    char workload;
+    std::string distribution;
+    size_t records;
+    size_t operations;
+    size_t keySize;
+    size_t valueSize;
+    size_t threads;
+    size_t maxScanLength;
+    size_t dbSize;
+    size_t pageSize;
+    size_t cacheSize;
+    size_t memoryBudget;
+    unsigned seed;
+    bool inMemory;
+    bool copyOnWrite;
+    bool fixedKeys;
+    bool compactFormat;
+    int engine;
+    bool printStats;
+};
+
+struct Mix
+{
+    double read;
+    double update;
+    double insert;
+    double scan;
+    double readModifyWrite;
+    const char *distribution;
+};
+
+enum OpKind {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_RMW,
+    OP_KINDS
+};
+
+static const char *OP_NAMES[OP_KINDS] = {"read", "update", "insert", "scan", "rmw"};
+
+static Mix workloadMix(char workload)
+{
+    switch (workload) {
+    case 'A': return {0.50, 0.50, 0.00, 0.00, 0.00, "zipfian"};
+    case 'B': return {0.95, 0.05, 0.00, 0.00, 0.00, "zipfian"};
+    case 'C': return {1.00, 0.00, 0.00, 0.00, 0.00, "zipfian"};
+    case 'D': return {0.95, 0.00, 0.05, 0.00, 0.00, "latest"};
+    case 'E': return {0.00, 0.00, 0.05, 0.95, 0.00, "zipfian"};
+    case 'F': return {0.50, 0.00, 0.00, 0.00, 0.50, "zipfian"};
+    }
+    fprintf(stderr, "Unknown workload %c, expected A-F\n", workload);
+    exit(1);
+}
+
+/// Zipfian generator over [0, n) as in YCSB, theta = 0.99
+class ZipfianGenerator
+{
+public:
+    ZipfianGenerator(size_t n, double theta = 0.99)
+	: m_n(n)
+	, m_theta(theta)
+    {
+	m_zetan = zeta(n, theta);
+	m_alpha = 1.0 / (1.0 - theta);
+	m_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / m_zetan);
+    }
+
+    size_t next(double u) const
+    {
+	double uz = u * m_zetan;
+	if (uz < 1.0) {
+	    return 0;
+	}
+	if (uz < 1.0 + pow(0.5, m_theta)) {
+	    return 1;
+	}
+	size_t res = static_cast<size_t>(m_n * pow(m_eta * u - m_eta + 1, m_alpha));
+	return res < m_n ? res : m_n - 1;
+    }
+
+private:
+    size_t m_n;
+    double m_theta;
+    double m_zetan;
+    double m_alpha;
+    double m_eta;
+
+    static double zeta(size_t n, double theta)
+    {
+	double sum = 0;
+	for (size_t i = 1; i <= n; i++) {
+	    sum += 1.0 / pow(i, theta);
+	}
+	return sum;
+    }
+};
+
+static uint64_t fnvHash(uint64_t value)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; i++) {
+	hash ^= value & 0xFF;
+	hash *= 0x100000001B3ULL;
+	value >>= 8;
+    }
+    return hash;
+}
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+class Workload
+{
+public:
+    Workload(const BenchConfig &conf)
+	: m_conf(conf)
+	, m_mix(workloadMix(conf.workload))
+	, m_distribution(conf.distribution.empty() ? m_mix.distribution : conf.distribution)
+	, m_zipfian(conf.records)
+	, m_insertCounter(conf.records)
+	, m_sequentialCounter(0)
+    {
+	if (m_distribution != "uniform" && m_distribution != "zipfian"
+		&& m_distribution != "latest" && m_distribution != "sequential") {
+	    fprintf(stderr, "Unknown distribution %s\n", m_distribution.c_str());
+	    exit(1);
+	}
+    }
+
+    /// Sequential keys are stored in order, others are hashed like YCSB does
+    std::string key(uint64_t index) const
+    {
+	char buf[32];
+	uint64_t id = m_distribution == "sequential" ? index : fnvHash(index);
+	snprintf(buf, sizeof(buf), "%020llu", static_cast<unsigned long long>(id));
+
+	std::string res = "user";
+	res += buf;
+	if (res.size() > m_conf.keySize) {
+	    res.erase(0, res.size() - m_conf.keySize);
+	} else {
+	    res.append(m_conf.keySize - res.size(), '0');
+	}
+	return res;
+    }
+
+    void value(std::mt19937_64 &rng, std::string &out) const
+    {
+	out.resize(m_conf.valueSize);
+	for (size_t i = 0; i < out.size(); i++) {
+	    out[i] = 'a' + rng() % 26;
+	}
+    }
+
+    OpKind nextOp(std::mt19937_64 &rng) const
+    {
+	double u = std::uniform_real_distribution<double>(0, 1)(rng);
+	if ((u -= m_mix.read) < 0) {
+	    return OP_READ;
+	}
+	if ((u -= m_mix.update) < 0) {
+	    return OP_UPDATE;
+	}
+	if ((u -= m_mix.insert) < 0) {
+	    return OP_INSERT;
+	}
+	if ((u -= m_mix.scan) < 0) {
+	    return OP_SCAN;
+	}
+	return OP_RMW;
+    }
+
+    uint64_t nextExistingIndex(std::mt19937_64 &rng)
+    {
+	uint64_t count = m_insertCounter.load();
+	double u = std::uniform_real_distribution<double>(0, 1)(rng);
+	if (m_distribution == "uniform") {
+	    return static_cast<uint64_t>(u * count) % count;
+	} else if (m_distribution == "zipfian") {
+	    // scrambled so that popular items are spread over key space
+	    return fnvHash(m_zipfian.next(u)) % count;
+	} else if (m_distribution == "latest") {
+	    return count - 1 - m_zipfian.next(u) % count;
+	} else {
+	    return m_sequentialCounter++ % count;
+	}
+    }
+
+    uint64_t nextInsertIndex()
+    {
+	return m_insertCounter++;
+    }
+
+    const Mix &mix() const
+    {
+	return m_mix;
+    }
+
+    const std::string &distribution() const
+    {
+	return m_distribution;
+    }
+
+private:
+    const BenchConfig &m_conf;
+    Mix m_mix;
+    std::string m_distribution;
+    ZipfianGenerator m_zipfian;
+    std::atomic<uint64_t> m_insertCounter;
+    std::atomic<uint64_t> m_sequentialCounter;
+};
+
+struct ThreadResult
+{
+    LatencyHistogram latency[OP_KINDS];
+    size_t failures;
+};
+
+static std::mutex dbMutex; // library calls are not thread-safe
+
+static int lockedInsert(DB *db, const std::string &key, std::string &value)
+{
+    std::lock_guard<std::mutex> lock(dbMutex);
+    return db_insert(db, const_cast<char *>(key.data()), key.size(), &value[0], value.size());
+}
+
+static int lockedSelect(DB *db, const std::string &key)
+{
+    void *val = 0;
+    size_t valLen = 0;
+    int res;
+    {
+	std::lock_guard<std::mutex> lock(dbMutex);
+	res = db_select(db, const_cast<char *>(key.data()), key.size(), &val, &valLen);
+    }
+    delete[] static_cast<char *>(val);
+    return res;
+}
+
+static int countScanned(void *arg, const void *, size_t, const void *, size_t)
+{
+    size_t *left = static_cast<size_t *>(arg);
+    return --*left == 0;
+}
+
+static int lockedScan(DB *db, const std::string &from, size_t length)
+{
+    std::lock_guard<std::mutex> lock(dbMutex);
+    return db_scan(db, const_cast<char *>(from.data()), from.size(), 0, 0, countScanned, &length);
+}
+
+static void runClient(DB *db, Workload *workload, const BenchConfig *conf, size_t opCount, unsigned seed, ThreadResult *result)
+{
+    std::mt19937_64 rng(seed);
+    std::string key;
+    std::string value;
+    std::vector<std::string> scanKeys;
+    bool rangeScan = conf->engine == DB_ENGINE_BTREE || conf->engine == DB_ENGINE_BTREE_BUFFERED;
+    result->failures = 0;
+
+    for (size_t n = 0; n < opCount; n++) {
+	OpKind op = workload->nextOp(rng);
+	size_t length = 0;
+	int rc = 0;
+
+	// Keys and values are made before start, only library calls are timed
+	switch (op) {
+	case OP_READ:
+	    key = workload->key(workload->nextExistingIndex(rng));
+	    break;
+	case OP_UPDATE:
+	    workload->value(rng, value);
+	    key = workload->key(workload->nextExistingIndex(rng));
+	    break;
+	case OP_INSERT:
+	    workload->value(rng, value);
+	    key = workload->key(workload->nextInsertIndex());
+	    break;
+	case OP_SCAN: {
+	    uint64_t first = workload->nextExistingIndex(rng);
+	    length = 1 + rng() % conf->maxScanLength;
+	    scanKeys.clear();
+	    // Engines without range API emulate scan by reads of consecutive key ids
+	    for (size_t i = 0; i < (rangeScan ? 1 : length); i++) {
+		scanKeys.push_back(workload->key(first + i));
+	    }
+	    break;
+	}
+	case OP_RMW:
+	    key = workload->key(workload->nextExistingIndex(rng));
+	    workload->value(rng, value);
+	    break;
+	default:
+	    break;
+	}
+
+	uint64_t start = nowNs();
+
+	switch (op) {
+	case OP_READ:
+	    rc = lockedSelect(db, key);
+	    break;
+	case OP_UPDATE:
+	case OP_INSERT:
+	    rc = lockedInsert(db, key, value);
+	    break;
+	case OP_SCAN:
+	    if (rangeScan) {
+		rc = lockedScan(db, scanKeys[0], length);
+		break;
+	    }
+	    for (size_t i = 0; i < scanKeys.size() && !rc; i++) {
+		rc = lockedSelect(db, scanKeys[i]);
+	    }
+	    break;
+	case OP_RMW:
+	    rc = lockedSelect(db, key);
+	    rc |= lockedInsert(db, key, value);
+	    break;
+	default:
+	    break;
+	}
+
+	result->latency[op].record(nowNs() - start);
+	if (rc) {
+	    result->failures++;
+	}
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+	"Usage: %s [options]\n"
+	"  --db=PATH            database file (default ./bench.db, recreated)\n"
+	"  --workload=A..F      YCSB core workload (default A)\n"
+	"  --distribution=D     uniform|zipfian|latest|sequential (default per workload)\n"
+	"  --records=N          keys loaded before run (default 10000)\n"
+	"  --operations=N       requests in run phase (default 100000)\n"
+	"  --key-size=N         key length in bytes (default 24)\n"
+	"  --value-size=N       value length in bytes (default 100)\n"
+	"  --threads=N          client threads (default 1)\n"
+	"  --scan-length=N      max records per scan (default 100)\n"
+	"  --db-size=N          database size (default 512MB)\n"
+	"  --page-size=N        page size (default 4KB)\n"
+	"  --cache-size=N       cache size (default 16MB)\n"
+	"  --memory-budget=N    memory limit of database, 0 for none (default 0)\n"
+	"  --seed=N             random seed (default 42)\n"
+	"  --in-memory          non-durable in-memory database\n"
+	"  --copy-on-write      shadow paging instead of journal\n"
+	"  --fixed-keys         declare key size to B-tree engines\n"
+	"  --compact            compact node format for B-tree engines\n"
+	"  --engine=E           btree|buffered|hash|lsm (default btree)\n"
+	"  --stats              print engine statistics after run\n",
+	name);
+    exit(1);
+}
+
+static bool parseOption(const char *arg, const char *name, std::string &value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) || arg[len] != '=') {
+	return false;
+    }
+    value = arg + len + 1;
+    return true;
+}
+
+/// Removes database file with journal, warm file and LSM runs of earlier runs
+static void removeDatabase(const std::string &dbPath)
+{
+    unlink(dbPath.c_str());
+    unlink((dbPath + ".journal").c_str());
+    unlink((dbPath + ".journal.tmp").c_str());
+    unlink((dbPath + ".warm").c_str());
+
+    size_t slash = dbPath.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : dbPath.substr(0, slash + 1);
+    std::string prefix = (slash == std::string::npos ? dbPath : dbPath.substr(slash + 1)) + ".";
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+	return;
+    }
+    while (dirent *entry = readdir(d)) {
+	std::string name = entry->d_name;
+	// Run files are <db>.<id>.run
+	if (name.size() > prefix.size() + 4 && !name.compare(0, prefix.size(), prefix)
+		&& !name.compare(name.size() - 4, 4, ".run")
+		&& name.find_first_not_of("0123456789", prefix.size()) == name.size() - 4) {
+	    unlink((slash == std::string::npos ? name : dir + name).c_str());
+	}
+    }
+    closedir(d);
+}
+
+static void printLatency(const char *name, const LatencyHistogram &h)
+{
+    printf("%-8s %10zu ops  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us\n",
+	name, h.count(), h.mean() / 1e3, h.percentile(0.5) / 1e3,
+	h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig conf;
+    conf.dbPath = "./bench.db";
+    conf.workload = 'A';
+    conf.records = 10000;
+    conf.operations = 100000;
+    conf.keySize = 24;
+    conf.valueSize = 100;
+    conf.threads = 1;
+    conf.maxScanLength = 100;
+    conf.dbSize = 512 << 20;
+    conf.pageSize = 4 << 10;
+    conf.cacheSize = 16 << 20;
+    conf.memoryBudget = 0;
+    conf.seed = 42;
+    conf.inMemory = false;
+    conf.copyOnWrite = false;
+    conf.fixedKeys = false;
+    conf.compactFormat = false;
+    conf.engine = DB_ENGINE_BTREE;
+    conf.printStats = false;
+
+    for (int i = 1; i < argc; i++) {
+	std::string v;
+	if (parseOption(argv[i], "--db", v)) {
+	    conf.dbPath = v;
+	} else if (parseOption(argv[i], "--workload", v) && v.size() == 1) {
+	    conf.workload = toupper(v[0]);
+	} else if (parseOption(argv[i], "--distribution", v)) {
+	    conf.distribution = v;
+	} else if (parseOption(argv[i], "--records", v)) {
+	    conf.records = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--operations", v)) {
+	    conf.operations = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--key-size", v)) {
+	    conf.keySize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--value-size", v)) {
+	    conf.valueSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--threads", v)) {
+	    conf.threads = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--scan-length", v)) {
+	    conf.maxScanLength = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--db-size", v)) {
+	    conf.dbSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--page-size", v)) {
+	    conf.pageSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--cache-size", v)) {
+	    conf.cacheSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--memory-budget", v)) {
+	    conf.memoryBudget = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--seed", v)) {
+	    conf.seed = strtoul(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--engine", v)
+		&& (v == "btree" || v == "hash" || v == "lsm" || v == "buffered")) {
+	    conf.engine = v == "hash" ? DB_ENGINE_HASH : v == "lsm" ? DB_ENGINE_LSM
+		: v == "buffered" ? DB_ENGINE_BTREE_BUFFERED : DB_ENGINE_BTREE;
+	} else if (!strcmp(argv[i], "--in-memory")) {
+	    conf.inMemory = true;
+	} else if (!strcmp(argv[i], "--copy-on-write")) {
+	    conf.copyOnWrite = true;
+	} else if (!strcmp(argv[i], "--fixed-keys")) {
+	    conf.fixedKeys = true;
+	} else if (!strcmp(argv[i], "--compact")) {
+	    conf.compactFormat = true;
+	} else if (!strcmp(argv[i], "--stats")) {
+	    conf.printStats = true;
+	} else {
+	    usage(argv[0]);
+	}
+    }
+    if (!conf.records || !conf.threads || !conf.keySize || !conf.valueSize || !conf.maxScanLength) {
+	usage(argv[0]);
+    }
+
+    removeDatabase(conf.dbPath);
+
+    DBC dbConf;
+    db_config_init(&dbConf);
+    dbConf.db_size = conf.dbSize;
+    dbConf.page_size = conf.pageSize;
+    dbConf.cache_size = conf.cacheSize;
+    dbConf.memory_budget = conf.memoryBudget;
+    dbConf.in_memory = conf.inMemory;
+    dbConf.copy_on_write = conf.copyOnWrite;
+    dbConf.fixed_key_size = conf.fixedKeys ? conf.keySize : 0;
+    dbConf.compact_format = conf.compactFormat;
+    dbConf.engine = conf.engine;
+    DB *db = dbcreate(const_cast<char *>(conf.dbPath.c_str()), &dbConf);
+    if (!db) {
+	fprintf(stderr, "Can't open database %s\n", conf.dbPath.c_str());
+	return 1;
+    }
+
+    Workload workload(conf);
+    std::mt19937_64 rng(conf.seed);
+    std::string value;
+
+    uint64_t loadStart = nowNs();
+    for (size_t i = 0; i < conf.records; i++) {
+	workload.value(rng, value);
+	if (lockedInsert(db, workload.key(i), value)) {
+	    fprintf(stderr, "Load failed at record %zu\n", i);
+	    return 1;
+	}
+    }
+    double loadSeconds = (nowNs() - loadStart) / 1e9;
+    printf("workload %c, distribution %s, %zu threads, key %zu B, value %zu B\n",
+	conf.workload, workload.distribution().c_str(), conf.threads, conf.keySize, conf.valueSize);
+    printf("load: %zu records in %.3f s, %.0f ops/s\n", conf.records, loadSeconds, conf.records / loadSeconds);
+
+    std::vector<ThreadResult> results(conf.threads);
+    std::vector<std::thread> clients;
+    uint64_t runStart = nowNs();
+    for (size_t t = 0; t < conf.threads; t++) {
+	size_t opCount = conf.operations / conf.threads + (t < conf.operations % conf.threads);
+	clients.push_back(std::thread(runClient, db, &workload, &conf, opCount, conf.seed + 1 + t, &results[t]));
+    }
+    for (std::thread &t : clients) {
+	t.join();
+    }
+    double runSeconds = (nowNs() - runStart) / 1e9;
+
+    LatencyHistogram total;
+    size_t failures = 0;
+    printf("run: %zu operations in %.3f s, %.0f ops/s\n", conf.operations, runSeconds, conf.operations / runSeconds);
+    for (int op = 0; op < OP_KINDS; op++) {
+	LatencyHistogram merged;
+	for (ThreadResult &r : results) {
+	    merged.merge(r.latency[op]);
+	}
+	if (merged.count()) {
+	    printLatency(OP_NAMES[op], merged);
+	}
+	total.merge(merged);
+    }
+    for (ThreadResult &r : results) {
+	failures += r.failures;
+    }
+    printLatency("overall", total);
+    if (failures) {
+	printf("failures: %zu\n", failures);
+    }
+
+    if (conf.printStats) {
+	char buf[4096];
+	db_stats_dump(db, buf, sizeof(buf));
+	printf("%s", buf);
+    }
+
+    db_close(db);
+    return failures != 0;
+}
@@ -0,0 +1,399 @@
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Bitset.h"
+#include "CachedPageReadWriter.h"
+#include "Database.h"
+#include "DatabaseNode.h"
+#include "DiskPageReadWriter.h"
+#include "GlobalConfiguration.h"
+#include "Statistics.h"
+
+/*
+ * Micro-benchmarks of single storage layers.
+ *
+ * Every benchmark runs a fixed number of iterations several times and
+ * reports nanoseconds per operation of each repetition as JSON, so two
+ * runs can be diffed by a script.
+ */
+
+static const size_t PAGE_SIZE = 4096;
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Single in-memory page, enough to encode and decode one node
+class SinglePageReadWriter : public PageReadWriter
+{
+public:
+    SinglePageReadWriter()
+	: m_page(0, PAGE_SIZE)
+    {
+    }
+
+    virtual size_t allocatePageNumber() { return 0; }
+    virtual void deallocatePageNumber(const size_t &) { }
+    virtual bool isPageAllocated(const size_t &number) { return number == 0; }
+    virtual void read(Page &page) { memcpy(page.rawData(), m_page.rawData(), PAGE_SIZE); }
+    virtual void write(const Page &page) { memcpy(m_page.rawData(), page.rawData(), PAGE_SIZE); }
+    virtual void close() { }
+    virtual void flush() { }
+    virtual void shrink() { }
+
+private:
+    Page m_page;
+};
+
+class MicroBenchmark
+{
+public:
+    MicroBenchmark(size_t repetitions, const std::string &filter)
+	: m_repetitions(repetitions)
+	, m_filter(filter)
+	, m_first(true)
+    {
+	char dirTemplate[] = "/tmp/mydb_micro_XXXXXX";
+	if (!mkdtemp(dirTemplate)) {
+	    throw std::string("Can't create temporary directory");
+	}
+	m_dir = dirTemplate;
+    }
+
+    ~MicroBenchmark()
+    {
+	std::string cmd = "rm -rf " + m_dir;
+	if (system(cmd.c_str())) {
+	    fprintf(stderr, "Can't remove %s\n", m_dir.c_str());
+	}
+    }
+
+    std::string path(const std::string &name) const
+    {
+	return m_dir + "/" + name;
+    }
+
+    /// body performs given number of iterations and returns measured nanoseconds
+    void run(const std::string &name, const std::string &params, size_t iterations,
+	const std::function<uint64_t(size_t)> &body)
+    {
+	if (!m_filter.empty() && name.find(m_filter) == std::string::npos) {
+	    return;
+	}
+
+	body(std::max<size_t>(iterations / 10, 1)); // warm up
+	std::vector<double> samples;
+	for (size_t r = 0; r < m_repetitions; r++) {
+	    samples.push_back(static_cast<double>(body(iterations)) / iterations);
+	}
+	std::vector<double> sorted(samples);
+	std::sort(sorted.begin(), sorted.end());
+
+	printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"iterations\": %zu, "
+	    "\"ns_per_op_min\": %.2f, \"ns_per_op_median\": %.2f, \"samples\": [",
+	    m_first ? "" : ",", name.c_str(), params.c_str(), iterations,
+	    sorted.front(), sorted[sorted.size() / 2]);
+	for (size_t i = 0; i < samples.size(); i++) {
+	    printf("%s%.2f", i ? ", " : "", samples[i]);
+	}
+	printf("]}");
+	fflush(stdout);
+	m_first = false;
+    }
+
+private:
+    size_t m_repetitions;
+    std::string m_filter;
+    std::string m_dir;
+    bool m_first;
+};
+
+/// Friend of Database, reaches split and merge directly
+class DatabaseBenchmark
+{
+public:
+    static void run(MicroBenchmark &bench, size_t keySize)
+    {
+	std::string file = bench.path("split_merge.db");
+	unlink(file.c_str());
+	unlink((file + ".journal").c_str());
+	Database::Configuration conf;
+	conf.size = 64 << 20;
+	conf.pageSize = PAGE_SIZE;
+	conf.cacheSize = 4 << 20;
+	conf.inMemory = false;
+	conf.engine = Database::BTREE;
+	conf.copyOnWrite = false;
+	conf.warmUp = Database::WARM_UP_NONE;
+	conf.readOnly = Database::READ_WRITE;
+	conf.fixedKeySize = 0;
+	conf.compactFormat = false;
+	conf.memoryBudget = 0;
+	Database db(file.c_str(), conf);
+
+	DatabaseNode *x = db.createNode();
+	x->setIsLeaf(false);
+	x->linkedNodesRootPageNumbers().push_back(0);
+	DatabaseNode *y = db.createNode();
+	x->linkedNodesRootPageNumbers()[0] = y->rootPage();
+
+	std::string value(32, 'v');
+	DatabaseNode::Record valueRec(value.size(), &value[0]);
+	for (size_t i = 0; y->spaceOnDisk() + y->additionalSpaceFor(DatabaseNode::Record(keySize), valueRec) <= db.effectivePageSize(); i++) {
+	    std::string key = std::to_string(i);
+	    key.insert(0, keySize - key.size(), '0');
+	    y->keys().push_back(DatabaseNode::Record::rawCopyFrom(DatabaseNode::Record(keySize, &key[0])));
+	    y->data().push_back(DatabaseNode::Record::rawCopyFrom(valueRec));
+	    y->setKeyCount(y->keyCount() + 1);
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"key_size\": %zu, \"keys\": %zu", keySize, y->keyCount());
+
+	// Split and merge undo each other, so the same node pair is reused
+	bench.run("database.splitChild", params, 2000, [&](size_t iterations) {
+	    uint64_t total = 0;
+	    for (size_t i = 0; i < iterations; i++) {
+		uint64_t start = nowNs();
+		db.splitChild(x, 0, y);
+		total += nowNs() - start;
+
+		DatabaseNode *z = db.loadNode(x->linkedNodesRootPageNumbers()[1]);
+		db.merge(y, x, 0, z);
+		delete z;
+	    }
+	    return total;
+	});
+	bench.run("database.merge", params, 2000, [&](size_t iterations) {
+	    uint64_t total = 0;
+	    for (size_t i = 0; i < iterations; i++) {
+		db.splitChild(x, 0, y);
+
+		DatabaseNode *z = db.loadNode(x->linkedNodesRootPageNumbers()[1]);
+		uint64_t start = nowNs();
+		db.merge(y, x, 0, z);
+		total += nowNs() - start;
+		delete z;
+	    }
+	    return total;
+	});
+
+	delete y;
+	delete x;
+    }
+};
+
+static volatile size_t sink; // keeps results of pure calls alive
+
+static void benchBitset(MicroBenchmark &bench)
+{
+    const size_t pageCount = 1 << 17; // 512MB of 4KB pages
+    GlobalConfiguration globConf(pageCount, PAGE_SIZE, 1, PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, "");
+    globConf.initialize(pageCount, PAGE_SIZE, 1, PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, "");
+
+    const double fills[] = {0.0, 0.5, 0.99};
+    for (double fill : fills) {
+	Bitset bitset;
+	bitset.initialize(&globConf, {0, 1}, 2);
+	for (size_t i = 0; i < pageCount * fill; i++) {
+	    bitset.set(i, true);
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"pages\": %zu, \"fill\": %.2f", pageCount, fill);
+	bench.run("bitset.freePageNumber", params, 200, [&](size_t iterations) {
+	    uint64_t start = nowNs();
+	    for (size_t i = 0; i < iterations; i++) {
+		sink = bitset.freePageNumber();
+	    }
+	    return nowNs() - start;
+	});
+    }
+
+    Bitset bitset;
+    bitset.initialize(&globConf, {0, 1}, 2);
+    std::mt19937_64 rng(1);
+    std::vector<size_t> positions(1 << 16);
+    for (size_t &pos : positions) {
+	pos = rng() % pageCount;
+    }
+    char params[64];
+    snprintf(params, sizeof(params), "\"pages\": %zu", pageCount);
+    bench.run("bitset.set", params, 1 << 20, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    bitset.set(positions[i & (positions.size() - 1)], i & 1);
+	}
+	return nowNs() - start;
+    });
+}
+
+static void benchNode(MicroBenchmark &bench)
+{
+    const size_t keySizes[] = {8, 16, 64, 256};
+    const size_t valueSize = 32;
+    GlobalConfiguration globConf(16, PAGE_SIZE, 1, PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, "");
+    globConf.initialize(16, PAGE_SIZE, 1, PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, "");
+
+    for (size_t keySize : keySizes) {
+	SinglePageReadWriter rw;
+	DatabaseNode node(&globConf, rw, 0, false);
+	for (size_t i = 0; node.spaceOnDisk() + keySize + valueSize + 2 * sizeof(size_t) <= PAGE_SIZE * 3 / 4; i++) {
+	    DatabaseNode::Record key(keySize, new char[keySize]);
+	    memset(key.data, 0, keySize);
+	    memcpy(key.data, &i, std::min(keySize, sizeof(i)));
+	    DatabaseNode::Record value(valueSize, new char[valueSize]);
+	    memset(value.data, 'v', valueSize);
+	    node.keys().push_back(key);
+	    node.data().push_back(value);
+	    node.setKeyCount(node.keyCount() + 1);
+	}
+	node.writeToPages(&globConf, rw);
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"key_size\": %zu, \"value_size\": %zu, \"keys\": %zu",
+	    keySize, valueSize, node.keyCount());
+	bench.run("node.decode", params, 20000, [&](size_t iterations) {
+	    uint64_t start = nowNs();
+	    for (size_t i = 0; i < iterations; i++) {
+		DatabaseNode decoded(&globConf, rw, 0, true);
+	    }
+	    return nowNs() - start;
+	});
+	bench.run("node.writeToPages", params, 20000, [&](size_t iterations) {
+	    uint64_t start = nowNs();
+	    for (size_t i = 0; i < iterations; i++) {
+		node.writeToPages(&globConf, rw);
+	    }
+	    return nowNs() - start;
+	});
+    }
+}
+
+static void benchDisk(MicroBenchmark &bench)
+{
+    const size_t pageCount = 1 << 14;
+    std::string file = bench.path("disk.db");
+    GlobalConfiguration globConf(pageCount, PAGE_SIZE, 1, PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, "");
+    Statistics stats;
+    DiskPageReadWriter disk(file.c_str(), &globConf, &stats);
+
+    std::mt19937_64 rng(2);
+    std::vector<size_t> pages(1 << 12);
+    for (size_t &p : pages) {
+	p = 1 + rng() % (pageCount - 1);
+    }
+    Page page(0, PAGE_SIZE);
+    memset(page.rawData(), 'p', PAGE_SIZE);
+
+    char params[64];
+    snprintf(params, sizeof(params), "\"pages\": %zu, \"page_size\": %zu", pageCount, PAGE_SIZE);
+    bench.run("disk.write", params, 20000, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    Page p(pages[i & (pages.size() - 1)], PAGE_SIZE);
+	    disk.write(p);
+	}
+	return nowNs() - start;
+    });
+    bench.run("disk.read", params, 20000, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    Page p(pages[i & (pages.size() - 1)], PAGE_SIZE);
+	    disk.read(p);
+	}
+	return nowNs() - start;
+    });
+    disk.close();
+}
+
+static void benchCache(MicroBenchmark &bench)
+{
+    const size_t pageCount = 1 << 14;
+    const size_t cachePages = 256;
+    std::string file = bench.path("cache.db");
+    std::string journal = bench.path("cache.journal");
+    GlobalConfiguration globConf(pageCount, PAGE_SIZE, 1, cachePages * PAGE_SIZE, 0, GlobalConfiguration::FORMAT_WIDE, journal.c_str());
+    Statistics stats;
+    MemoryBudget budget(0);
+    CachedPageReadWriter cache(new DiskPageReadWriter(file.c_str(), &globConf, &stats), &globConf, &stats, &budget);
+
+    char params[64];
+    snprintf(params, sizeof(params), "\"cache_pages\": %zu, \"page_size\": %zu", cachePages, PAGE_SIZE);
+    bench.run("cache.read_hit", params, 100000, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    Page p(1 + i % (cachePages / 2), PAGE_SIZE);
+	    cache.read(p);
+	}
+	return nowNs() - start;
+    });
+
+    // Walking over twice the cache keeps every read a miss with a clean eviction
+    cache.flush();
+    size_t next = 0;
+    bench.run("cache.read_miss_evict", params, 20000, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    Page p(1 + next++ % (cachePages * 2), PAGE_SIZE);
+	    cache.read(p);
+	}
+	return nowNs() - start;
+    });
+
+    bench.run("cache.write_dirty_evict", params, 2000, [&](size_t iterations) {
+	uint64_t start = nowNs();
+	for (size_t i = 0; i < iterations; i++) {
+	    Page p(1 + next++ % (cachePages * 2), PAGE_SIZE);
+	    cache.write(p);
+	}
+	return nowNs() - start;
+    });
+    cache.close();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t repetitions = 5;
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+	if (!strncmp(argv[i], "--repetitions=", 14)) {
+	    repetitions = std::max(1UL, strtoul(argv[i] + 14, 0, 10));
+	} else if (!strncmp(argv[i], "--filter=", 9)) {
+	    filter = argv[i] + 9;
+	} else {
+	    fprintf(stderr, "Usage: %s [--repetitions=N] [--filter=SUBSTRING]\n", argv[0]);
+	    return 1;
+	}
+    }
+
+    try {
+	MicroBenchmark bench(repetitions, filter);
+	printf("{\"page_size\": %zu, \"repetitions\": %zu, \"benchmarks\": [", PAGE_SIZE, repetitions);
+	benchBitset(bench);
+	benchCache(bench);
+	benchNode(bench);
+	benchDisk(bench);
+	const size_t keySizes[] = {8, 64};
+	for (size_t keySize : keySizes) {
+	    DatabaseBenchmark::run(bench, keySize);
+	}
+	printf("\n]}\n");
+    } catch (std::string err) {
+	fprintf(stderr, "Error: %s\n", err.c_str());
+	return 1;
+    }
+    return 0;
+}
@@ -2,18 +2,37 @@
 
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 
 DB *dbcreate(char *file, DBC *conf)
 {
     try {
+	if (conf->engine < DB_ENGINE_BTREE || conf->engine > DB_ENGINE_BTREE_BUFFERED
+		|| conf->warm_up < DB_WARM_UP_NONE || conf->warm_up > DB_WARM_UP_BACKGROUND
+		|| conf->read_only < DB_READ_WRITE || conf->read_only > DB_READ_ONLY_MMAP) {
+	    throw std::string("Invalid configuration, use db_config_init to fill it");
+	}
+
 	DB *res = new DB;
+	res->keyspace = 0;
+	res->ownsBase = true;
 
-	Database::Configuration newConf;
+	DatabaseEngine::Configuration newConf;
 	newConf.pageSize = conf->page_size;
 	newConf.cacheSize = conf->cache_size;
 	newConf.size = conf->db_size;
+	newConf.inMemory = conf->in_memory != 0;
+	newConf.engine = static_cast<DatabaseEngine::EngineType>(conf->engine);
+	newConf.copyOnWrite = conf->copy_on_write != 0;
+	newConf.warmUp = static_cast<DatabaseEngine::WarmUp>(conf->warm_up);
+	newConf.fixedKeySize = conf->fixed_key_size;
+	newConf.compactFormat = conf->compact_format != 0;
+	newConf.memoryBudget = conf->memory_budget;
+	newConf.readOnly = static_cast<DatabaseEngine::ReadOnly>(conf->read_only);
 
-	res->base = new Database(file, newConf);
+	res->base = DatabaseEngine::create(file, newConf);
 
 	return res;
     } catch (std::string err) {
@@ -22,8 +41,23 @@ DB *dbcreate(char *file, DBC *conf)
     }
 }
 
+void db_config_init(DBC *conf)
+{
+    memset(conf, 0, sizeof(*conf));
+    conf->db_size = 512 * 1024 * 1024;
+    conf->page_size = 4 * 1024;
+    conf->cache_size = 16 * 1024 * 1024;
+    conf->engine = DB_ENGINE_BTREE;
+    conf->warm_up = DB_WARM_UP_NONE;
+    conf->read_only = DB_READ_WRITE;
+}
+
 int db_close(DB *db) {
     try {
+	if (!db->ownsBase) {
+	    delete db;
+	    return 0;
+	}
 	db->base->close();
 	return 0;
     } catch (std::string err) {
@@ -34,6 +68,8 @@ int db_close(DB *db) {
 
 int db_delete(DB *db, void *key, size_t key_len) {
     try {
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().deleteLatency);
 	db->base->remove(DatabaseNode::Record(key_len, static_cast<char *>(key)));
 	return 0;
     } catch (std::string err) {
@@ -54,6 +90,8 @@ int db_select(
     DatabaseNode::Record valueRec(0, 0);
 
     try {
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().selectLatency);
 	db->base->select(keyRec, valueRec);
 
 	*val_len = valueRec.size;
@@ -65,6 +103,37 @@ int db_select(
     }
 }
 
+int db_multi_select(
+    DB *db,
+    size_t count,
+    void **keys,
+    size_t *key_lens,
+    void **vals,
+    size_t *val_lens
+)
+{
+    try {
+	std::vector<DatabaseNode::Record> keyRecs;
+	for (size_t i = 0; i < count; i++) {
+	    keyRecs.push_back(DatabaseNode::Record(key_lens[i], static_cast<char *>(keys[i])));
+	}
+	std::vector<DatabaseNode::Record> valueRecs(count);
+
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().selectLatency);
+	db->base->multiSelect(keyRecs.data(), count, valueRecs.data());
+
+	for (size_t i = 0; i < count; i++) {
+	    vals[i] = valueRecs[i].data;
+	    val_lens[i] = valueRecs[i].size;
+	}
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
 int db_insert(
     DB *db,
     void *key,
@@ -74,6 +143,8 @@ int db_insert(
 )
 {
     try {
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().insertLatency);
 	db->base->insert(
 	    DatabaseNode::Record(key_len, static_cast<char *>(key)),
 	    DatabaseNode::Record(val_len, static_cast<char *>(val))
@@ -85,9 +156,368 @@ int db_insert(
     }
 }
 
-// TODO: implement
+int db_upsert(
+    DB *db,
+    void *key,
+    size_t key_len,
+    void *val,
+    size_t val_len
+)
+{
+    try {
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().insertLatency);
+	db->base->upsert(
+	    DatabaseNode::Record(key_len, static_cast<char *>(key)),
+	    DatabaseNode::Record(val_len, static_cast<char *>(val))
+	);
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+DB *db_keyspace(DB *db, const char *name)
+{
+    try {
+	size_t keyspace = db->base->openKeyspace(name);
+	DB *res = new DB;
+	res->base = db->base;
+	res->keyspace = keyspace;
+	res->ownsBase = false;
+	return res;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 0;
+    }
+}
+
+int db_write_batch(DB *db, const DBBatchOp *ops, size_t count)
+{
+    try {
+	std::vector<DatabaseEngine::BatchOperation> batch(count);
+	for (size_t i = 0; i < count; i++) {
+	    if (ops[i].db->base != db->base) {
+		throw std::string("Batch operation belongs to other database");
+	    }
+	    if (ops[i].type == DB_BATCH_INSERT) {
+		batch[i].type = CachedPageReadWriter::INSERT;
+		batch[i].value.assign(static_cast<char *>(ops[i].val), ops[i].val_len);
+	    } else if (ops[i].type == DB_BATCH_DELETE) {
+		batch[i].type = CachedPageReadWriter::DELETE;
+	    } else {
+		throw std::string("Unknown batch operation type");
+	    }
+	    batch[i].key.assign(static_cast<char *>(ops[i].key), ops[i].key_len);
+	    batch[i].keyspace = ops[i].db->keyspace;
+	}
+	db->base->writeBatch(batch);
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+size_t db_batch_limit(DB *db)
+{
+    try {
+	return db->base->batchLimit();
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 0;
+    }
+}
+
+DBSnapshot *db_snapshot_create(DB *db)
+{
+    try {
+	DBSnapshot *res = new DBSnapshot;
+	try {
+	    res->id = db->base->createSnapshot();
+	} catch (...) {
+	    delete res;
+	    throw;
+	}
+	return res;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 0;
+    }
+}
+
+int db_snapshot_release(DB *db, DBSnapshot *snapshot)
+{
+    try {
+	size_t id = snapshot->id;
+	delete snapshot;
+	db->base->releaseSnapshot(id);
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+int db_snapshot_select(
+    DB *db,
+    DBSnapshot *snapshot,
+    void *key,
+    size_t key_len,
+    void **val,
+    size_t *val_len
+)
+{
+    DatabaseNode::Record keyRec(key_len, static_cast<char *>(key));
+    DatabaseNode::Record valueRec(0, 0);
+
+    try {
+	db->base->useKeyspace(db->keyspace);
+	ScopedLatency latency(db->base->statistics().selectLatency);
+	db->base->selectAtSnapshot(snapshot->id, keyRec, valueRec);
+
+	*val_len = valueRec.size;
+	*val = valueRec.data;
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+static DatabaseEngine::ScanCallback wrapScanCallback(db_scan_callback callback, void *arg)
+{
+    return [callback, arg](const DatabaseNode::Record &key, const DatabaseNode::Record &value) {
+	return callback(arg, key.data, key.size, value.data, value.size) == 0;
+    };
+}
+
+int db_scan(
+    DB *db,
+    void *from,
+    size_t from_len,
+    void *to,
+    size_t to_len,
+    db_scan_callback callback,
+    void *arg
+)
+{
+    DatabaseNode::Record fromRec(from_len, static_cast<char *>(from));
+    DatabaseNode::Record toRec(to_len, static_cast<char *>(to));
+
+    try {
+	db->base->useKeyspace(db->keyspace);
+	db->base->scan(from ? &fromRec : 0, to ? &toRec : 0, wrapScanCallback(callback, arg));
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+int db_snapshot_scan(
+    DB *db,
+    DBSnapshot *snapshot,
+    void *from,
+    size_t from_len,
+    void *to,
+    size_t to_len,
+    db_scan_callback callback,
+    void *arg
+)
+{
+    DatabaseNode::Record fromRec(from_len, static_cast<char *>(from));
+    DatabaseNode::Record toRec(to_len, static_cast<char *>(to));
+
+    try {
+	db->base->useKeyspace(db->keyspace);
+	db->base->scanAtSnapshot(snapshot->id, from ? &fromRec : 0, to ? &toRec : 0, wrapScanCallback(callback, arg));
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+DBQueue *db_queue_create(DB *db)
+{
+    try {
+	DBQueue *res = new DBQueue;
+	try {
+	    res->base = new AsyncQueue(db->base);
+	} catch (...) {
+	    res->base = 0;
+	    delete res;
+	    throw;
+	}
+	return res;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 0;
+    }
+}
+
+int db_queue_destroy(DBQueue *queue)
+{
+    delete queue;
+    return 0;
+}
+
+int db_queue_fd(DBQueue *queue)
+{
+    return queue->base->eventFd();
+}
+
+static int submitRequest(
+    DBQueue *queue,
+    DB *db,
+    AsyncQueue::RequestType type,
+    void *key,
+    size_t key_len,
+    void *val,
+    size_t val_len,
+    void *user_data)
+{
+    try {
+	if (db->base != queue->base->engine()) {
+	    throw std::string("Request belongs to other database");
+	}
+	AsyncQueue::Request request;
+	request.type = type;
+	request.keyspace = db->keyspace;
+	request.key.assign(static_cast<char *>(key), key_len);
+	request.value.assign(static_cast<char *>(val), val_len);
+	request.userData = user_data;
+	queue->base->submit(request);
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+int db_submit_get(DBQueue *queue, DB *db, void *key, size_t key_len, void *user_data)
+{
+    return submitRequest(queue, db, AsyncQueue::GET, key, key_len, 0, 0, user_data);
+}
+
+int db_submit_put(DBQueue *queue, DB *db, void *key, size_t key_len, void *val, size_t val_len, void *user_data)
+{
+    return submitRequest(queue, db, AsyncQueue::PUT, key, key_len, val, val_len, user_data);
+}
+
+int db_submit_del(DBQueue *queue, DB *db, void *key, size_t key_len, void *user_data)
+{
+    return submitRequest(queue, db, AsyncQueue::DEL, key, key_len, 0, 0, user_data);
+}
+
+size_t db_queue_poll(DBQueue *queue, DBCompletion *completions, size_t max_count)
+{
+    std::vector<AsyncQueue::Completion> done(max_count);
+    size_t count = queue->base->poll(done.data(), max_count);
+    for (size_t i = 0; i < count; i++) {
+	completions[i].user_data = done[i].userData;
+	completions[i].type = done[i].type;
+	completions[i].status = done[i].status;
+	completions[i].val = done[i].value.data;
+	completions[i].val_len = done[i].value.size;
+    }
+    return count;
+}
+
+static void fillLatency(DBLatency *res, const LatencyHistogram &histogram)
+{
+    res->count = histogram.count();
+    res->mean_ns = histogram.mean();
+    res->p50_ns = histogram.percentile(0.5);
+    res->p99_ns = histogram.percentile(0.99);
+    res->p999_ns = histogram.percentile(0.999);
+    res->max_ns = histogram.max();
+}
+
+int db_stats(DB *db, DBStats *stats)
+{
+    const Statistics &s = db->base->statistics();
+
+    fillLatency(&stats->insert_latency, s.insertLatency);
+    fillLatency(&stats->select_latency, s.selectLatency);
+    fillLatency(&stats->delete_latency, s.deleteLatency);
+
+    stats->cache_hits = s.cacheHits;
+    stats->cache_misses = s.cacheMisses;
+    stats->cache_evictions = s.cacheEvictions;
+    stats->cache_dirty_evictions = s.cacheDirtyEvictions;
+    stats->pages_read = s.pagesRead;
+    stats->pages_written = s.pagesWritten;
+    stats->journal_bytes = s.journalBytes;
+    stats->journal_records = s.journalRecords;
+    stats->splits = s.splits;
+    stats->merges = s.merges;
+    stats->buffer_flushes = s.bufferFlushes;
+    stats->snapshot_page_copies = s.snapshotPageCopies;
+    stats->node_cache_hits = s.nodeCacheHits;
+    stats->node_cache_misses = s.nodeCacheMisses;
+    stats->node_writes_avoided = s.nodeWritesAvoided;
+    stats->append_fast_path_inserts = s.appendFastPathInserts;
+    stats->warm_up_pages = s.warmUpPages;
+    stats->memory_sheds = s.memorySheds;
+
+    const MemoryBudget &m = db->base->memoryBudget();
+    stats->memory_limit = m.limit();
+    stats->memory_used = m.used();
+    stats->memory_peak = m.peak();
+    stats->memory_page_cache = m.used(MemoryBudget::PAGE_CACHE);
+    stats->memory_node_cache = m.used(MemoryBudget::NODE_CACHE);
+    stats->memory_operation_buffers = m.used(MemoryBudget::OPERATION_BUFFERS);
+    stats->memory_memtable = m.used(MemoryBudget::MEMTABLE);
+    stats->memory_snapshots = m.used(MemoryBudget::SNAPSHOTS);
+    return 0;
+}
+
+int db_stats_dump(DB *db, char *buf, size_t buf_len)
+{
+    if (!buf_len) {
+	return 1;
+    }
+    std::string dump = db->base->statistics().dump() + db->base->memoryBudget().dump();
+    size_t len = std::min(dump.size(), buf_len - 1);
+    memcpy(buf, dump.data(), len);
+    buf[len] = '\0';
+    return 0;
+}
+
+int db_compact(DB *db)
+{
+    try {
+	db->base->compact();
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
+int db_set_cache_size(DB *db, size_t cache_size)
+{
+    try {
+	db->base->setCacheSize(cache_size);
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
+}
+
 int db_sync(const DB *db)
 {
+    try {
+	db->base->sync();
+	return 0;
+    } catch (std::string err) {
+	std::cerr << "Error: " << err << std::endl;
+	return 1;
+    }
 }
 
 // TODO: implement
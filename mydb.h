@@ -1,17 +1,75 @@
 #include <stddef.h>
 
-#include "Database.h"
+#include "AsyncQueue.h"
+#include "DatabaseEngine.h"
 
 struct DB
 {
-    Database *base;
+    DatabaseEngine *base;
+    /* Keyspace which operations of this handle go to */
+    size_t keyspace;
+    /* Keyspace handles share base with handle they are opened from */
+    bool ownsBase;
 
     ~DB()
+    {
+	if (ownsBase) {
+	    delete base;
+	}
+    }
+};
+
+/* Queue of asynchronous requests to one database */
+struct DBQueue
+{
+    AsyncQueue *base;
+
+    ~DBQueue()
     {
 	delete base;
     }
 };
 
+enum DBEngine
+{
+    /* Ordered B-tree */
+    DB_ENGINE_BTREE = 0,
+    /* Extendible hashing, point operations only */
+    DB_ENGINE_HASH = 1,
+    /* Log-structured merge tree for write-heavy loads,
+     * keeps sorted run files next to database file
+     * */
+    DB_ENGINE_LSM = 2,
+    /* B-tree with update buffers in internal nodes (B-epsilon tree):
+     * fewer leaf writes, lookups check buffers on the way down
+     * */
+    DB_ENGINE_BTREE_BUFFERED = 3
+};
+
+enum DBWarmUp
+{
+    /* Page cache starts empty */
+    DB_WARM_UP_NONE = 0,
+    /* Pages cached at last close are read back during open */
+    DB_WARM_UP_LOAD = 1,
+    /* Kernel is asked to read those pages ahead, open doesn't wait */
+    DB_WARM_UP_BACKGROUND = 2
+};
+
+enum DBReadOnly
+{
+    DB_READ_WRITE = 0,
+    /* Database is read and never written: no journal records, header is
+     * kept as it is on close, so many processes can open one file */
+    DB_READ_ONLY = 1,
+    /* Same, file is mapped and pages are copied from shared mapping, so
+     * processes share one copy of data in OS page cache */
+    DB_READ_ONLY_MMAP = 2
+};
+
+/* Fill with db_config_init before setting fields: defaults below are set
+ * there, so callers built before a field was added still pass its default
+ * */
 struct DBC
 {
     /* Maximum on-disk file size
@@ -28,16 +86,250 @@ struct DBC
      * 16MB by default
      * */
     size_t cache_size;
+
+    /* Non-zero keeps database in memory only: file isn't touched,
+     * no journal is written and data is lost on close
+     * 0 by default
+     * */
+    int in_memory;
+
+    /* Storage engine of new database, existing files keep their own
+     * DB_ENGINE_BTREE by default
+     * */
+    int engine;
+
+    /* Non-zero creates B-tree database without journal: changed nodes are
+     * written to free pages and every operation is committed by header
+     * write with new root, so each page is written once.
+     * Existing files keep their own mode
+     * 0 by default
+     * */
+    int copy_on_write;
+
+    /* B-tree and hash engines save list of cached pages, hottest first,
+     * to <file>.warm on close and preload them on open as DBWarmUp says
+     * DB_WARM_UP_NONE by default
+     * */
+    int warm_up;
+
+    /* Non-zero makes new B-tree database take keys of this size only,
+     * e.g. 8 for integer keys: keys are stored without length and compared
+     * as words. Keys must be big-endian to keep numeric order.
+     * Existing files keep their own key size
+     * 0 by default
+     * */
+    size_t fixed_key_size;
+
+    /* Non-zero creates B-tree database with compact nodes: key and value
+     * lengths are varints, key counts and child page numbers take 4 bytes,
+     * so each page holds more records. Existing files keep their own format
+     * 0 by default
+     * */
+    int compact_format;
+
+    /* Non-zero limits memory held by database: cached pages, decoded nodes,
+     * copies of logged operations, LSM memtable and snapshot page copies.
+     * Over the limit cached pages and nodes are dropped and memtable is
+     * written out early. Snapshot copies are counted but kept
+     * 0 by default
+     * */
+    size_t memory_budget;
+
+    /* Opens existing database as DBReadOnly says. It must have been closed
+     * cleanly, changes fail and warm file isn't saved
+     * DB_READ_WRITE by default
+     * */
+    int read_only;
 };
 
-/* Open DB if it exists, otherwise create DB */
+enum DBBatchOpType
+{
+    DB_BATCH_INSERT = 0,
+    DB_BATCH_DELETE = 1
+};
+
+/* Operation of atomic batch, db is handle of keyspace it changes */
+struct DBBatchOp
+{
+    DB *db;
+    int type;
+    void *key;
+    size_t key_len;
+    /* Ignored by DB_BATCH_DELETE */
+    void *val;
+    size_t val_len;
+};
+
+enum DBRequestType
+{
+    DB_REQUEST_GET = 0,
+    DB_REQUEST_PUT = 1,
+    DB_REQUEST_DEL = 2
+};
+
+/* Finished asynchronous request */
+struct DBCompletion
+{
+    /* user_data given on submit */
+    void *user_data;
+    int type;
+    /* 0 on success, 1 on error */
+    int status;
+    /* Value found by DB_REQUEST_GET, NULL when key is absent.
+     * Owned by caller as value of db_select
+     * */
+    void *val;
+    size_t val_len;
+};
+
+struct DBLatency
+{
+    size_t count;
+    size_t mean_ns;
+    size_t p50_ns;
+    size_t p99_ns;
+    size_t p999_ns;
+    size_t max_ns;
+};
+
+struct DBStats
+{
+    DBLatency insert_latency;
+    DBLatency select_latency;
+    DBLatency delete_latency;
+
+    size_t cache_hits;
+    size_t cache_misses;
+    size_t cache_evictions;
+    size_t cache_dirty_evictions;
+
+    size_t pages_read;
+    size_t pages_written;
+
+    size_t journal_bytes;
+    size_t journal_records;
+
+    size_t splits;
+    size_t merges;
+    size_t buffer_flushes;
+    size_t snapshot_page_copies;
+    size_t node_cache_hits;
+    size_t node_cache_misses;
+    size_t node_writes_avoided;
+    size_t append_fast_path_inserts;
+    size_t warm_up_pages;
+    size_t memory_sheds;
+
+    /* Memory counted against DBC::memory_budget, in bytes */
+    size_t memory_limit;
+    size_t memory_used;
+    size_t memory_peak;
+    size_t memory_page_cache;
+    size_t memory_node_cache;
+    size_t memory_operation_buffers;
+    size_t memory_memtable;
+    size_t memory_snapshots;
+};
+
+/* Consistent read-only view of DB at the moment of creation */
+struct DBSnapshot
+{
+    size_t id;
+};
+
+/* Called for every key of scan in order: shorter keys first, then by bytes.
+ * Non-zero return stops the scan
+ * */
+typedef int (*db_scan_callback)(void *arg, const void *key, size_t key_len, const void *val, size_t val_len);
+
+/* Open DB if it exists, otherwise create DB.
+ * Read-only open fails for missing DB */
 extern "C" DB *dbcreate(char *file, DBC *conf);
+/* Set every field of conf to its default */
+extern "C" void db_config_init(DBC *conf);
 
 extern "C" int db_close(DB *db);
+
+/* Handle of named keyspace: separate key space in the same file, sharing
+ * page cache and journal with db. Keyspace is created on first open.
+ * Supported by B-tree engines only. Close keyspace handles before db
+ * */
+extern "C" DB *db_keyspace(DB *db, const char *name);
+/* Apply all operations or none of them, operations may go to different
+ * keyspaces of one database. Pages changed by batch have to fit page cache,
+ * batch longer than db_batch_limit is refused
+ * */
+extern "C" int db_write_batch(DB *db, const DBBatchOp *ops, size_t count);
+/* Most operations db_write_batch takes now, it shrinks as trees grow.
+ * 0 when engine has no batches
+ * */
+extern "C" size_t db_batch_limit(DB *db);
+
 extern "C" int db_delete(DB *, void *, size_t);
 extern "C" int db_select(DB *, void *, size_t, void **, size_t *);
 extern "C" int db_insert(DB *, void *, size_t, void * , size_t  );
+/* Select count keys at once: B-tree lookups go down the tree together and
+ * their page misses are read ahead together. vals[i] is NULL for absent key
+ * */
+extern "C" int db_multi_select(DB *db, size_t count, void **keys, size_t *key_lens, void **vals, size_t *val_lens);
+/* Append value to stored one, store value if key is absent */
+extern "C" int db_upsert(DB *, void *, size_t, void *, size_t);
+
+/* Snapshots keep old page versions until released,
+ * supported by B-tree engines only
+ * */
+extern "C" DBSnapshot *db_snapshot_create(DB *db);
+extern "C" int db_snapshot_release(DB *db, DBSnapshot *snapshot);
+extern "C" int db_snapshot_select(DB *db, DBSnapshot *snapshot, void *, size_t, void **, size_t *);
+
+/* Visit keys in [from, to), NULL bound means unbounded.
+ * Scan reads an implicit snapshot, so callback may modify DB
+ * */
+extern "C" int db_scan(
+    DB *db,
+    void *from, size_t from_len,
+    void *to, size_t to_len,
+    db_scan_callback callback, void *arg
+);
+extern "C" int db_snapshot_scan(
+    DB *db, DBSnapshot *snapshot,
+    void *from, size_t from_len,
+    void *to, size_t to_len,
+    db_scan_callback callback, void *arg
+);
+
+/* Asynchronous requests are done by worker thread of queue in submit order,
+ * submit calls copy key and value and return at once. Blocking calls of the
+ * same database mustn't run meanwhile
+ * */
+extern "C" DBQueue *db_queue_create(DB *db);
+/* Waits for submitted requests, uncollected completions are dropped */
+extern "C" int db_queue_destroy(DBQueue *queue);
+/* Readable while queue has completions, for poll/epoll loops */
+extern "C" int db_queue_fd(DBQueue *queue);
+/* db is handle of queue database or of its keyspace */
+extern "C" int db_submit_get(DBQueue *queue, DB *db, void *key, size_t key_len, void *user_data);
+extern "C" int db_submit_put(DBQueue *queue, DB *db, void *key, size_t key_len, void *val, size_t val_len, void *user_data);
+extern "C" int db_submit_del(DBQueue *queue, DB *db, void *key, size_t key_len, void *user_data);
+/* Take at most max_count completions without waiting, returns their count */
+extern "C" size_t db_queue_poll(DBQueue *queue, DBCompletion *completions, size_t max_count);
+
+/* Fill stats with counters and latencies collected since open */
+extern "C" int db_stats(DB *db, DBStats *stats);
+/* Write "name value" text lines, truncated to buf_len including '\0' */
+extern "C" int db_stats_dump(DB *db, char *buf, size_t buf_len);
+
+/* Move live pages to the file start and truncate free tail */
+extern "C" int db_compact(DB *db);
+
+/* Resize page cache of open database, cache_size is multiple of page size.
+ * Growing takes effect at once. Shrunk cache takes no pages above new size
+ * and evicts extra pages a few at each following write and cache miss, so
+ * call returns without waiting for them. Size stored in file isn't changed
+ * */
+extern "C" int db_set_cache_size(DB *db, size_t cache_size);
 
 /* Sync cached pages with disk */
 extern "C" int db_flush(const DB *db);
+/* Write cached pages and wait until they and journal are on disk */
 extern "C" int db_sync(const DB *db);
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * Binary protocol of mydb_server over Unix domain socket, integers are
+ * in host byte order.
+ *
+ * Request:  uint8 op, uint32 key length, uint32 value length, key, value
+ * Response: uint8 status, uint32 value length, value
+ *
+ * Responses of a connection come in request order, so client may send
+ * next requests before responses of previous ones arrive.
+ */
+namespace Protocol {
+
+enum Op {
+    OP_GET = 1,
+    OP_PUT = 2,
+    OP_DEL = 3
+};
+
+enum Status {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND = 1,
+    STATUS_ERROR = 2
+};
+
+static const size_t REQUEST_HEADER_SIZE = 9;
+static const size_t RESPONSE_HEADER_SIZE = 5;
+/// Longer keys and values break connection
+static const uint32_t MAX_LENGTH = 1 << 20;
+
+struct Request
+{
+    uint8_t op;
+    std::string key;
+    std::string value;
+};
+
+inline void appendHeader(std::string &buf, uint8_t first, uint32_t a, const uint32_t *b)
+{
+    buf.append(reinterpret_cast<const char *>(&first), sizeof(first));
+    buf.append(reinterpret_cast<const char *>(&a), sizeof(a));
+    if (b) {
+	buf.append(reinterpret_cast<const char *>(b), sizeof(*b));
+    }
+}
+
+inline void appendRequest(std::string &buf, uint8_t op, const std::string &key, const std::string &value)
+{
+    uint32_t valueSize = value.size();
+    appendHeader(buf, op, key.size(), &valueSize);
+    buf.append(key);
+    buf.append(value);
+}
+
+inline void appendResponse(std::string &buf, uint8_t status, const char *value, uint32_t valueSize)
+{
+    appendHeader(buf, status, valueSize, nullptr);
+    buf.append(value, valueSize);
+}
+
+/// Returns 1 and moves pos past request, 0 when buffer holds only part of
+/// request, -1 when request is malformed
+inline int parseRequest(const std::string &buf, size_t &pos, Request &request)
+{
+    if (buf.size() - pos < REQUEST_HEADER_SIZE) {
+	return 0;
+    }
+    uint32_t keySize, valueSize;
+    request.op = buf[pos];
+    memcpy(&keySize, buf.data() + pos + 1, sizeof(keySize));
+    memcpy(&valueSize, buf.data() + pos + 5, sizeof(valueSize));
+    if (request.op < OP_GET || request.op > OP_DEL || keySize > MAX_LENGTH || valueSize > MAX_LENGTH) {
+	return -1;
+    }
+    if (buf.size() - pos - REQUEST_HEADER_SIZE < static_cast<size_t>(keySize) + valueSize) {
+	return 0;
+    }
+    request.key.assign(buf, pos + REQUEST_HEADER_SIZE, keySize);
+    request.value.assign(buf, pos + REQUEST_HEADER_SIZE + keySize, valueSize);
+    pos += REQUEST_HEADER_SIZE + keySize + valueSize;
+    return 1;
+}
+
+/// Same results as parseRequest
+inline int parseResponse(const std::string &buf, size_t &pos, uint8_t &status, std::string &value)
+{
+    if (buf.size() - pos < RESPONSE_HEADER_SIZE) {
+	return 0;
+    }
+    uint32_t valueSize;
+    status = buf[pos];
+    memcpy(&valueSize, buf.data() + pos + 1, sizeof(valueSize));
+    if (status > STATUS_ERROR || valueSize > MAX_LENGTH) {
+	return -1;
+    }
+    if (buf.size() - pos - RESPONSE_HEADER_SIZE < valueSize) {
+	return 0;
+    }
+    value.assign(buf, pos + RESPONSE_HEADER_SIZE, valueSize);
+    pos += RESPONSE_HEADER_SIZE + valueSize;
+    return 1;
+}
+
+}
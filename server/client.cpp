@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Statistics.h"
+#include "server/Protocol.h"
+
+/*
+ * Load generator for mydb_server.
+ *
+ * Every client thread opens its own connection and keeps `depth`
+ * requests in flight. Threads use disjoint keys and remember what they
+ * wrote, so every get response is checked against the expected value.
+ */
+
+struct ClientConfig
+{
+    std::string socketPath;
+    size_t clients;
+    size_t requests;
+    size_t depth;
+    size_t keys;
+    size_t valueSize;
+    double writeRatio;
+    double deleteRatio;
+    unsigned seed;
+};
+
+struct InFlight
+{
+    uint8_t op;
+    uint64_t start;
+    /// Expected get result
+    bool isPresent;
+    std::string value;
+};
+
+struct ClientResult
+{
+    LatencyHistogram latency;
+    size_t errors;
+    size_t mismatches;
+};
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+	"Usage: %s [options]\n"
+	"  --socket=PATH        Unix socket path (default ./mydb.sock)\n"
+	"  --clients=N          connections, one thread each (default 4)\n"
+	"  --requests=N         requests per client (default 100000)\n"
+	"  --depth=N            pipelined requests per client (default 16)\n"
+	"  --keys=N             keys per client (default 10000)\n"
+	"  --value-size=N       value length in bytes (default 100)\n"
+	"  --write-ratio=R      share of puts and deletes (default 0.5)\n"
+	"  --delete-ratio=R     share of deletes among writes (default 0.1)\n"
+	"  --seed=N             random seed (default 42)\n",
+	name);
+    exit(1);
+}
+
+static bool parseOption(const char *arg, const char *name, std::string &value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) || arg[len] != '=') {
+	return false;
+    }
+    value = arg + len + 1;
+    return true;
+}
+
+static int connectTo(const std::string &socketPath)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+	perror("Can't connect to server");
+	exit(1);
+    }
+    return fd;
+}
+
+static void writeAll(int fd, const std::string &buf)
+{
+    size_t pos = 0;
+    while (pos < buf.size()) {
+	ssize_t sent = write(fd, buf.data() + pos, buf.size() - pos);
+	if (sent <= 0 && errno != EINTR) {
+	    perror("Can't send requests");
+	    exit(1);
+	}
+	pos += sent > 0 ? sent : 0;
+    }
+}
+
+static void runClient(const ClientConfig *conf, size_t id, ClientResult *result)
+{
+    int fd = connectTo(conf->socketPath);
+    std::mt19937_64 rng(conf->seed + id);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::map<std::string, std::string> stored;
+    std::deque<InFlight> inFlight;
+    std::string out, in;
+    size_t inPos = 0, sent = 0, received = 0;
+    char buf[64 << 10];
+
+    while (received < conf->requests) {
+	out.clear();
+	while (sent < conf->requests && inFlight.size() < conf->depth) {
+	    char key[64];
+	    snprintf(key, sizeof(key), "c%04zu-k%012zu", id, static_cast<size_t>(rng() % conf->keys));
+	    InFlight f;
+	    f.start = nowNs();
+	    std::string value;
+	    if (uniform(rng) < conf->writeRatio) {
+		if (uniform(rng) < conf->deleteRatio) {
+		    f.op = Protocol::OP_DEL;
+		    stored.erase(key);
+		} else {
+		    f.op = Protocol::OP_PUT;
+		    value.assign(conf->valueSize, 'a' + sent % 26);
+		    stored[key] = value;
+		}
+	    } else {
+		f.op = Protocol::OP_GET;
+		std::map<std::string, std::string>::const_iterator it = stored.find(key);
+		f.isPresent = it != stored.end();
+		if (f.isPresent) {
+		    f.value = it->second;
+		}
+	    }
+	    Protocol::appendRequest(out, f.op, key, value);
+	    inFlight.push_back(f);
+	    sent++;
+	}
+	writeAll(fd, out);
+
+	ssize_t got = read(fd, buf, sizeof(buf));
+	if (got <= 0) {
+	    if (got == -1 && errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "Server closed connection\n");
+	    exit(1);
+	}
+	in.append(buf, got);
+
+	uint8_t status;
+	std::string value;
+	int res;
+	while ((res = Protocol::parseResponse(in, inPos, status, value)) == 1) {
+	    InFlight &f = inFlight.front();
+	    result->latency.record(nowNs() - f.start);
+	    if (status == Protocol::STATUS_ERROR) {
+		result->errors++;
+	    } else if (f.op == Protocol::OP_GET) {
+		bool isPresent = status == Protocol::STATUS_OK;
+		if (isPresent != f.isPresent || (isPresent && value != f.value)) {
+		    result->mismatches++;
+		}
+	    }
+	    inFlight.pop_front();
+	    received++;
+	}
+	if (res == -1) {
+	    fprintf(stderr, "Malformed response\n");
+	    exit(1);
+	}
+	in.erase(0, inPos);
+	inPos = 0;
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    ClientConfig conf;
+    conf.socketPath = "./mydb.sock";
+    conf.clients = 4;
+    conf.requests = 100000;
+    conf.depth = 16;
+    conf.keys = 10000;
+    conf.valueSize = 100;
+    conf.writeRatio = 0.5;
+    conf.deleteRatio = 0.1;
+    conf.seed = 42;
+
+    for (int i = 1; i < argc; i++) {
+	std::string v;
+	if (parseOption(argv[i], "--socket", v)) {
+	    conf.socketPath = v;
+	} else if (parseOption(argv[i], "--clients", v)) {
+	    conf.clients = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--requests", v)) {
+	    conf.requests = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--depth", v)) {
+	    conf.depth = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--keys", v)) {
+	    conf.keys = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--value-size", v)) {
+	    conf.valueSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--write-ratio", v)) {
+	    conf.writeRatio = atof(v.c_str());
+	} else if (parseOption(argv[i], "--delete-ratio", v)) {
+	    conf.deleteRatio = atof(v.c_str());
+	} else if (parseOption(argv[i], "--seed", v)) {
+	    conf.seed = strtoul(v.c_str(), 0, 10);
+	} else {
+	    usage(argv[0]);
+	}
+    }
+    if (!conf.clients || !conf.requests || !conf.depth || !conf.keys) {
+	usage(argv[0]);
+    }
+
+    std::vector<ClientResult> results(conf.clients);
+    std::vector<std::thread> threads;
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < conf.clients; i++) {
+	results[i].errors = 0;
+	results[i].mismatches = 0;
+	threads.push_back(std::thread(runClient, &conf, i, &results[i]));
+    }
+    for (std::thread &t : threads) {
+	t.join();
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    LatencyHistogram total;
+    size_t errors = 0, mismatches = 0;
+    for (const ClientResult &r : results) {
+	total.merge(r.latency);
+	errors += r.errors;
+	mismatches += r.mismatches;
+    }
+    printf("clients %zu depth %zu: %.0f requests/s, errors %zu, mismatches %zu\n",
+	conf.clients, conf.depth, total.count() / seconds, errors, mismatches);
+    printf("latency  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us\n",
+	total.mean() / 1e3, total.percentile(0.5) / 1e3, total.percentile(0.99) / 1e3,
+	total.percentile(0.999) / 1e3, total.max() / 1e3);
+    return errors || mismatches;
+}
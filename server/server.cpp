@@ -0,0 +1,446 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mydb.h"
+#include "server/Protocol.h"
+
+/*
+ * Serves one database to local clients over Unix domain socket.
+ *
+ * Single thread waits for all connections with epoll. Requests read in
+ * one wakeup are done in rounds: leading puts and deletes of every
+ * connection are committed as one batch, then leading gets of every
+ * connection are done by multi-selects, and so on. Requests of one
+ * connection keep their order. Responses are sent after the batch holding
+ * the request is committed.
+ */
+
+struct ServerConfig
+{
+    std::string socketPath;
+    std::string dbPath;
+    size_t dbSize;
+    size_t pageSize;
+    size_t cacheSize;
+    int engine;
+    bool copyOnWrite;
+    size_t maxBatch;
+};
+
+struct Connection
+{
+    int fd;
+    std::string in;
+    std::string out;
+    size_t outPos;
+    bool isBroken;
+    uint32_t events;
+};
+
+struct PendingRequest
+{
+    Connection *connection;
+    Protocol::Request request;
+    uint8_t status;
+};
+
+struct ServerStats
+{
+    size_t requests;
+    size_t batches;
+    size_t batchedWrites;
+    size_t multiSelects;
+};
+
+/// Connection output above this isn't read from until client takes responses
+static const size_t MAX_OUTPUT = 4 << 20;
+static const size_t MAX_MULTI_SELECT = 64;
+static const size_t READ_CHUNK = 64 << 10;
+
+static volatile sig_atomic_t isStopping = 0;
+
+static void onStopSignal(int)
+{
+    isStopping = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+	"Usage: %s [options]\n"
+	"  --socket=PATH        Unix socket path (default ./mydb.sock)\n"
+	"  --db=PATH            database file (default ./server.db)\n"
+	"  --db-size=N          database size of new file (default 512MB)\n"
+	"  --page-size=N        page size of new file (default 4KB)\n"
+	"  --cache-size=N       cache size (default 16MB)\n"
+	"  --engine=E           btree|buffered|hash|lsm for new file (default btree)\n"
+	"  --copy-on-write      shadow paging instead of journal for new file\n"
+	"  --max-batch=N        writes committed together at most, fewer when\n"
+	"                       their pages don't fit cache (default 256)\n",
+	name);
+    exit(1);
+}
+
+static bool parseOption(const char *arg, const char *name, std::string &value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) || arg[len] != '=') {
+	return false;
+    }
+    value = arg + len + 1;
+    return true;
+}
+
+static void updateEvents(int epollFd, Connection *c)
+{
+    size_t pending = c->out.size() - c->outPos;
+    uint32_t events = (pending < MAX_OUTPUT ? EPOLLIN : 0) | (pending ? EPOLLOUT : 0);
+    if (events == c->events) {
+	return;
+    }
+    epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+static void readRequests(Connection *c, std::vector<PendingRequest> &pending)
+{
+    char buf[READ_CHUNK];
+    while (true) {
+	ssize_t got = read(c->fd, buf, sizeof(buf));
+	if (got > 0) {
+	    c->in.append(buf, got);
+	    continue;
+	}
+	if (got == -1 && errno == EINTR) {
+	    continue;
+	}
+	if (got == 0 || errno != EAGAIN) {
+	    c->isBroken = true;
+	}
+	break;
+    }
+
+    size_t pos = 0;
+    PendingRequest p;
+    p.connection = c;
+    p.status = Protocol::STATUS_OK;
+    int res;
+    while ((res = Protocol::parseRequest(c->in, pos, p.request)) == 1) {
+	pending.push_back(p);
+    }
+    if (res == -1) {
+	c->isBroken = true;
+    }
+    c->in.erase(0, pos);
+}
+
+static void writeResponses(Connection *c)
+{
+    while (c->outPos < c->out.size()) {
+	ssize_t sent = write(c->fd, c->out.data() + c->outPos, c->out.size() - c->outPos);
+	if (sent > 0) {
+	    c->outPos += sent;
+	} else if (sent == -1 && errno == EINTR) {
+	    continue;
+	} else {
+	    if (sent == -1 && errno != EAGAIN) {
+		c->isBroken = true;
+	    }
+	    break;
+	}
+    }
+    if (c->outPos == c->out.size()) {
+	c->out.clear();
+	c->outPos = 0;
+    }
+}
+
+static void doWritesOneByOne(DB *db, const std::vector<PendingRequest *> &writes)
+{
+    for (PendingRequest *w : writes) {
+	Protocol::Request &r = w->request;
+	int rc = r.op == Protocol::OP_PUT
+	    ? db_insert(db, &r.key[0], r.key.size(), &r.value[0], r.value.size())
+	    : db_delete(db, &r.key[0], r.key.size());
+	w->status = rc ? Protocol::STATUS_ERROR : Protocol::STATUS_OK;
+    }
+}
+
+static void doWrites(DB *db, const std::vector<PendingRequest *> &writes, bool useBatch, ServerStats &stats)
+{
+    size_t count = writes.size();
+    if (!useBatch || count == 1) {
+	doWritesOneByOne(db, writes);
+	return;
+    }
+
+    std::vector<DBBatchOp> ops(count);
+    for (size_t i = 0; i < count; i++) {
+	Protocol::Request &r = writes[i]->request;
+	ops[i].db = db;
+	ops[i].type = r.op == Protocol::OP_PUT ? DB_BATCH_INSERT : DB_BATCH_DELETE;
+	ops[i].key = &r.key[0];
+	ops[i].key_len = r.key.size();
+	ops[i].val = &r.value[0];
+	ops[i].val_len = r.value.size();
+    }
+    if (!db_write_batch(db, ops.data(), count)) {
+	stats.batches++;
+	stats.batchedWrites += count;
+	return;
+    }
+
+    // Failed batch left no change, writes are repeated so bad request fails alone
+    doWritesOneByOne(db, writes);
+}
+
+static void doGets(DB *db, PendingRequest **gets, size_t count, std::vector<std::string> &values, ServerStats &stats)
+{
+    std::vector<void *> keys(count), vals(count, nullptr);
+    std::vector<size_t> keyLens(count), valLens(count, 0);
+    for (size_t i = 0; i < count; i++) {
+	keys[i] = &gets[i]->request.key[0];
+	keyLens[i] = gets[i]->request.key.size();
+    }
+    int rc = db_multi_select(db, count, keys.data(), keyLens.data(), vals.data(), valLens.data());
+    stats.multiSelects++;
+    for (size_t i = 0; i < count; i++) {
+	if (rc) {
+	    gets[i]->status = Protocol::STATUS_ERROR;
+	} else if (!vals[i]) {
+	    gets[i]->status = Protocol::STATUS_NOT_FOUND;
+	} else {
+	    gets[i]->status = Protocol::STATUS_OK;
+	    values[i].assign(static_cast<char *>(vals[i]), valLens[i]);
+	    delete[] static_cast<char *>(vals[i]);
+	}
+    }
+}
+
+static void serve(DB *db, int listenFd, const ServerConfig &conf)
+{
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    std::map<int, Connection *> connections;
+    std::vector<epoll_event> events(256);
+    std::vector<PendingRequest> pending;
+    std::vector<PendingRequest *> group;
+    std::vector<std::string> values;
+    ServerStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    while (!isStopping) {
+	int n = epoll_wait(epollFd, events.data(), events.size(), -1);
+	if (n == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    perror("epoll_wait");
+	    break;
+	}
+
+	pending.clear();
+	std::vector<Connection *> touched;
+	// Range of pending requests of every touched connection
+	std::vector<std::pair<size_t, size_t> > queues;
+	for (int i = 0; i < n; i++) {
+	    if (!events[i].data.ptr) {
+		int fd;
+		while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		    Connection *c = new Connection;
+		    c->fd = fd;
+		    c->outPos = 0;
+		    c->isBroken = false;
+		    c->events = EPOLLIN;
+		    ev.events = EPOLLIN;
+		    ev.data.ptr = c;
+		    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+		    connections[fd] = c;
+		}
+		continue;
+	    }
+	    Connection *c = static_cast<Connection *>(events[i].data.ptr);
+	    size_t begin = pending.size();
+	    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		readRequests(c, pending);
+	    }
+	    touched.push_back(c);
+	    queues.push_back(std::make_pair(begin, pending.size()));
+	}
+	stats.requests += pending.size();
+
+	// Connection whose run didn't fit the group continues it in the next
+	// round, so its requests and responses stay in order
+	size_t done = 0;
+	while (done < pending.size()) {
+	    // Pages of batch have to fit cache, limit shrinks as tree grows
+	    size_t batchLimit = db_batch_limit(db);
+	    bool useBatch = batchLimit > 1;
+	    size_t groupLimit = useBatch ? std::min(conf.maxBatch, batchLimit) : conf.maxBatch;
+	    group.clear();
+	    for (std::pair<size_t, size_t> &q : queues) {
+		while (q.first < q.second && group.size() < groupLimit && pending[q.first].request.op != Protocol::OP_GET) {
+		    group.push_back(&pending[q.first++]);
+		}
+	    }
+	    if (!group.empty()) {
+		doWrites(db, group, useBatch, stats);
+		for (PendingRequest *p : group) {
+		    Protocol::appendResponse(p->connection->out, p->status, nullptr, 0);
+		}
+		done += group.size();
+	    }
+
+	    group.clear();
+	    for (std::pair<size_t, size_t> &q : queues) {
+		while (q.first < q.second && pending[q.first].request.op == Protocol::OP_GET) {
+		    group.push_back(&pending[q.first++]);
+		}
+	    }
+	    for (size_t i = 0; i < group.size(); i += MAX_MULTI_SELECT) {
+		size_t count = std::min(MAX_MULTI_SELECT, group.size() - i);
+		values.assign(count, std::string());
+		doGets(db, &group[i], count, values, stats);
+		for (size_t k = 0; k < count; k++) {
+		    PendingRequest *p = group[i + k];
+		    Protocol::appendResponse(p->connection->out, p->status, values[k].data(), values[k].size());
+		}
+	    }
+	    done += group.size();
+	}
+
+	for (Connection *c : touched) {
+	    if (connections.count(c->fd) == 0) {
+		continue; // closed by earlier event of this wakeup
+	    }
+	    writeResponses(c);
+	    if (c->isBroken) {
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr);
+		close(c->fd);
+		connections.erase(c->fd);
+		delete c;
+	    } else {
+		updateEvents(epollFd, c);
+	    }
+	}
+    }
+
+    for (std::map<int, Connection *>::iterator it = connections.begin(); it != connections.end(); it++) {
+	close(it->first);
+	delete it->second;
+    }
+    close(epollFd);
+    printf("requests %zu, write batches %zu of %.1f writes on average, multi-selects %zu\n",
+	stats.requests, stats.batches, stats.batches ? 1.0 * stats.batchedWrites / stats.batches : 0.0, stats.multiSelects);
+}
+
+int main(int argc, char *argv[])
+{
+    ServerConfig conf;
+    conf.socketPath = "./mydb.sock";
+    conf.dbPath = "./server.db";
+    conf.dbSize = 512 << 20;
+    conf.pageSize = 4 << 10;
+    conf.cacheSize = 16 << 20;
+    conf.engine = DB_ENGINE_BTREE;
+    conf.copyOnWrite = false;
+    conf.maxBatch = 256;
+
+    for (int i = 1; i < argc; i++) {
+	std::string v;
+	if (parseOption(argv[i], "--socket", v)) {
+	    conf.socketPath = v;
+	} else if (parseOption(argv[i], "--db", v)) {
+	    conf.dbPath = v;
+	} else if (parseOption(argv[i], "--db-size", v)) {
+	    conf.dbSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--page-size", v)) {
+	    conf.pageSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--cache-size", v)) {
+	    conf.cacheSize = strtoull(v.c_str(), 0, 10);
+	} else if (parseOption(argv[i], "--engine", v)) {
+	    if (v == "btree") {
+		conf.engine = DB_ENGINE_BTREE;
+	    } else if (v == "buffered") {
+		conf.engine = DB_ENGINE_BTREE_BUFFERED;
+	    } else if (v == "hash") {
+		conf.engine = DB_ENGINE_HASH;
+	    } else if (v == "lsm") {
+		conf.engine = DB_ENGINE_LSM;
+	    } else {
+		usage(argv[0]);
+	    }
+	} else if (!strcmp(argv[i], "--copy-on-write")) {
+	    conf.copyOnWrite = true;
+	} else if (parseOption(argv[i], "--max-batch", v)) {
+	    conf.maxBatch = strtoull(v.c_str(), 0, 10);
+	} else {
+	    usage(argv[0]);
+	}
+    }
+    if (!conf.maxBatch) {
+	usage(argv[0]);
+    }
+
+    DBC dbConf;
+    db_config_init(&dbConf);
+    dbConf.db_size = conf.dbSize;
+    dbConf.page_size = conf.pageSize;
+    dbConf.cache_size = conf.cacheSize;
+    dbConf.engine = conf.engine;
+    dbConf.copy_on_write = conf.copyOnWrite;
+    DB *db = dbcreate(const_cast<char *>(conf.dbPath.c_str()), &dbConf);
+    if (!db) {
+	fprintf(stderr, "Can't open database %s\n", conf.dbPath.c_str());
+	return 1;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (conf.socketPath.size() >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "Socket path is too long\n");
+	return 1;
+    }
+    strcpy(addr.sun_path, conf.socketPath.c_str());
+    unlink(conf.socketPath.c_str());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd == -1 || bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1
+	    || listen(listenFd, SOMAXCONN) == -1) {
+	perror("Can't listen on socket");
+	return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStopSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    serve(db, listenFd, conf);
+
+    close(listenFd);
+    unlink(conf.socketPath.c_str());
+    return db_close(db);
+}
@@ -0,0 +1,429 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mydb.h"
+
+/*
+ * Crash recovery check of journal mode.
+ *
+ * Parent creates database with three keyspaces. Child process reopens it,
+ * runs a fixed workload of batches over the keyspaces and dies at the n-th
+ * write to the journal, optionally after writing half of it. Parent reopens the database and checks that every batch is either
+ * whole or absent, then that the database takes writes and survives close.
+ * n goes over every journal write of the workload, so crashes land inside
+ * batches which split roots, inside commit records and inside close.
+ */
+
+static const char *DB_PATH = "./recovery.db";
+static const size_t PAGE_SIZE = 1024;
+static const int ROUNDS = 12;
+static const int KEYSPACES = 3;
+static const int KEYS_PER_ROUND = 5;
+static const int CRASH_EXIT = 42;
+
+typedef std::map<std::string, std::string> Model;
+
+static long crashAt = -1;
+static bool tornWrite = false;
+static long journalWrites = 0;
+
+static bool isJournal(int fd)
+{
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len < 0) {
+	return false;
+    }
+    path[len] = '\0';
+    return len >= 8 && !strcmp(path + len - 8, ".journal");
+}
+
+/// Library writes journal through write(2), this one is taken instead
+extern "C" ssize_t write(int fd, const void *buf, size_t count)
+{
+    if (crashAt >= 0 && isJournal(fd) && journalWrites++ == crashAt) {
+	if (tornWrite) {
+	    syscall(SYS_write, fd, buf, count / 2);
+	}
+	_exit(CRASH_EXIT);
+    }
+    return syscall(SYS_write, fd, buf, count);
+}
+
+static DBC config(int engine)
+{
+    DBC conf;
+    db_config_init(&conf);
+    conf.db_size = 16 << 20;
+    conf.page_size = PAGE_SIZE;
+    conf.cache_size = 1 << 20;
+    conf.engine = engine;
+    return conf;
+}
+
+static std::string roundKey(int round, int j)
+{
+    return "k" + std::to_string(round) + "-" + std::to_string(j);
+}
+
+static std::string singleKey(int round)
+{
+    return "s" + std::to_string(round);
+}
+
+/// Batch of round: new keys and marker in every keyspace, every third
+/// round also deletes keys of two rounds before
+static void roundOps(int round, std::vector<std::pair<int, std::string> > &deletes, std::vector<std::pair<int, Model::value_type> > &inserts)
+{
+    for (int s = 0; s < KEYSPACES; s++) {
+	std::string value = "v" + std::to_string(round) + "-" + std::to_string(s) + std::string(20, 'x');
+	for (int j = 0; j < KEYS_PER_ROUND; j++) {
+	    inserts.push_back(std::make_pair(s, Model::value_type(roundKey(round, j), value)));
+	}
+	if (round >= 2 && round % 3 == 0) {
+	    for (int j = 0; j < KEYS_PER_ROUND; j++) {
+		deletes.push_back(std::make_pair(s, roundKey(round - 2, j)));
+	    }
+	}
+	inserts.push_back(std::make_pair(s, Model::value_type("marker", std::to_string(round))));
+    }
+}
+
+/// Keyspaces after batches up to lastBatch and singles before it
+static void buildModel(int lastBatch, Model models[KEYSPACES])
+{
+    for (int round = 0; round <= lastBatch; round++) {
+	std::vector<std::pair<int, std::string> > deletes;
+	std::vector<std::pair<int, Model::value_type> > inserts;
+	roundOps(round, deletes, inserts);
+	for (const std::pair<int, Model::value_type> &op : inserts) {
+	    models[op.first][op.second.first] = op.second.second;
+	}
+	for (const std::pair<int, std::string> &op : deletes) {
+	    models[op.first].erase(op.second);
+	}
+	if (round < lastBatch) {
+	    models[0][singleKey(round)] = "single";
+	}
+    }
+}
+
+static bool openKeyspaces(DB *db, DB *keyspaces[KEYSPACES])
+{
+    keyspaces[0] = db;
+    keyspaces[1] = db_keyspace(db, "second");
+    keyspaces[2] = db_keyspace(db, "third");
+    return keyspaces[1] && keyspaces[2];
+}
+
+/// Closes keyspace handles, then database
+static void closeKeyspaces(DB *keyspaces[KEYSPACES])
+{
+    for (int s = KEYSPACES - 1; s > 0; s--) {
+	if (keyspaces[s]) {
+	    db_close(keyspaces[s]);
+	}
+    }
+    db_close(keyspaces[0]);
+    delete keyspaces[0];
+}
+
+static void runWorkload(int engine)
+{
+    DBC conf = config(engine);
+    DB *db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    if (!db) {
+	_exit(1);
+    }
+    DB *keyspaces[KEYSPACES];
+    if (!openKeyspaces(db, keyspaces)) {
+	_exit(1);
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+	std::vector<std::pair<int, std::string> > deletes;
+	std::vector<std::pair<int, Model::value_type> > inserts;
+	roundOps(round, deletes, inserts);
+
+	std::vector<DBBatchOp> ops;
+	for (std::pair<int, std::string> &op : deletes) {
+	    DBBatchOp o = {keyspaces[op.first], DB_BATCH_DELETE, &op.second[0], op.second.size(), 0, 0};
+	    ops.push_back(o);
+	}
+	for (std::pair<int, Model::value_type> &op : inserts) {
+	    DBBatchOp o = {keyspaces[op.first], DB_BATCH_INSERT, const_cast<char *>(op.second.first.data()),
+		op.second.first.size(), &op.second.second[0], op.second.second.size()};
+	    ops.push_back(o);
+	}
+	if (db_write_batch(db, ops.data(), ops.size())) {
+	    _exit(1);
+	}
+
+	std::string key = singleKey(round);
+	if (db_insert(db, &key[0], key.size(), const_cast<char *>("single"), 6)) {
+	    _exit(1);
+	}
+    }
+    closeKeyspaces(keyspaces);
+}
+
+static int collect(void *arg, const void *key, size_t keyLen, const void *val, size_t valLen)
+{
+    Model *model = static_cast<Model *>(arg);
+    (*model)[std::string(static_cast<const char *>(key), keyLen)] = std::string(static_cast<const char *>(val), valLen);
+    return 0;
+}
+
+static Model scan(DB *db)
+{
+    Model res;
+    db_scan(db, 0, 0, 0, 0, collect, &res);
+    return res;
+}
+
+/// What recovery has to deal with, read from journal before reopen
+struct JournalTail
+{
+    bool isTorn;
+    bool hasUnfinishedBatch;
+    bool hasRootRollback;
+};
+
+static JournalTail inspectJournal()
+{
+    JournalTail tail = {false, false, false};
+    std::string path = std::string(DB_PATH) + ".journal";
+    size_t recordSize = 8 + sizeof(size_t) + PAGE_SIZE;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+	return tail;
+    }
+    struct stat st;
+    fstat(fileno(f), &st);
+    tail.isTorn = st.st_size % recordSize != 0;
+
+    bool hasRoot = false;
+    char type[8];
+    for (off_t offset = 0; offset + static_cast<off_t>(recordSize) <= st.st_size; offset += recordSize) {
+	fseek(f, offset, SEEK_SET);
+	if (fread(type, 1, sizeof(type), f) != sizeof(type)) {
+	    break;
+	}
+	if (!strcmp(type, "COMMIT_") || !strcmp(type, "CHCKPNT")) {
+	    tail.hasUnfinishedBatch = false;
+	    hasRoot = false;
+	} else if (!strcmp(type, "BATCH__")) {
+	    tail.hasUnfinishedBatch = true;
+	} else if (!strcmp(type, "ROOT___")) {
+	    hasRoot = true;
+	}
+    }
+    tail.hasRootRollback = tail.hasUnfinishedBatch && hasRoot;
+    fclose(f);
+    return tail;
+}
+
+static void removeDatabase()
+{
+    unlink(DB_PATH);
+    unlink((std::string(DB_PATH) + ".journal").c_str());
+}
+
+/// Empty database, crash while new file gets its first root isn't checked
+static bool createDatabase(int engine)
+{
+    removeDatabase();
+    DBC conf = config(engine);
+    DB *db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    if (!db) {
+	return false;
+    }
+    DB *keyspaces[KEYSPACES];
+    bool res = openKeyspaces(db, keyspaces);
+    closeKeyspaces(keyspaces);
+    return res;
+}
+
+/// Reopens crashed database, returns number of problems
+static int verify(int engine, long point)
+{
+    DBC conf = config(engine);
+    DB *db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    if (!db) {
+	fprintf(stderr, "crash at %ld: reopen failed\n", point);
+	return 1;
+    }
+    DB *keyspaces[KEYSPACES];
+    if (!openKeyspaces(db, keyspaces)) {
+	fprintf(stderr, "crash at %ld: keyspaces can't be opened\n", point);
+	closeKeyspaces(keyspaces);
+	return 1;
+    }
+
+    Model found[KEYSPACES];
+    for (int s = 0; s < KEYSPACES; s++) {
+	found[s] = scan(keyspaces[s]);
+    }
+    int lastBatch = found[0].count("marker") ? atoi(found[0]["marker"].c_str()) : -1;
+    Model expected[KEYSPACES];
+    buildModel(lastBatch, expected);
+    // Single insert after last batch may have been cut before its record
+    if (lastBatch >= 0 && found[0].count(singleKey(lastBatch))) {
+	expected[0][singleKey(lastBatch)] = "single";
+    }
+
+    int problems = 0;
+    for (int s = 0; s < KEYSPACES; s++) {
+	if (found[s] != expected[s]) {
+	    fprintf(stderr, "crash at %ld: keyspace %d doesn't match batch %d\n", point, s, lastBatch);
+	    problems++;
+	}
+    }
+
+    for (int s = 0; s < KEYSPACES; s++) {
+	if (db_insert(keyspaces[s], const_cast<char *>("after"), 5, const_cast<char *>("crash"), 5)) {
+	    problems++;
+	}
+	expected[s]["after"] = "crash";
+    }
+    closeKeyspaces(keyspaces);
+
+    db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    if (!db) {
+	fprintf(stderr, "crash at %ld: second reopen failed\n", point);
+	return problems + 1;
+    }
+    if (!openKeyspaces(db, keyspaces)) {
+	fprintf(stderr, "crash at %ld: keyspaces can't be reopened\n", point);
+	closeKeyspaces(keyspaces);
+	return problems + 1;
+    }
+    for (int s = 0; s < KEYSPACES; s++) {
+	if (scan(keyspaces[s]) != expected[s]) {
+	    fprintf(stderr, "crash at %ld: keyspace %d changed after reopen\n", point, s);
+	    problems++;
+	}
+    }
+    closeKeyspaces(keyspaces);
+    return problems;
+}
+
+/// Crashes workload at every journal write, returns number of problems
+static int crashEverywhere(int engine, bool torn)
+{
+    int problems = 0;
+    size_t points = 0, tornRecords = 0, droppedBatches = 0, rootRollbacks = 0;
+    for (long point = 0;; point++) {
+	if (!createDatabase(engine)) {
+	    fprintf(stderr, "engine %d: database can't be created\n", engine);
+	    return problems + 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+	    crashAt = point;
+	    tornWrite = torn;
+	    runWorkload(engine);
+	    _exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != CRASH_EXIT)) {
+	    fprintf(stderr, "crash at %ld: workload failed\n", point);
+	    return problems + 1;
+	}
+	if (WEXITSTATUS(status) == 0) {
+	    break; // workload has fewer journal writes
+	}
+
+	JournalTail tail = inspectJournal();
+	points++;
+	tornRecords += tail.isTorn;
+	droppedBatches += tail.hasUnfinishedBatch;
+	rootRollbacks += tail.hasRootRollback;
+	problems += verify(engine, point);
+    }
+    removeDatabase();
+
+    printf("engine %d%s: %zu crash points, %zu torn records, %zu unfinished batches, %zu with root rollback, %d problems\n",
+	engine, torn ? " torn" : "", points, tornRecords, droppedBatches, rootRollbacks, problems);
+    // Workload is built so that every case is hit
+    if ((torn && !tornRecords) || !droppedBatches || !rootRollbacks) {
+	fprintf(stderr, "engine %d: crash points missed a recovery case\n", engine);
+	problems++;
+    }
+    return problems;
+}
+
+/// Failed batch is rolled back in memory and in journal
+static int checkAbortedBatch()
+{
+    if (!createDatabase(DB_ENGINE_BTREE_BUFFERED)) {
+	fprintf(stderr, "aborted batch: database can't be created\n");
+	return 1;
+    }
+    DBC conf = config(DB_ENGINE_BTREE_BUFFERED);
+    DB *db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    Model expected;
+    for (int i = 0; i < 200; i++) {
+	std::string key = "key" + std::to_string(i);
+	db_insert(db, &key[0], key.size(), &key[0], key.size());
+	expected[key] = key;
+    }
+
+    // Key of buffered engine has to fit node page, so the second insert fails
+    std::string key = "batched", value = "lost";
+    std::string huge(2 * PAGE_SIZE, 'k');
+    DBBatchOp ops[2] = {
+	{db, DB_BATCH_INSERT, &key[0], key.size(), &value[0], value.size()},
+	{db, DB_BATCH_INSERT, &huge[0], huge.size(), &value[0], value.size()}
+    };
+    int problems = 0;
+    if (db_write_batch(db, ops, 2) == 0) {
+	fprintf(stderr, "aborted batch: oversized key was taken\n");
+	problems++;
+    }
+    if (scan(db) != expected) {
+	fprintf(stderr, "aborted batch: changes are visible\n");
+	problems++;
+    }
+    db_insert(db, const_cast<char *>("after"), 5, const_cast<char *>("abort"), 5);
+    expected["after"] = "abort";
+    db_close(db);
+    delete db;
+
+    db = dbcreate(const_cast<char *>(DB_PATH), &conf);
+    if (!db || scan(db) != expected) {
+	fprintf(stderr, "aborted batch: reopened database differs\n");
+	problems++;
+    }
+    if (db) {
+	db_close(db);
+	delete db;
+    }
+    removeDatabase();
+
+    printf("aborted batch: %d problems\n", problems);
+    return problems;
+}
+
+int main()
+{
+    int problems = 0;
+    problems += crashEverywhere(DB_ENGINE_BTREE, false);
+    problems += crashEverywhere(DB_ENGINE_BTREE, true);
+    problems += crashEverywhere(DB_ENGINE_BTREE_BUFFERED, true);
+    problems += checkAbortedBatch();
+    return problems != 0;
+}